@@ -103,6 +103,14 @@ mt_db_save() {
     local ref=$(mt_db) wt="$(mt_db_worktree)"
     run git -C "$wt" add -u ||
         error "failed to add current mt-db to the index"
+
+    # Tables newer than the db aren't tracked yet, so add -u skips them.
+    local table
+    for table in splitrev splitrev.index; do
+        [ -f "$MT_DB_SPLIT2MONO_DB/$table" ] || continue
+        run git -C "$wt" add "$MT_DB_SPLIT2MONO_DB/$table" ||
+            error "failed to add $table to the index"
+    done
     local new old
     new=$(run git -C "$wt" write-tree) ||
         error "failed to write new tree for $ref"
@@ -152,6 +160,8 @@ mt_db_upstream_impl() {
             error "could not update split2mono from '$upstream'"
         run cp "$usvn2gitdb" "$MT_DB_SVN2GIT_DB" ||
             error "could not update svn2git from '$upstream'"
+        run "$svn2git" reindex "$MT_DB_SVN2GIT_DB" ||
+            error "could not reindex svn2git from '$upstream'"
     else
         # Check for things to do in the merge.
         run --hide-errors "$split2mono" check-upstream \
@@ -8,7 +8,7 @@ sources := $(wildcard $S*.cpp)
 programs := $(patsubst $S%.cpp,$D/%,$(sources))
 
 $(programs): $D/%: $S%.cpp $(headers) $SPrograms.mk
-	mkdir -p "$(@D)" && clang++ -O2 -std=c++17 -fno-exceptions -fno-rtti -lc++ -Wall -Wextra -o "$@" $<
+	mkdir -p "$(@D)" && clang++ -O2 -std=c++17 -fno-exceptions -fno-rtti -lc++ -Wall -Wextra $(if $(MAX_DIRS),-DMT_MAX_DIRS=$(MAX_DIRS)) -o "$@" $<
 
 .PHONY: programs clean-programs
 programs: $(programs) ;
@@ -3,30 +3,79 @@
 #pragma once
 
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <memory>
+#include <sys/mman.h>
+#include <unistd.h>
 #include <vector>
 
 namespace {
 struct bump_allocator {
   struct deleter {
-    void operator()(void *mem) const { free(mem); }
+    size_t mapped_size = 0;
+    void operator()(void *mem) const {
+      if (!mapped_size) {
+        free(mem);
+        return;
+      }
+      int status = munmap(mem, mapped_size);
+      assert(!status && "failed to unmap slab");
+      (void)status;
+    }
   };
   std::vector<std::unique_ptr<void, deleter>> slabs;
   char *next_byte = nullptr;
   char *last_byte = nullptr;
   static constexpr const size_t slab_size = 4096 << 3;
+  static constexpr const size_t huge_page_size = 2u << 20;
+
+  // Configuration.  Change these before the first allocation.
+  size_t initial_slab_size = slab_size;
+  size_t max_slab_size = slab_size << 27;
+  bool should_mmap = false;
+
+  // Statistics.  Bytes used are handed out to callers; bytes wasted are lost
+  // to alignment and to the unused tails of abandoned slabs.
+  size_t num_bytes_used = 0;
+  size_t num_bytes_wasted = 0;
+  size_t num_bytes_reserved = 0;
 
   bump_allocator() = default;
   bump_allocator(const bump_allocator &) = delete;
 
+  /// Back slabs with anonymous mmap, aligned and advised for transparent huge
+  /// pages where the platform supports it.  Slabs start at one huge page.
+  void use_huge_pages() {
+    assert(slabs.empty());
+    should_mmap = true;
+    if (initial_slab_size < huge_page_size)
+      initial_slab_size = huge_page_size;
+    if (max_slab_size < initial_slab_size)
+      max_slab_size = initial_slab_size;
+  }
+  void set_slab_sizes(size_t initial, size_t max) {
+    assert(slabs.empty());
+    assert(initial <= max);
+    initial_slab_size = initial;
+    max_slab_size = max;
+  }
+
   template <typename T> void *allocate(size_t num = 1) {
     return allocate(num * sizeof(T), alignof(T));
   }
 
   void *allocate(size_t size, size_t alignment);
-  void add_slab();
+  void add_slab(size_t min_size);
+  void *allocate_dedicated_slab(size_t size);
+
+  void print_stats(FILE *file, const char *name) const;
   static uintptr_t align(const void *x, size_t alignment);
+
+private:
+  /// Allocate a slab of at least \a size bytes, updating \a size to what was
+  /// actually reserved.
+  void *allocate_slab(size_t &size, deleter &d);
 };
 } // end namespace
 
@@ -37,28 +86,93 @@ uintptr_t bump_allocator::align(const void *x, size_t alignment) {
 void *bump_allocator::allocate(size_t size, size_t alignment) {
   // this is not general purpose; lots of corner cases are NOT handled.
   assert(alignment <= 16);
-  assert(size <= slab_size / 2);
 
   size_t adjust = align(next_byte, alignment) - (uintptr_t)next_byte;
   assert(adjust + size >= size);
   if (adjust + size <= size_t(last_byte - next_byte)) {
     char *aligned = next_byte + adjust;
     next_byte = aligned + size;
+    num_bytes_used += size;
+    num_bytes_wasted += adjust;
     return aligned;
   }
-  add_slab();
+
+  // Give big allocations their own slab, leaving the current one alone.
+  if (size > initial_slab_size / 2)
+    return allocate_dedicated_slab(size);
+
+  add_slab(size);
   return allocate(size, alignment);
 }
 
-void bump_allocator::add_slab() {
-  size_t new_slab_size = slab_size;
+void *bump_allocator::allocate_slab(size_t &size, deleter &d) {
+  if (!should_mmap)
+    return malloc(size);
+
+  // Round up to whole pages, since only those can be unmapped.
+  static const size_t page_size = sysconf(_SC_PAGESIZE);
+  size = (size + page_size - 1) & ~(page_size - 1);
+
+  // Over-allocate so the slab can be aligned to a huge page, then trim.
+  size_t mapped_size = size + huge_page_size;
+  char *mem = (char *)mmap(nullptr, mapped_size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANON, -1, 0);
+  if (mem == MAP_FAILED)
+    return malloc(size);
+  char *aligned = (char *)align(mem, huge_page_size);
+  char *tail = aligned + size;
+  if ((aligned != mem && munmap(mem, aligned - mem)) ||
+      (tail != mem + mapped_size && munmap(tail, mem + mapped_size - tail))) {
+    // Couldn't trim; give up on this mapping rather than leak part of it.
+    munmap(mem, mapped_size);
+    return malloc(size);
+  }
+#ifdef MADV_HUGEPAGE
+  madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+  d.mapped_size = size;
+  return aligned;
+}
+
+void bump_allocator::add_slab(size_t min_size) {
+  size_t new_slab_size = initial_slab_size;
   if (unsigned scale = slabs.size() / 128)
-    new_slab_size *= 1 << (scale > 27 ? 27 : scale);
-  slabs.emplace_back(malloc(new_slab_size));
-  next_byte = (char *)slabs.back().get();
+    new_slab_size <<= scale > 27 ? 27 : scale;
+  if (new_slab_size > max_slab_size)
+    new_slab_size = max_slab_size;
+  if (new_slab_size < min_size)
+    new_slab_size = min_size;
+  if (should_mmap)
+    new_slab_size =
+        (new_slab_size + huge_page_size - 1) & ~(huge_page_size - 1);
+
+  deleter d;
+  void *mem = allocate_slab(new_slab_size, d);
+  slabs.emplace_back(mem, d);
+  num_bytes_wasted += last_byte - next_byte;
+  num_bytes_reserved += new_slab_size;
+  next_byte = (char *)mem;
   last_byte = next_byte + new_slab_size;
 }
 
+void *bump_allocator::allocate_dedicated_slab(size_t size) {
+  deleter d;
+  size_t reserved = size;
+  void *mem = allocate_slab(reserved, d);
+  slabs.emplace_back(mem, d);
+  num_bytes_used += size;
+  num_bytes_wasted += reserved - size;
+  num_bytes_reserved += reserved;
+  return mem;
+}
+
+void bump_allocator::print_stats(FILE *file, const char *name) const {
+  fprintf(file,
+          "alloc: %-26s slabs=%zu reserved=%zu used=%zu wasted=%zu%s\n",
+          name, slabs.size(), num_bytes_reserved, num_bytes_used,
+          num_bytes_wasted, should_mmap ? " mmap" : "");
+}
+
 void *operator new(size_t size, bump_allocator &alloc) {
   struct S {
     char c;
@@ -0,0 +1,370 @@
+// cache_snapshot.h
+#pragma once
+
+#include "error.h"
+#include "mmapped_file.h"
+#include "sha1convert.h"
+#include <algorithm>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace {
+/// A read-only snapshot of what git_cache learned from git in an earlier run.
+///
+/// The file is mmapped and used in place.  Everything in it is addressed by
+/// offset or index, so it can be mapped anywhere.  Records refer to sha1s by
+/// their index in a sorted sha1 table (with a 256-entry fanout), and each
+/// record table is sorted by its key so lookups are binary searches.  The
+/// header has a checksum of the rest of the file, which is validated on load.
+///
+/// Since git objects are immutable, the facts stored here (commit to tree,
+/// tree to items, commit to metadata, and monorepo commit to base rev) do not
+/// go stale.  Split commits' revs can depend on the database, so they aren't
+/// stored.
+struct cache_snapshot {
+  enum section_id {
+    fanout_section,
+    sha1s_section,
+    commit_trees_section,
+    revs_section,
+    trees_section,
+    tree_items_section,
+    metadata_section,
+    names_section,
+    text_section,
+    num_sections,
+  };
+  struct section_type {
+    uint64_t offset = 0;
+    uint64_t count = 0;
+  };
+  struct header_type {
+    unsigned char magic[8];
+    uint32_t version = 0;
+    uint32_t reserved = 0;
+    uint64_t checksum = 0;
+    section_type sections[num_sections];
+  };
+
+  static constexpr const uint32_t no_sha1 = UINT32_MAX;
+  struct commit_tree_record {
+    uint32_t commit;
+    uint32_t tree;
+  };
+  struct rev_record {
+    uint32_t commit;
+    int32_t rev;
+  };
+  struct tree_record {
+    uint32_t tree;
+    uint32_t first_item;
+    uint32_t num_items;
+  };
+  struct tree_item_record {
+    uint32_t sha1;
+    uint32_t name;
+    uint32_t type;
+  };
+  struct metadata_record {
+    uint32_t commit;
+    uint32_t first_parent;
+    uint32_t is_merge;
+    uint32_t text;
+  };
+
+  static const unsigned char *get_magic() {
+    static const unsigned char magic[] = {'s', 2,   'm', 0xc,
+                                          0xa, 0xc, 'h', 'e'};
+    return magic;
+  }
+  static constexpr const uint32_t current_version = 2;
+
+  mmapped_file file;
+  const header_type *header = nullptr;
+
+  bool empty() const { return !header; }
+  int load(const char *path);
+
+  template <class T> const T *get_section(section_id id) const {
+    return reinterpret_cast<const T *>(file.bytes +
+                                       header->sections[id].offset);
+  }
+  size_t get_count(section_id id) const {
+    return header->sections[id].count;
+  }
+
+  const binary_sha1 &get_sha1(uint32_t index) const {
+    assert(index < get_count(sha1s_section));
+    return get_section<binary_sha1>(sha1s_section)[index];
+  }
+  const char *get_name(uint32_t offset) const {
+    return get_section<char>(names_section) + offset;
+  }
+  const char *get_text(uint32_t offset) const {
+    return get_section<char>(text_section) + offset;
+  }
+
+  bool find_sha1(const binary_sha1 &sha1, uint32_t &index) const;
+  template <class T>
+  const T *find_record(section_id id, const binary_sha1 &key) const;
+
+  static uint64_t compute_checksum(const char *bytes, size_t size);
+};
+
+/// Collects records keyed by sha1s, then writes them out as a snapshot.
+struct cache_snapshot_builder {
+  std::vector<binary_sha1> sha1s;
+  std::vector<cache_snapshot::commit_tree_record> commit_trees;
+  std::vector<cache_snapshot::rev_record> revs;
+  std::vector<cache_snapshot::tree_record> trees;
+  std::vector<cache_snapshot::tree_item_record> tree_items;
+  std::vector<cache_snapshot::metadata_record> metadata;
+  std::string names;
+  std::string text;
+  std::map<std::string, uint32_t> name_offsets;
+
+  uint32_t add_sha1(const binary_sha1 &sha1) {
+    sha1s.push_back(sha1);
+    return sha1s.size() - 1;
+  }
+  uint32_t add_name(const char *name);
+
+  void add_commit_tree(const binary_sha1 &commit, const binary_sha1 &tree) {
+    commit_trees.push_back({add_sha1(commit), add_sha1(tree)});
+  }
+  void add_rev(const binary_sha1 &commit, int rev) {
+    revs.push_back({add_sha1(commit), rev});
+  }
+  void start_tree(const binary_sha1 &tree) {
+    trees.push_back({add_sha1(tree), uint32_t(tree_items.size()), 0});
+  }
+  void add_tree_item(const binary_sha1 &sha1, const char *name, int type) {
+    tree_items.push_back({add_sha1(sha1), add_name(name), uint32_t(type)});
+    ++trees.back().num_items;
+  }
+  void add_metadata(const binary_sha1 &commit, const char *metadata,
+                    bool is_merge, const binary_sha1 *first_parent);
+
+  int write(const char *path);
+};
+} // end namespace
+
+uint64_t cache_snapshot::compute_checksum(const char *bytes, size_t size) {
+  // Not cryptographic; this is for catching truncated or corrupted files.
+  uint64_t hash = 0xcbf29ce484222325ull ^ size;
+  auto mix = [&hash](uint64_t word) {
+    hash ^= word;
+    hash *= 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 29;
+  };
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, bytes + i, 8);
+    mix(word);
+  }
+  uint64_t tail = 0;
+  memcpy(&tail, bytes + i, size - i);
+  mix(tail);
+  return hash;
+}
+
+int cache_snapshot::load(const char *path) {
+  header = nullptr;
+  int fd = open(path, O_RDONLY);
+  if (fd == -1)
+    return 1;
+  if (file.init(fd))
+    return error("cache: could not mmap '" + std::string(path) + "'");
+  if (file.num_bytes < (long)sizeof(header_type))
+    return error("cache: '" + std::string(path) + "' is truncated");
+
+  auto *h = reinterpret_cast<const header_type *>(file.bytes);
+  if (memcmp(h->magic, get_magic(), sizeof(h->magic)))
+    return error("cache: '" + std::string(path) + "' has bad magic");
+  if (h->version != current_version)
+    return error("cache: '" + std::string(path) + "' has unknown version");
+  if (h->checksum != compute_checksum(file.bytes + sizeof(header_type),
+                                      file.num_bytes - sizeof(header_type)))
+    return error("cache: '" + std::string(path) + "' has bad checksum");
+
+  const size_t sizes[num_sections] = {
+      sizeof(uint32_t),         sizeof(binary_sha1),
+      sizeof(commit_tree_record), sizeof(rev_record),
+      sizeof(tree_record),      sizeof(tree_item_record),
+      sizeof(metadata_record),  1,
+      1,
+  };
+  for (int i = 0; i < num_sections; ++i) {
+    const section_type &s = h->sections[i];
+    if (s.offset < sizeof(header_type) || s.offset > uint64_t(file.num_bytes) ||
+        s.count > (file.num_bytes - s.offset) / sizes[i])
+      return error("cache: '" + std::string(path) + "' has a bad section");
+  }
+  if (h->sections[fanout_section].count != 257)
+    return error("cache: '" + std::string(path) + "' has a bad fanout");
+  for (section_id id : {names_section, text_section})
+    if (size_t count = h->sections[id].count)
+      if (file.bytes[h->sections[id].offset + count - 1])
+        return error("cache: '" + std::string(path) +
+                     "' has unterminated strings");
+
+  header = h;
+  return 0;
+}
+
+bool cache_snapshot::find_sha1(const binary_sha1 &sha1,
+                               uint32_t &index) const {
+  if (!header)
+    return false;
+  const uint32_t *fanout = get_section<uint32_t>(fanout_section);
+  const binary_sha1 *first = get_section<binary_sha1>(sha1s_section);
+  const binary_sha1 *last = first + fanout[sha1.bytes[0] + 1];
+  first += fanout[sha1.bytes[0]];
+  auto *found = std::lower_bound(
+      first, last, sha1, [](const binary_sha1 &lhs, const binary_sha1 &rhs) {
+        return memcmp(lhs.bytes, rhs.bytes, 20) < 0;
+      });
+  if (found == last || !(*found == sha1))
+    return false;
+  index = found - get_section<binary_sha1>(sha1s_section);
+  return true;
+}
+
+template <class T>
+const T *cache_snapshot::find_record(section_id id,
+                                     const binary_sha1 &key) const {
+  uint32_t index;
+  if (!find_sha1(key, index))
+    return nullptr;
+
+  // Every record type starts with its key.
+  const T *first = get_section<T>(id);
+  const T *last = first + get_count(id);
+  auto *found = std::lower_bound(first, last, index,
+                                 [](const T &record, uint32_t index) {
+                                   uint32_t key;
+                                   memcpy(&key, &record, sizeof(key));
+                                   return key < index;
+                                 });
+  if (found == last)
+    return nullptr;
+  uint32_t found_key;
+  memcpy(&found_key, found, sizeof(found_key));
+  return found_key == index ? found : nullptr;
+}
+
+uint32_t cache_snapshot_builder::add_name(const char *name) {
+  auto inserted = name_offsets.emplace(name, names.size());
+  if (inserted.second) {
+    names += name;
+    names += '\0';
+  }
+  return inserted.first->second;
+}
+
+void cache_snapshot_builder::add_metadata(const binary_sha1 &commit,
+                                          const char *metadata, bool is_merge,
+                                          const binary_sha1 *first_parent) {
+  cache_snapshot::metadata_record record;
+  record.commit = add_sha1(commit);
+  record.first_parent =
+      first_parent ? add_sha1(*first_parent) : cache_snapshot::no_sha1;
+  record.is_merge = is_merge;
+  record.text = text.size();
+  text += metadata;
+  text += '\0';
+  this->metadata.push_back(record);
+}
+
+int cache_snapshot_builder::write(const char *path) {
+  // Sort and unique the sha1s, and remap everything that refers to them.
+  std::vector<uint32_t> order(sha1s.size());
+  for (uint32_t i = 0; i != order.size(); ++i)
+    order[i] = i;
+  std::sort(order.begin(), order.end(), [&](uint32_t lhs, uint32_t rhs) {
+    return memcmp(sha1s[lhs].bytes, sha1s[rhs].bytes, 20) < 0;
+  });
+  std::vector<uint32_t> remap(sha1s.size());
+  std::vector<binary_sha1> sorted;
+  sorted.reserve(sha1s.size());
+  for (uint32_t i : order) {
+    if (sorted.empty() || !(sorted.back() == sha1s[i]))
+      sorted.push_back(sha1s[i]);
+    remap[i] = sorted.size() - 1;
+  }
+  uint32_t fanout[257] = {0};
+  for (auto &sha1 : sorted)
+    ++fanout[sha1.bytes[0] + 1];
+  for (int i = 1; i < 257; ++i)
+    fanout[i] += fanout[i - 1];
+
+  auto by_key = [](const auto &lhs, const auto &rhs) {
+    uint32_t lkey, rkey;
+    memcpy(&lkey, &lhs, sizeof(lkey));
+    memcpy(&rkey, &rhs, sizeof(rkey));
+    return lkey < rkey;
+  };
+  for (auto &r : commit_trees)
+    r.commit = remap[r.commit], r.tree = remap[r.tree];
+  for (auto &r : revs)
+    r.commit = remap[r.commit];
+  for (auto &r : trees)
+    r.tree = remap[r.tree];
+  for (auto &r : tree_items)
+    r.sha1 = remap[r.sha1];
+  for (auto &r : metadata) {
+    r.commit = remap[r.commit];
+    if (r.first_parent != cache_snapshot::no_sha1)
+      r.first_parent = remap[r.first_parent];
+  }
+  std::stable_sort(commit_trees.begin(), commit_trees.end(), by_key);
+  std::stable_sort(revs.begin(), revs.end(), by_key);
+  std::stable_sort(trees.begin(), trees.end(), by_key);
+  std::stable_sort(metadata.begin(), metadata.end(), by_key);
+
+  // Lay out the file.
+  std::string bytes(sizeof(cache_snapshot::header_type), '\0');
+  cache_snapshot::header_type header;
+  memcpy(header.magic, cache_snapshot::get_magic(), sizeof(header.magic));
+  header.version = cache_snapshot::current_version;
+  auto add_section = [&](cache_snapshot::section_id id, const void *data,
+                         size_t count, size_t size) {
+    bytes.resize((bytes.size() + 7) & ~size_t(7));
+    header.sections[id].offset = bytes.size();
+    header.sections[id].count = count;
+    bytes.append(reinterpret_cast<const char *>(data), count * size);
+  };
+#define ADD_SECTION(ID, VECTOR)                                                \
+  add_section(cache_snapshot::ID, VECTOR.data(), VECTOR.size(),                \
+              sizeof(VECTOR[0]))
+  add_section(cache_snapshot::fanout_section, fanout, 257, sizeof(fanout[0]));
+  ADD_SECTION(sha1s_section, sorted);
+  ADD_SECTION(commit_trees_section, commit_trees);
+  ADD_SECTION(revs_section, revs);
+  ADD_SECTION(trees_section, trees);
+  ADD_SECTION(tree_items_section, tree_items);
+  ADD_SECTION(metadata_section, metadata);
+  ADD_SECTION(names_section, names);
+  ADD_SECTION(text_section, text);
+#undef ADD_SECTION
+  header.checksum = cache_snapshot::compute_checksum(
+      bytes.data() + sizeof(header), bytes.size() - sizeof(header));
+  memcpy(&bytes[0], &header, sizeof(header));
+
+  // Write to a temporary and rename, so that a reader (including an older
+  // mapping of this same file) never sees a partial write.
+  std::string tmp = std::string(path) + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "wb");
+  if (!out)
+    return error("cache: could not open '" + tmp + "'");
+  bool failed = fwrite(bytes.data(), 1, bytes.size(), out) != bytes.size();
+  failed |= fclose(out) != 0;
+  if (failed || rename(tmp.c_str(), path)) {
+    unlink(tmp.c_str());
+    return error("cache: could not write '" + std::string(path) + "'");
+  }
+  return 0;
+}
@@ -2,28 +2,51 @@
 #pragma once
 
 #include "error.h"
+#include "git_exchange_log.h"
+#include "git_stats.h"
 #include "read_all.h"
+#include "trace_events.h"
 #include <cassert>
 #include <cstdio>
+#include <csignal>
+#include <fcntl.h>
 #include <mutex>
+#include <poll.h>
 #include <spawn.h>
 #include <string>
 #include <sys/errno.h>
+#include <sys/socket.h>
+#include <thread>
 #include <unistd.h>
 #include <vector>
 
-static int call_git_impl(char *argv[], char *envp[], const std::string &input,
-                         std::vector<char> &reply, bool ignore_errors) {
-  reply.clear();
+/// Returned by a reply reader that has everything it needs before git is
+/// done.  Git is terminated instead of being left to finish.
+static constexpr const int call_git_stop_reading = 2;
 
-  static bool once = false;
-  static bool trace_git = false;
+/// Git is spawned from several threads at once.  Spawn one at a time, and
+/// keep our ends of pipes from leaking into other children, or a git could
+/// wait forever on a pipe that another git is holding open.
+static std::mutex &call_git_spawn_mutex() {
+  static std::mutex spawn_mutex;
+  return spawn_mutex;
+}
+
+/// Spawn git with \a argv and hand the read end of its stdout to
+/// \a read_reply, which is called with \a context and must read until EOF,
+/// fail, or return call_git_stop_reading.  If git exits, its exit status is
+/// stored in \a exit_status.
+static int call_git_impl(char *argv[], char *envp[], const std::string &input,
+                         int (*read_reply)(void *context, int fd),
+                         void *context, bool ignore_errors,
+                         int *exit_status = nullptr) {
+  // Function-local statics are initialized exactly once, even when several
+  // threads get here first at the same time.
+  static const bool trace_git = []() {
+    const char *var = getenv("MT_TRACE_GIT");
+    return var && strcmp(var, "0");
+  }();
   static std::mutex tracing_mutex;
-  if (!once) {
-    once = true;
-    if (const char *var = getenv("MT_TRACE_GIT"))
-      trace_git = strcmp(var, "0");
-  }
 
   struct cleanup {
     posix_spawn_file_actions_t *file_actions = nullptr;
@@ -46,6 +69,15 @@ static int call_git_impl(char *argv[], char *envp[], const std::string &input,
   if (!envp)
     envp = default_envp;
 
+  // Name the event after the subcommand, with the rest of the command line
+  // as its detail.
+  trace_scope scope("git", argv[1] ? argv[1] : argv[0]);
+  if (scope.is_enabled())
+    for (char **x = argv + 1; *x; ++x)
+      scope.detail += (x == argv + 1 ? "" : " ") + std::string(*x);
+  git_call_stats stats(argv[1]);
+  stats.bytes_written = input.size();
+
   if (trace_git) {
     std::lock_guard<std::mutex> lock(tracing_mutex);
     fprintf(stderr, "#");
@@ -57,6 +89,8 @@ static int call_git_impl(char *argv[], char *envp[], const std::string &input,
     fflush(stderr);
   }
 
+  std::unique_lock<std::mutex> spawn_lock(call_git_spawn_mutex());
+
   bool needs_to_write = !input.empty();
   if (pipe(fromgit) || posix_spawn_file_actions_init(&file_actions) ||
       cleanup.set(file_actions) ||
@@ -76,8 +110,13 @@ static int call_git_impl(char *argv[], char *envp[], const std::string &input,
   failed |= close(fromgit[1]);
   if (needs_to_write)
     failed |= close(togit[0]);
+  failed |= fcntl(fromgit[0], F_SETFD, FD_CLOEXEC) == -1;
+  if (needs_to_write)
+    failed |= fcntl(togit[1], F_SETFD, FD_CLOEXEC) == -1;
   if (failed)
     return error("call-git: failed to close pipe(s) to git");
+  spawn_lock.unlock();
+  stats.note_spawned();
 
   auto write_all = [&](int fd) {
     size_t next_byte = 0;
@@ -100,7 +139,18 @@ static int call_git_impl(char *argv[], char *envp[], const std::string &input,
   if (needs_to_write)
     if (write_all(togit[1]) || close(togit[1]))
       return error("call-git: failed to read output");
-  if (read_all(fromgit[0], reply) || close(fromgit[0]))
+  if (int read_status = read_reply(context, fromgit[0])) {
+    // Stop git, in case it's busy walking without writing, and reap it.
+    close(fromgit[0]);
+    kill(pid, SIGTERM);
+    int status;
+    while (wait4(pid, &status, 0, nullptr) == -1 && errno == EINTR)
+      continue;
+    if (read_status == call_git_stop_reading)
+      return 0;
+    return error("call-git: failed to read output");
+  }
+  if (close(fromgit[0]))
     return error("call-git: failed to read output");
 
   int interrupts = 0;
@@ -123,9 +173,11 @@ static int call_git_impl(char *argv[], char *envp[], const std::string &input,
                  std::to_string(WTERMSIG(status)));
   if (!WIFEXITED(status))
     return error("call-git: git stopped, but we're done");
-  if (int exit_status = WEXITSTATUS(status))
+  if (exit_status)
+    *exit_status = WEXITSTATUS(status);
+  if (WEXITSTATUS(status))
     return ignore_errors || error("call-git: git exited with status " +
-                                  std::to_string(exit_status));
+                                  std::to_string(WEXITSTATUS(status)));
 
   return 0;
 }
@@ -133,24 +185,183 @@ static int call_git_impl(char *argv[], char *envp[], const std::string &input,
 template <class T> static void call_lambda(void *lambda) {
   (*reinterpret_cast<T *>(lambda))();
 }
-static int call_git(char *argv[], char *envp[], const std::string &input,
-                    std::vector<char> &reply, bool ignore_errors = false) {
+template <class T> static int call_reader_lambda(void *lambda, int fd) {
+  return (*reinterpret_cast<T *>(lambda))(fd);
+}
+
+/// Answer a call to git from MT_GIT_REPLAY.
+static int call_git_replay(char *argv[], char *envp[],
+                           const std::string &input,
+                           int (*read_reply)(void *context, int fd),
+                           void *context, bool ignore_errors) {
+  git_exchange_log::exchange_type exchange;
+  if (git_exchange_log::get().replay(
+          git_exchange_log::make_key(argv, envp, input), exchange))
+    return 1;
+
+  // Hand the reader a file, since it only knows how to read.
+  FILE *file = tmpfile();
+  if (!file ||
+      fwrite(exchange.output.data(), 1, exchange.output.size(), file) !=
+          exchange.output.size() ||
+      fflush(file) || lseek(fileno(file), 0, SEEK_SET) == -1) {
+    if (file)
+      fclose(file);
+    return error("call-git: failed to replay output");
+  }
+  int read_status = read_reply(context, fileno(file));
+  fclose(file);
+  if (read_status == call_git_stop_reading)
+    return 0;
+  if (read_status)
+    return error("call-git: failed to read output");
+  if (exchange.exit_status == -1)
+    return error("call-git: git failed when recorded");
+  if (exchange.exit_status)
+    return ignore_errors || error("call-git: git exited with status " +
+                                  std::to_string(exchange.exit_status));
+  return 0;
+}
+
+/// Sit between git and the reader for MT_GIT_RECORD, keeping a copy of
+/// everything git writes.
+struct call_git_recorder {
+  int (*read_reply)(void *context, int fd);
+  void *context;
+  std::string output;
+  int read_status = 0;
+  bool was_read = false;
+
+  static int read(void *context, int fd);
+};
+
+int call_git_recorder::read(void *context, int fd) {
+  auto &self = *static_cast<call_git_recorder *>(context);
+  self.was_read = true;
+
+  int sockets[2];
+  {
+    std::lock_guard<std::mutex> lock(call_git_spawn_mutex());
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, sockets))
+      return error("call-git: failed to record output");
+    if (fcntl(sockets[0], F_SETFD, FD_CLOEXEC) == -1 ||
+        fcntl(sockets[1], F_SETFD, FD_CLOEXEC) == -1) {
+      close(sockets[0]);
+      close(sockets[1]);
+      return error("call-git: failed to record output");
+    }
+  }
+#ifdef SO_NOSIGPIPE
+  int no_sigpipe = 1;
+  setsockopt(sockets[0], SOL_SOCKET, SO_NOSIGPIPE, &no_sigpipe,
+             sizeof(no_sigpipe));
+#endif
+#ifdef MSG_NOSIGNAL
+  const int send_flags = MSG_NOSIGNAL;
+#else
+  const int send_flags = 0;
+#endif
+
+  // Copy on a thread, so that the reader still sees the output as git writes
+  // it.  Stop copying once the reader hangs up.
+  std::thread copier([&]() {
+    pollfd fds[2] = {{fd, POLLIN, 0}, {sockets[0], 0, 0}};
+    char buffer[1 << 16];
+    bool has_reader = true;
+    while (has_reader) {
+      if (poll(fds, 2, -1) == -1) {
+        if (errno == EINTR)
+          continue;
+        break;
+      }
+      if (fds[1].revents)
+        break;
+      ssize_t num_bytes = ::read(fd, buffer, sizeof(buffer));
+      if (num_bytes == -1 && errno == EINTR)
+        continue;
+      if (num_bytes <= 0)
+        break;
+      self.output.append(buffer, num_bytes);
+      for (ssize_t sent = 0; sent < num_bytes;) {
+        ssize_t num_sent =
+            send(sockets[0], buffer + sent, num_bytes - sent, send_flags);
+        if (num_sent == -1 && errno == EINTR)
+          continue;
+        if (num_sent == -1) {
+          has_reader = false;
+          break;
+        }
+        sent += num_sent;
+      }
+    }
+    close(sockets[0]);
+  });
+  self.read_status = self.read_reply(self.context, sockets[1]);
+  close(sockets[1]);
+  copier.join();
+  return self.read_status;
+}
+
+/// Call git for MT_GIT_RECORD and record the exchange.
+static int call_git_record(char *argv[], char *envp[],
+                           const std::string &input,
+                           int (*read_reply)(void *context, int fd),
+                           void *context, bool ignore_errors) {
+  call_git_recorder recorder;
+  recorder.read_reply = read_reply;
+  recorder.context = context;
+  int exit_status = -1;
+  int status = call_git_impl(argv, envp, input, call_git_recorder::read,
+                             &recorder, ignore_errors, &exit_status);
+  if (!recorder.was_read)
+    return status;
+
+  // Git was stopped, but replaying will stop the reader in the same place.
+  if (recorder.read_status == call_git_stop_reading)
+    exit_status = 0;
+  git_exchange_log::get().record(git_exchange_log::make_key(argv, envp, input),
+                                 recorder.output, exit_status);
+  return status;
+}
+
+/// Scrape the full path to git from 'git --exec-path'.  Returns an empty
+/// string on failure.
+static std::string call_git_find_executable() {
+  const char *git_argv[] = {"git", "--exec-path", nullptr};
+  char *git_envp[] = {nullptr};
+  std::vector<char> reply;
+  auto read_exec_path = [&reply](int fd) { return read_all(fd, reply); };
+  if (call_git_impl(const_cast<char **>(git_argv), git_envp, "",
+                    call_reader_lambda<decltype(read_exec_path)>,
+                    &read_exec_path, /*ignore_errors=*/false) ||
+      reply.empty() || reply.back() != '\n') {
+    error("call-git: failed to scrape git --exec-path");
+    return std::string();
+  }
+  return std::string(reply.begin(), reply.end() - 1) + "/git";
+}
+
+/// The full path to git, found the first time any thread asks.
+static const std::string &call_git_executable() {
+  static const std::string git = call_git_find_executable();
+  return git;
+}
+
+static int call_git_with_reader(char *argv[], char *envp[],
+                                const std::string &input,
+                                int (*read_reply)(void *context, int fd),
+                                void *context, bool ignore_errors) {
   if (argv && strcmp(argv[0], "git"))
     return error("wrong git executable");
 
-  static std::string git;
-  if (git.empty()) {
-    const char *git_argv[] = {"git", "--exec-path", nullptr};
-    char *git_envp[] = {nullptr};
-    if (call_git_impl(const_cast<char **>(git_argv), git_envp, input, reply,
-                      /*ignore_errors=*/false) ||
-        reply.empty() || reply.back() != '\n')
-      return error("call-git: failed to scrape git --exec-path");
-    git.reserve(reply.size() + sizeof("/git") - 1);
-    git.assign(reply.begin(), reply.end() - 1);
-    git += "/git";
-    reply.clear();
-  };
+  // Git isn't needed at all when replaying.
+  auto &exchange_log = git_exchange_log::get();
+  if (exchange_log.is_replaying)
+    return argv ? call_git_replay(argv, envp, input, read_reply, context,
+                                  ignore_errors)
+                : 0;
+
+  const std::string &git = call_git_executable();
   if (git.empty())
     return 1;
 
@@ -160,11 +371,41 @@ static int call_git(char *argv[], char *envp[], const std::string &input,
   // Do a dance to keep the check above working.
   const char *original = argv[0];
   argv[0] = const_cast<char *>(git.c_str());
-  int status = call_git_impl(argv, envp, input, reply, ignore_errors);
+  int status = exchange_log.is_recording
+                   ? call_git_record(argv, envp, input, read_reply, context,
+                                     ignore_errors)
+                   : call_git_impl(argv, envp, input, read_reply, context,
+                                   ignore_errors);
   argv[0] = const_cast<char *>(original);
   return status;
 }
 
+static int call_git(char *argv[], char *envp[], const std::string &input,
+                    std::vector<char> &reply, bool ignore_errors = false) {
+  reply.clear();
+  auto read_reply = [&reply](int fd) {
+    int status = read_all(fd, reply);
+    git_stats::note_bytes_read(reply.size());
+    return status;
+  };
+  return call_git_with_reader(argv, envp, input,
+                              call_reader_lambda<decltype(read_reply)>,
+                              &read_reply, ignore_errors);
+}
+
+/// Like call_git, but instead of collecting the whole reply, hand the pipe to
+/// \a read_reply as soon as git starts, so that parsing overlaps with git's
+/// work.  \a read_reply takes the file descriptor and returns non-zero on
+/// failure, or call_git_stop_reading to stop git early.
+template <class F>
+static int call_git_streaming(const char *argv[], const char *envp[],
+                              F read_reply, bool ignore_errors = false) {
+  return call_git_with_reader(const_cast<char **>(argv),
+                              const_cast<char **>(envp), "",
+                              call_reader_lambda<F>, &read_reply,
+                              ignore_errors);
+}
+
 static int call_git_init() {
   std::vector<char> reply;
   return call_git(nullptr, nullptr, "", reply);
@@ -176,3 +417,56 @@ static int call_git(const char *argv[], const char *envp[],
   return call_git(const_cast<char **>(argv), const_cast<char **>(envp), input,
                   reply, ignore_errors);
 }
+
+/// Spawn a long-lived git, such as 'git cat-file --batch', that answers
+/// requests on \a to_git one at a time on \a from_git.  The caller owns both
+/// ends and reaps \a pid.  These bypass MT_GIT_RECORD and MT_GIT_REPLAY.
+static int call_git_spawn_process(const char *argv[], pid_t &pid, int &to_git,
+                                  int &from_git) {
+  if (strcmp(argv[0], "git"))
+    return error("wrong git executable");
+  if (call_git_init() || call_git_executable().empty())
+    return error("call-git: failed to find git");
+
+  std::vector<const char *> args(argv, argv + 1);
+  args[0] = call_git_executable().c_str();
+  for (const char **x = argv + 1; *x; ++x)
+    args.push_back(*x);
+  args.push_back(nullptr);
+
+  int fromgit[2];
+  int togit[2];
+  char *envp[] = {nullptr};
+  posix_spawn_file_actions_t file_actions;
+  std::lock_guard<std::mutex> spawn_lock(call_git_spawn_mutex());
+  if (pipe(fromgit))
+    return error("call-git: failed to spawn git");
+  if (pipe(togit)) {
+    close(fromgit[0]);
+    close(fromgit[1]);
+    return error("call-git: failed to spawn git");
+  }
+  bool failed = posix_spawn_file_actions_init(&file_actions);
+  if (!failed) {
+    failed = posix_spawn_file_actions_addclose(&file_actions, fromgit[0]) ||
+             posix_spawn_file_actions_adddup2(&file_actions, fromgit[1], 1) ||
+             posix_spawn_file_actions_addclose(&file_actions, togit[1]) ||
+             posix_spawn_file_actions_adddup2(&file_actions, togit[0], 0) ||
+             posix_spawnp(&pid, args[0], &file_actions, nullptr,
+                          const_cast<char **>(args.data()), envp);
+    posix_spawn_file_actions_destroy(&file_actions);
+  }
+  close(fromgit[1]);
+  close(togit[0]);
+  if (failed) {
+    close(fromgit[0]);
+    close(togit[1]);
+    return error("call-git: failed to spawn git");
+  }
+  if (fcntl(fromgit[0], F_SETFD, FD_CLOEXEC) == -1 ||
+      fcntl(togit[1], F_SETFD, FD_CLOEXEC) == -1)
+    return error("call-git: failed to close pipe(s) to git");
+  to_git = togit[1];
+  from_git = fromgit[0];
+  return 0;
+}
@@ -8,8 +8,13 @@
 #include "read_all.h"
 #include "sha1_pool.h"
 #include "split2monodb.h"
+#include "trace_events.h"
 #include "translation_queue.h"
 #include <array>
+#include <cerrno>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
 
 namespace {
 struct progress_reporter {
@@ -74,6 +79,53 @@ struct MergeRequest {
   }
 };
 
+/// The items of the last tree assembled on the head, with a slot per dir, so
+/// that the next tree on the head only has to replace the slots for the
+/// dirs that changed.  Most dirs have at most one item; the monorepo root can
+/// have many.
+struct resident_tree {
+  sha1_ref tree;
+  int dir_generation = -1;
+  std::array<std::vector<git_tree::item_type>, dir_mask::max_size> slots;
+
+  bool is_tree_of(sha1_ref head_tree, const dir_list &dirs) const {
+    return tree && tree == head_tree && dir_generation == dirs.generation;
+  }
+
+  /// Replace the slots for \a changed_dirs with \a items.
+  void replace(git_cache &cache, dir_mask changed_dirs,
+               const std::vector<git_tree::item_type> &items) {
+    for (int d = 0, de = cache.dirs.list.size(); d != de; ++d)
+      if (changed_dirs.test(d))
+        slots[d].clear();
+    for (auto &item : items) {
+      int d = cache.find_dir(item.name);
+      assert(changed_dirs.test(d));
+      slots[d].push_back(item);
+    }
+  }
+
+  /// Replace all the slots with the items of \a new_tree.
+  void reset(git_cache &cache, const git_tree &new_tree) {
+    tree = new_tree.sha1;
+    dir_generation = cache.dirs.generation;
+    for (int d = 0, de = cache.dirs.list.size(); d != de; ++d)
+      slots[d].clear();
+    for (int i = 0; i != new_tree.num_items; ++i) {
+      int d = cache.find_dir(new_tree.items[i].name);
+      assert(d != -1);
+      slots[d].push_back(new_tree.items[i]);
+    }
+  }
+
+  void collect(const dir_list &dirs,
+               std::vector<git_tree::item_type> &items) const {
+    items.clear();
+    for (int d = 0, de = dirs.list.size(); d != de; ++d)
+      items.insert(items.end(), slots[d].begin(), slots[d].end());
+  }
+};
+
 struct commit_interleaver {
   constexpr static const size_t max_parents = 128;
   sha1_pool sha1s;
@@ -87,12 +139,25 @@ struct commit_interleaver {
   std::vector<const char *> repeated_dir_names;
   dir_list dirs;
   translation_queue q;
+  resident_tree resident_head;
 
   std::vector<char> stdin_bytes;
 
-  commit_interleaver(split2monodb &db, mmapped_file &svn2git)
+  /// Where interleave() periodically records the queue and the heads, so
+  /// that if it dies, a later run with the same \a checkpoint_key (the
+  /// command line) can pick up where it left off instead of rediscovering
+  /// commits.  Empty without --checkpoint.
+  std::string checkpoint_path;
+  std::string checkpoint_key;
+
+  /// With --plan, stop after discovery and print what interleaving would
+  /// cost, without writing any objects or database rows.
+  bool is_planning = false;
+
+  commit_interleaver(split2monodb &db, svn2git_reader &svn2git)
       : cache(db, svn2git, sha1s, dirs), q(cache, dirs) {
-    dirs.list.reserve(64);
+    sha1s.root.use_huge_pages();
+    dirs.list.reserve(dir_mask::max_size);
   }
 
   void set_source_head(commit_source &source, sha1_ref sha1) {
@@ -120,6 +185,9 @@ struct commit_interleaver {
                                         const std::vector<int> &parent_revs,
                                         std::vector<git_tree::item_type> &items,
                                         sha1_ref &tree_sha1);
+  int make_tree_from_items(sha1_ref base_commit,
+                           std::vector<git_tree::item_type> &items,
+                           git_tree &tree);
   int index_parent_tree_items(int head_p, int p, dir_mask source_dirs,
                               bool source_includes_root, int &inactive_p,
                               sha1_ref parent, git_tree &tree,
@@ -138,6 +206,8 @@ struct commit_interleaver {
                        git_cache::commit_tree_buffers &buffers,
                        sha1_ref *head = nullptr, int head_p = -1);
   void print_heads(FILE *file);
+  int print_plan(FILE *file);
+  int time_object_store(double &us_per_call);
 
   void initialize_sources();
   int run();
@@ -146,8 +216,13 @@ struct commit_interleaver {
   int merge_heads();
   int fast_forward();
   int interleave();
+  int interleave_impl();
   int merge_goals();
 
+  int write_checkpoint();
+  int read_checkpoint(bool &is_resuming);
+  int fetch_checkpoint_commits(const std::vector<sha1_ref> &commits);
+
   int merge_targets(MergeRequest &targets, sha1_ref &new_commit);
   int mark_independent_targets(MergeRequest &targets);
 };
@@ -195,7 +270,25 @@ int commit_interleaver::run() {
       if (source.worker->thread)
         source.worker->thread->join();
 
+  // A plan has no heads to print, and nothing to save.
+  if (is_planning)
+    return status;
+
+  // Only save the cache after a successful run, and don't remember objects
+  // that were never written.
+  if (!status && !cache.snapshot_path.empty() && !cache.has_unwritten_objects)
+    if (cache.save_snapshot())
+      status = 1;
+
+  if (const char *var = getenv("MT_ALLOC_STATS"))
+    if (strcmp(var, "0"))
+      cache.print_allocator_stats(stderr);
+
   if (!status) {
+    // The checkpoint is stale now.
+    if (!checkpoint_path.empty())
+      if (unlink(checkpoint_path.c_str()) && errno != ENOENT)
+        error("failed to remove checkpoint '" + checkpoint_path + "'");
     print_heads(stdout);
     return 0;
   }
@@ -206,11 +299,22 @@ int commit_interleaver::run() {
 }
 
 int commit_interleaver::run_impl() {
+  if (is_planning)
+    return prepare_sources() || print_plan(stdout);
+
+  // A checkpoint picks up in the middle of interleave().
+  bool is_resuming = false;
+  if (!checkpoint_path.empty() && read_checkpoint(is_resuming))
+    return error("failed to resume from checkpoint '" + checkpoint_path +
+                 "'");
+
   // This is split out for better error reporting of interleave.
-  if (prepare_sources() || merge_heads())
-    return 1; // Has a good error already.
-  if (fast_forward())
-    return error("failed to fast-forward");
+  if (!is_resuming) {
+    if (prepare_sources() || merge_heads())
+      return 1; // Has a good error already.
+    if (fast_forward())
+      return error("failed to fast-forward");
+  }
   if (interleave())
     return error("failed to interleave");
   // Has a good error already.
@@ -218,6 +322,7 @@ int commit_interleaver::run_impl() {
 }
 
 int commit_interleaver::prepare_sources() {
+  trace_scope scope("phase", "prepare_sources");
   assert(!q.sources.empty());
   if (q.find_dir_commit_parents_to_translate() ||
       q.clean_initial_source_heads() || q.clean_initial_head(head) ||
@@ -257,7 +362,9 @@ int commit_interleaver::translate_parents(const commit_source &source,
     if (bc.was_noted)
       return;
 
-    cache.note_tree_raw(p, bc.rawtree);
+    // Trees found in the cache snapshot weren't fetched.
+    if (bc.rawtree)
+      cache.note_tree_raw(p, bc.rawtree);
     bc.was_noted = true;
   };
   auto add_parent = [&](sha1_ref p) {
@@ -275,10 +382,13 @@ int commit_interleaver::translate_parents(const commit_source &source,
   };
 
   // Wait for the worker to dig up information on boundary parents.
-  if (base.has_boundary_parents)
+  if (base.has_boundary_parents &&
+      int(source.worker->last_ready_future) < base.last_boundary_parent) {
+    trace_scope scope("worker", "wait for boundary parents");
     while (int(source.worker->last_ready_future) < base.last_boundary_parent)
       if (bool(source.worker->has_error))
         return 1;
+  }
 
   if (parent_override && override_p == -1) {
     assert(!base.num_parents);
@@ -313,7 +423,7 @@ int commit_interleaver::make_partial_tree(
       assert(mono);
       assert(!base);
       assert(source.dir_index == -1);
-      source_dirs.bits |= dirs.repeated_dirs.bits;
+      source_dirs |= dirs.repeated_dirs;
     } else {
       assert(base);
       assert(source.dir_index != -1);
@@ -328,7 +438,7 @@ int commit_interleaver::make_partial_tree(
     if (source.is_repeat) {
       for (int i = 0; i < tree.num_items; ++i) {
         assert(tree.items[i].sha1);
-        int d = dirs.find_dir(tree.items[i].name);
+        int d = cache.find_dir(tree.items[i].name);
         if (d == -1)
           continue;
         if (!dirs.repeated_dirs.test(d))
@@ -357,7 +467,8 @@ int commit_interleaver::make_partial_tree(
   assert(base_tree);
   items.emplace_back();
   items.back().sha1 = base_tree;
-  items.back().name = dirs.list[source.dir_index].name;
+  const char *name = dirs.list[source.dir_index].name;
+  items.back().name = cache.make_name(name, strlen(name));
   items.back().type = git_tree::item_type::tree;
   source_dirs.set(source.dir_index);
 
@@ -390,7 +501,27 @@ int commit_interleaver::finish_making_tree_outside_source(
                  ")");
 
   if (head_p != -1)
-    dirs.active_dirs.bits |= source_dirs.bits;
+    dirs.active_dirs |= source_dirs;
+
+  // When building on top of the last tree assembled on the head, which is
+  // the common case for first-parent commits, just replace the source's
+  // dirs.
+  if (head_p == 0 && parents.size() == 1 && resident_head.tree) {
+    sha1_ref head_tree;
+    if (cache.compute_commit_tree(parents[0], head_tree))
+      return error("failed to look up tree for '" +
+                   parents[0]->to_string() + "'");
+    if (resident_head.is_tree_of(head_tree, dirs)) {
+      resident_head.replace(cache, source_dirs, items);
+      resident_head.collect(dirs, items);
+      git_tree tree;
+      resident_head.tree = sha1_ref();
+      if (make_tree_from_items(base_commit, items, tree))
+        return 1;
+      tree_sha1 = resident_head.tree = tree.sha1;
+      return 0;
+    }
+  }
 
   // Pick parents for all the other directories.
   std::array<int, dir_mask::max_size> parent_for_d;
@@ -427,7 +558,7 @@ int commit_interleaver::finish_making_tree_outside_source(
       if (source_includes_root && item.type != git_tree::item_type::tree)
         continue;
 
-      int d = dirs.find_dir(item.name);
+      int d = cache.find_dir(item.name);
       assert(d != -1);
       if (!source_dirs.test(d))
         if (p == get_dir_p(d))
@@ -435,15 +566,28 @@ int commit_interleaver::finish_making_tree_outside_source(
     }
   }
 
-  // Sort and assert that we don't have any duplicates.
+  git_tree tree;
+  if (make_tree_from_items(base_commit, items, tree))
+    return 1;
+  tree_sha1 = tree.sha1;
+  if (head_p != -1)
+    resident_head.reset(cache, tree);
+  return 0;
+}
+
+int commit_interleaver::make_tree_from_items(
+    sha1_ref base_commit, std::vector<git_tree::item_type> &items,
+    git_tree &tree) {
+  // Sort and assert that we don't have any duplicates.  Names are interned,
+  // so compare their pointers; format_tree puts the items in git's order.
   std::sort(items.begin(), items.end(),
             [](const git_tree::item_type &lhs, const git_tree::item_type &rhs) {
-              return strcmp(lhs.name, rhs.name) < 0;
+              return std::less<const char *>()(lhs.name, rhs.name);
             });
   assert(std::adjacent_find(items.begin(), items.end(),
                             [](const git_tree::item_type &lhs,
                                const git_tree::item_type &rhs) {
-                              return strcmp(lhs.name, rhs.name) == 0;
+                              return lhs.name == rhs.name;
                             }) == items.end());
 
   // Make the tree.
@@ -452,14 +596,10 @@ int commit_interleaver::finish_making_tree_outside_source(
                  "); constructing tree for " +
                  (base_commit ? base_commit.sha1->to_string()
                               : std::string("merge commit")));
-  git_tree tree;
   tree.num_items = items.size();
   tree.items = cache.make_items(items.data(), items.data() + items.size());
   items.clear();
-  if (cache.mktree(tree))
-    return 1;
-  tree_sha1 = tree.sha1;
-  return 0;
+  return cache.mktree(tree);
 }
 
 int commit_interleaver::index_parent_tree_items(
@@ -487,7 +627,7 @@ int commit_interleaver::index_parent_tree_items(
     if (source_includes_root && item.type != git_tree::item_type::tree)
       continue;
 
-    int d = dirs.find_dir(item.name);
+    int d = cache.find_dir(item.name);
     if (d == -1)
       return error("no monorepo root to claim undeclared directory '" +
                     std::string(item.name) + "' in " +
@@ -575,6 +715,9 @@ int commit_interleaver::index_parent_tree_items(
 }
 
 void progress_reporter::report() {
+  trace_counter("interleaved", num_fparents_processed);
+  trace_counter("side", num_side_processed);
+  trace_counter("generated", num_merges_processed);
   fprintf(stderr,
           "%8ld / %ld interleaved %8ld / %ld side %8ld / %ld generated\n",
           num_fparents_processed, num_fparents_to_translate, num_side_processed,
@@ -597,6 +740,7 @@ void progress_reporter::report_fparent() {
 }
 
 int commit_interleaver::fast_forward() {
+  trace_scope scope("phase", "fast_forward");
   if (q.fparents.empty())
     return 0;
 
@@ -639,6 +783,25 @@ int commit_interleaver::fast_forward() {
 }
 
 int commit_interleaver::interleave() {
+  trace_scope scope("phase", "interleave");
+
+  // With MT_PIPELINE set, name each tree and commit here and let git write
+  // them in the background, so building the next tree overlaps with writing
+  // the last commit.  The database is updated at the end.
+  bool is_pipelined = false;
+  if (const char *var = getenv("MT_PIPELINE"))
+    is_pipelined = strcmp(var, "0");
+  if (is_pipelined)
+    cache.start_pipeline();
+
+  // Update the database even after an error, to keep the progress made.
+  int status = interleave_impl();
+  if (cache.finish_pipeline())
+    status = 1;
+  return status;
+}
+
+int commit_interleaver::interleave_impl() {
   // Persistent buffers.
   std::vector<MergeTarget> targets;
   std::vector<sha1_ref> new_parents;
@@ -646,10 +809,23 @@ int commit_interleaver::interleave() {
   std::vector<git_tree::item_type> items;
   git_cache::commit_tree_buffers buffers;
 
+  long checkpoint_interval = 1000;
+  if (const char *var = getenv("MT_CHECKPOINT_INTERVAL"))
+    checkpoint_interval = std::max(1L, strtol(var, nullptr, 10));
+  long num_since_checkpoint = 0;
+
   // Construct trees and commit them.
   progress_reporter progress(q);
   progress.report();
   while (!q.fparents.empty()) {
+    // Nothing is half-done at the top of the loop.
+    if (!checkpoint_path.empty() &&
+        ++num_since_checkpoint > checkpoint_interval) {
+      if (write_checkpoint())
+        return error("failed to write checkpoint '" + checkpoint_path + "'");
+      num_since_checkpoint = 1;
+    }
+
     auto fparent = q.fparents.back();
     q.fparents.pop_back();
     auto &source = q.sources[fparent.index];
@@ -667,7 +843,7 @@ int commit_interleaver::interleave() {
 
       targets.emplace_back(source, base, mono);
       sha1_ref new_commit;
-      if (merge_targets(merge, new_commit))
+      if (cache.wait_for_objects() || merge_targets(merge, new_commit))
         return error("failed to generate merge of '" +
                      fparent.commit->to_string() + "'");
       set_source_head(source, fparent.commit);
@@ -708,6 +884,7 @@ int commit_interleaver::interleave() {
 }
 
 int commit_interleaver::merge_heads() {
+  trace_scope scope("phase", "merge_heads");
   std::vector<MergeTarget> targets;
   std::vector<sha1_ref> new_parents;
   std::vector<int> parent_revs;
@@ -753,6 +930,7 @@ int commit_interleaver::merge_heads() {
 }
 
 int commit_interleaver::merge_goals() {
+  trace_scope scope("phase", "merge_goals");
   std::vector<MergeTarget> targets;
   std::vector<sha1_ref> new_parents;
   std::vector<int> parent_revs;
@@ -879,13 +1057,13 @@ int commit_interleaver::compare_trees(const commit_source &source,
 
   std::vector<git_tree::item_type> items;
   for (int i = 0; i < tree.num_items; ++i) {
-    int d = dirs.find_dir(tree.items[i].name);
+    int d = cache.find_dir(tree.items[i].name);
     if (d != -1)
       if (source.is_repeat ? dirs.repeated_dirs.test(d) : dirs.list[d].is_root)
         items.push_back(tree.items[i]);
   }
   for (int i = 0; i < head_tree.num_items; ++i) {
-    int d = dirs.find_dir(head_tree.items[i].name);
+    int d = cache.find_dir(head_tree.items[i].name);
     if (d != -1)
       if (source.is_repeat ? dirs.repeated_dirs.test(d) : dirs.list[d].is_root)
         items.push_back(head_tree.items[i]);
@@ -900,7 +1078,7 @@ int commit_interleaver::compare_trees(const commit_source &source,
 
   for (int i = 0, ie = items.size(); i < ie; i += 2)
     if (i + 1 == ie || items[i] < items[i + 1])
-      changed_dirs.set(dirs.find_dir(items[i].name));
+      changed_dirs.set(cache.find_dir(items[i].name));
   return 0;
 }
 
@@ -1129,7 +1307,7 @@ void commit_interleaver::print_heads(FILE *file) {
   };
   set_sha1(head);
   fprintf(file, "%s", sha1.bytes);
-  if (dirs.repeated_dirs.bits.any()) {
+  if (dirs.repeated_dirs.any()) {
     set_sha1(repeated_head);
     fprintf(file, " %s:%s", sha1.bytes, "%");
   }
@@ -1149,6 +1327,70 @@ void commit_interleaver::print_heads(FILE *file) {
   fprintf(file, "\n");
 }
 
+int commit_interleaver::print_plan(FILE *file) {
+  trace_scope scope("phase", "plan");
+  long num_fparents = progress_reporter::count_fparents(q);
+  long num_merges = q.fparents.size() - num_fparents;
+  long num_side = q.commits.size() - num_fparents;
+  long num_boundary = 0;
+  for (auto &source : q.sources)
+    if (source.worker)
+      num_boundary += source.worker->futures.size();
+
+  // Every commit gets a tree and a commit, unless it turns out to be a
+  // duplicate.  Boundary commits have their trees listed up front, and a
+  // generated merge lists its parents' trees and checks which are
+  // independent.  Merging the heads and the goals may add one more each.
+  long num_commits = num_fparents + num_side + num_merges + 2;
+  long num_ls_tree = num_boundary + num_merges;
+  long num_mktree = num_commits;
+  long num_commit_tree = num_commits;
+  long num_merge_base = num_merges + 2;
+  long num_calls = num_ls_tree + num_mktree + num_commit_tree + num_merge_base;
+
+  double us_per_call = 0;
+  if (time_object_store(us_per_call))
+    return error("failed to time the object store");
+
+  fprintf(file, "fparents          %ld\n", num_fparents);
+  fprintf(file, "side              %ld\n", num_side);
+  fprintf(file, "generated-merges  %ld\n", num_merges);
+  fprintf(file, "boundary          %ld\n", num_boundary);
+  fprintf(file, "ls-tree           %ld\n", num_ls_tree);
+  fprintf(file, "mktree            %ld\n", num_mktree);
+  fprintf(file, "commit-tree       %ld\n", num_commit_tree);
+  fprintf(file, "merge-base        %ld\n", num_merge_base);
+  fprintf(file, "us-per-call       %.0f\n", us_per_call);
+  fprintf(file, "projected-seconds %.1f\n", num_calls * us_per_call / 1e6);
+  return 0;
+}
+
+int commit_interleaver::time_object_store(double &us_per_call) {
+  // Read the trees of a few of the commits to translate straight from the
+  // object store, which is where the time goes.  The first read is a
+  // warm-up, since it may have to start git.
+  constexpr const size_t num_samples = 8;
+  us_per_call = 0;
+  if (q.commits.empty())
+    return 0;
+  object_store &store = object_store::get();
+  binary_sha1 tree;
+  if (store.read_commit_tree(*q.commits.front().commit, tree))
+    return 1;
+
+  size_t step = std::max(size_t(1), q.commits.size() / num_samples);
+  size_t num_timed = 0;
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < q.commits.size() && num_timed != num_samples;
+       i += step, ++num_timed)
+    if (store.read_commit_tree(*q.commits[i].commit, tree))
+      return 1;
+  auto elapsed = std::chrono::steady_clock::now() - start;
+  us_per_call =
+      std::chrono::duration<double, std::micro>(elapsed).count() / num_timed;
+  return 0;
+}
+
 int commit_interleaver::translate_commit(
     commit_source &source, const commit_type &base,
     std::vector<sha1_ref> &new_parents, std::vector<int> &parent_revs,
@@ -1182,3 +1424,249 @@ int commit_interleaver::translate_commit(
   *head = new_commit;
   return 0;
 }
+
+int commit_interleaver::write_checkpoint() {
+  trace_scope scope("phase", "write_checkpoint");
+
+  // Everything the checkpoint treats as translated has to be on disk first.
+  if (cache.flush_pipeline() || cache.db.flush())
+    return 1;
+
+  // There's nothing to resume from if the commits were never written.
+  if (cache.has_unwritten_objects)
+    return 0;
+
+  std::string temp_path = checkpoint_path + ".tmp";
+  FILE *file = fopen(temp_path.c_str(), "w");
+  if (!file)
+    return error("failed to open '" + temp_path + "': " + strerror(errno));
+
+  auto to_string = [](sha1_ref sha1) {
+    return sha1 ? sha1->to_string() : std::string(40, '0');
+  };
+  fprintf(file, "mt-checkpoint 1\n");
+  fprintf(file, "args %s\n", checkpoint_key.c_str());
+  fprintf(file, "head %s\n", to_string(head).c_str());
+  fprintf(file, "active");
+  for (int d = 0, de = dirs.list.size(); d != de; ++d)
+    if (dirs.active_dirs.test(d))
+      fprintf(file, " %d", d);
+  fprintf(file, "\n");
+  for (auto &source : q.sources) {
+    fprintf(file, "source %s %s %u\n", to_string(source.head).c_str(),
+            to_string(source.goal).c_str(), source.commits.count);
+    for (unsigned i = 0; i != source.commits.count; ++i)
+      fprintf(file, "%s\n",
+              q.commits[source.commits.first + i].commit->to_string().c_str());
+  }
+  fprintf(file, "fparents %zu\n", q.fparents.size());
+  for (auto &fparent : q.fparents)
+    fprintf(file, "%s %lld %d %d %d %d %d %d\n",
+            fparent.commit->to_string().c_str(), fparent.ct, fparent.index,
+            fparent.head_p, int(fparent.has_parents), int(fparent.is_merge),
+            int(fparent.is_translated), int(fparent.is_locked_in));
+
+  // Replace the old checkpoint atomically.
+  bool failed = ferror(file);
+  failed |= bool(fclose(file));
+  if (failed || rename(temp_path.c_str(), checkpoint_path.c_str()))
+    return error("failed to write '" + temp_path + "': " + strerror(errno));
+  return 0;
+}
+
+int commit_interleaver::read_checkpoint(bool &is_resuming) {
+  trace_scope scope("phase", "read_checkpoint");
+  is_resuming = false;
+  int fd = open(checkpoint_path.c_str(), O_RDONLY);
+  if (fd == -1) {
+    if (errno == ENOENT)
+      return 0;
+    return error("failed to open '" + checkpoint_path + "': " +
+                 strerror(errno));
+  }
+  std::vector<char> bytes;
+  int status = read_all(fd, bytes);
+  close(fd);
+  if (status)
+    return error("failed to read '" + checkpoint_path + "'");
+  bytes.push_back(0);
+
+  // Only resume the same command.
+  const char *current = bytes.data();
+  if (parse_string(current, "mt-checkpoint 1\nargs "))
+    return error("unknown checkpoint format");
+  size_t key_size = strcspn(current, "\n");
+  if (checkpoint_key != std::string(current, key_size)) {
+    fprintf(stderr, "interleave-commits: ignoring checkpoint '%s' for "
+                    "different arguments\n",
+            checkpoint_path.c_str());
+    return 0;
+  }
+  current += key_size;
+
+  // Parse everything before changing anything.
+  sha1_ref new_head;
+  if (parse_newline(current) || parse_string(current, "head ") ||
+      cache.pool.parse_sha1_or_zeros(current, new_head) ||
+      parse_newline(current) || parse_string(current, "active"))
+    return error("invalid checkpoint head");
+  dir_mask active_dirs;
+  while (!parse_space(current)) {
+    int d = -1;
+    if (parse_num(current, d) || d < 0 || d >= int(dirs.list.size()))
+      return error("invalid checkpoint active dirs");
+    active_dirs.set(d);
+  }
+  if (parse_newline(current))
+    return error("invalid checkpoint active dirs");
+
+  std::vector<sha1_ref> heads, goals, commits;
+  std::vector<unsigned> counts;
+  for (size_t i = 0, ie = q.sources.size(); i != ie; ++i) {
+    heads.emplace_back();
+    goals.emplace_back();
+    long long count = 0;
+    if (parse_string(current, "source ") ||
+        cache.pool.parse_sha1_or_zeros(current, heads.back()) ||
+        parse_space(current) ||
+        cache.pool.parse_sha1_or_zeros(current, goals.back()) ||
+        parse_space(current) || parse_num(current, count) || count < 0 ||
+        parse_newline(current))
+      return error("invalid checkpoint source");
+    counts.push_back(count);
+    for (; count; --count) {
+      commits.emplace_back();
+      if (cache.pool.parse_sha1(current, commits.back()) ||
+          parse_newline(current))
+        return error("invalid checkpoint commit");
+    }
+  }
+
+  long long num_fparents = 0;
+  if (parse_string(current, "fparents ") || parse_num(current, num_fparents) ||
+      num_fparents < 0 || parse_newline(current))
+    return error("invalid checkpoint first parents");
+  std::vector<fparent_type> fparents;
+  for (; num_fparents; --num_fparents) {
+    sha1_ref commit;
+    long long ct = -1;
+    int index = -1;
+    int flags[4] = {0};
+    if (cache.pool.parse_sha1(current, commit) || parse_space(current) ||
+        parse_ct(current, ct) || parse_space(current) ||
+        parse_num(current, index) || index < 0 ||
+        index >= int(q.sources.size()))
+      return error("invalid checkpoint first parent");
+    fparents.emplace_back(index);
+    auto &fparent = fparents.back();
+    fparent.commit = commit;
+    fparent.ct = ct;
+    if (parse_space(current) || parse_num(current, fparent.head_p))
+      return error("invalid checkpoint first parent");
+    for (int &flag : flags)
+      if (parse_space(current) || parse_num(current, flag))
+        return error("invalid checkpoint first parent");
+    if (parse_newline(current))
+      return error("invalid checkpoint first parent");
+    fparent.has_parents = flags[0];
+    fparent.is_merge = flags[1];
+    fparent.is_translated = flags[2];
+    fparent.is_locked_in = flags[3];
+  }
+  if (*current)
+    return error("junk at end of checkpoint");
+
+  // Restore the state from the top of the loop in interleave().
+  fprintf(stderr, "interleave-commits: resuming from checkpoint '%s'\n",
+          checkpoint_path.c_str());
+  head = new_head;
+  dirs.active_dirs = active_dirs;
+  q.commits.clear();
+  if (fetch_checkpoint_commits(commits))
+    return 1;
+  for (size_t i = 0, ie = q.sources.size(), first = 0; i != ie; ++i) {
+    auto &source = q.sources[i];
+    source.head = heads[i];
+    source.goal = goals[i];
+    source.commits.first = first;
+    source.commits.count = counts[i];
+    source.num_fparents_to_translate = 0;
+    first += counts[i];
+  }
+  q.fparents = std::move(fparents);
+  for (auto &fparent : q.fparents)
+    if (!fparent.is_translated)
+      ++q.sources[fparent.index].num_fparents_to_translate;
+  is_resuming = true;
+  return 0;
+}
+
+int commit_interleaver::fetch_checkpoint_commits(
+    const std::vector<sha1_ref> &commits) {
+  if (commits.empty())
+    return 0;
+
+  // Get the trees, parents, and metadata in one go, rather than asking git
+  // about each commit when it's translated.
+  std::string input;
+  for (sha1_ref commit : commits)
+    input += commit->to_string() + "\n";
+  const char *args[] = {
+      "git",
+      "log",
+      "--no-walk=unsorted",
+      "--stdin",
+      "--date=raw",
+      "--format=tformat:%H %T %P%x00%an%n%cn%n%ad%n%cd%n%ae%n%ce%n%B%x00",
+      nullptr,
+  };
+  std::vector<char> reply;
+  if (call_git(args, nullptr, input, reply))
+    return error("failed to look up commits from checkpoint");
+  reply.push_back(0);
+
+  const char *current = reply.data();
+  const char *end = current + reply.size() - 1;
+  std::vector<sha1_ref> parents;
+  for (sha1_ref expected : commits) {
+    // line ::= commit SP tree SP ( parent ( SP parent )* )? NUL metadata NUL
+    sha1_ref commit, tree;
+    if (cache.pool.parse_sha1(current, commit) || parse_space(current) ||
+        cache.pool.parse_sha1(current, tree) || parse_space(current))
+      return error("failed to parse commit for '" + expected->to_string() +
+                   "' from checkpoint");
+    if (commit != expected)
+      return error("expected '" + expected->to_string() + "', got '" +
+                   commit->to_string() + "'");
+    parents.clear();
+    while (*current) {
+      parents.emplace_back();
+      if (cache.pool.parse_sha1(current, parents.back()) ||
+          (*current && parse_space(current)))
+        return error("failed to parse parents of '" + commit->to_string() +
+                     "'");
+    }
+    const char *metadata = ++current;
+    if (parse_through_null(current, end) || parse_newline(current))
+      return error("failed to parse metadata for '" + commit->to_string() +
+                   "'");
+
+    cache.note_commit_tree(commit, tree);
+    cache.store_metadata_if_new(commit, metadata, current - 2,
+                                /*is_merge=*/parents.size() > 1,
+                                parents.empty() ? sha1_ref() : parents.front());
+    cache.note_being_translated(commit);
+    q.commits.emplace_back();
+    auto &untranslated = q.commits.back();
+    untranslated.commit = commit;
+    untranslated.tree = tree;
+    untranslated.num_parents = parents.size();
+    if (!parents.empty()) {
+      untranslated.parents = new (q.parent_alloc) sha1_ref[parents.size()];
+      std::copy(parents.begin(), parents.end(), untranslated.parents);
+    }
+  }
+  if (current != end)
+    return error("unexpected commits from git when resuming");
+  return 0;
+}
@@ -3,6 +3,7 @@
 
 #include "error.h"
 #include "git_cache.h"
+#include "git_record_prefetcher.h"
 #include "parsers.h"
 #include <atomic>
 #include <optional>
@@ -75,6 +76,9 @@ struct monocommit_worker {
   /// Report an error.
   std::atomic<bool> has_error = false;
 
+  /// Trees already in the cache snapshot don't need to be fetched.
+  const cache_snapshot *snapshot = nullptr;
+
   /// Returns after spawning a thread to process all the futures.
   void start() {
     thread.emplace([&]() { process_futures(); });
@@ -113,6 +117,10 @@ struct commit_source {
 
   std::unique_ptr<monocommit_worker> worker;
 
+  /// The git-log for the current step of discovery.  It's started for every
+  /// source before any are parsed, so the walks run at the same time.
+  std::unique_ptr<git_record_prefetcher> log;
+
   commit_source(int source_index, dir_type &dir, int dir_index)
       : source_index(source_index), dir_index(dir_index), has_root(dir.is_root),
         head(dir.head), goal(dir.head), cmdline_start(dir.head) {}
@@ -122,8 +130,10 @@ struct commit_source {
 
   int clean_head(git_cache &cache);
   void lock_in_start_dir_commits();
+  int start_matching_dir_commits(git_cache &cache, const std::string &since);
   int find_dir_commits_to_match_and_update_head(git_cache &cache,
                                                 const std::string &since);
+  int start_listing_dir_commits(git_cache &cache);
   int find_dir_commits(git_cache &cache, long long &earliest_ct);
   int find_repeat_commits_and_head(git_cache &cache, long long min_ct_to_merge);
   int find_repeat_commits_and_head_impl(git_cache &cache,
@@ -137,27 +147,36 @@ struct commit_source {
 
   int list_first_ancestry_path(git_cache &cache);
   int list_first_parents(git_cache &cache);
-  int list_first_parents_limit(git_cache &cache, int limit);
-  int list_first_parents_limit(git_cache &cache, const std::string &limitter);
-  int list_first_parents_limit_impl(
-      git_cache &cache, const std::string &limitter, std::string start,
-      sha1_ref &last_first_parent,
-      std::vector<sha1_ref> stops = std::vector<sha1_ref>());
+
+  void start_log(git_cache &cache, const std::vector<const char *> &argv,
+                 int num_fields);
+  void start_first_parents(git_cache &cache, const std::string &limitter,
+                           sha1_ref start);
+
+  /// List first parents from the log started by start_first_parents.  If \a
+  /// stop_at_translated, stop early once the last commit listed has been
+  /// translated, checking after the first 50 commits and then every 1000.
+  int list_first_parents_limit_impl(git_cache &cache,
+                                    sha1_ref &last_first_parent,
+                                    bool stop_at_translated = false);
   int get_next_fparent(git_cache &cache, sha1_ref &sha1);
   static int get_next_fparent_impl(const fparent_type &fparent,
                                    git_cache &cache, sha1_ref &sha1);
   void validate_last_ct();
 
+  int start_finding_dir_commit_parents(git_cache &cache);
   int find_dir_commit_parents_to_translate(
       git_cache &cache, bump_allocator &parent_alloc,
       std::vector<commit_type> &untranslated);
   int extract_mtsplits(git_cache &cache, std::vector<std::string> &mtsplits);
   int queue_boundary_commit(git_cache &cache, sha1_ref commit);
-  int parse_boundary_metadata(git_cache &cache, sha1_ref commit,
-                              const char *&current, const char *end);
-  int parse_untranslated_commit(git_cache &cache, bump_allocator &parent_alloc,
-                                sha1_ref commit, const char *&current,
-                                const char *end, commit_type &untranslated,
+  int parse_boundary_metadata(git_cache &cache, git_record_prefetcher &log,
+                              sha1_ref commit, const char *&current,
+                              const char *end);
+  int parse_untranslated_commit(git_cache &cache, git_record_prefetcher &log,
+                                bump_allocator &parent_alloc, sha1_ref commit,
+                                const char *&current, const char *end,
+                                commit_type &untranslated,
                                 std::vector<sha1_ref> &parents,
                                 bool &should_skip);
   int parse_dir_metadata(git_cache &cache, sha1_ref commit,
@@ -166,11 +185,18 @@ struct commit_source {
 } // end namespace
 
 void monocommit_worker::process_futures() {
+  trace_scope scope("worker", "process_futures");
   std::vector<char> reply;
   for (auto fb = futures.begin(), f = fb, fe = futures.end(); f != fe; ++f) {
     if (bool(should_cancel))
       return;
 
+    if (snapshot && snapshot->find_record<cache_snapshot::tree_record>(
+                        cache_snapshot::trees_section, *f->commit)) {
+      last_ready_future = f - fb;
+      continue;
+    }
+
     if (git_cache::ls_tree_impl(f->commit, reply)) {
       has_error = true;
       return;
@@ -240,8 +266,8 @@ void commit_source::lock_in_start_dir_commits() {
   fparents.erase(fparents.begin() + num_fparents_from_start, fparents.end());
 }
 
-int commit_source::find_dir_commits_to_match_and_update_head(
-    git_cache &cache, const std::string &since) {
+int commit_source::start_matching_dir_commits(git_cache &cache,
+                                              const std::string &since) {
   assert(!is_repeat);
 
   // Otherwise, extend into already translated commits to match the most
@@ -249,12 +275,20 @@ int commit_source::find_dir_commits_to_match_and_update_head(
   sha1_ref start;
   if (get_next_fparent(cache, start))
     return 1;
-  if (!start)
+  if (start)
+    start_first_parents(cache, since, start);
+  return 0;
+}
+
+int commit_source::find_dir_commits_to_match_and_update_head(
+    git_cache &cache, const std::string &since) {
+  if (!log && start_matching_dir_commits(cache, since))
+    return 1;
+  if (!log)
     return 0;
 
   sha1_ref last_first_parent;
-  if (list_first_parents_limit_impl(cache, since, start->to_string(),
-                                    last_first_parent))
+  if (list_first_parents_limit_impl(cache, last_first_parent))
     return 1;
 
   if (last_first_parent) {
@@ -341,34 +375,56 @@ int commit_source::find_dir_commits(git_cache &cache, long long &earliest_ct) {
   return 0;
 }
 
-int commit_source::list_first_parents(git_cache &cache) {
-  // Parse just 50 to start with.
-  int limit = 50;
-  size_t prev_fparents_size = fparents.size();
-  while (true) {
-    if (list_first_parents_limit(cache, limit))
-      return 1;
-    // If we run again, parse 1000 at a time to reduce the number of calls to
-    // Git.
-    limit = 1000;
-
-    if (prev_fparents_size == fparents.size())
-      break;
-    prev_fparents_size = fparents.size();
-
-    if (!fparents.back().has_parents)
-      break;
+int commit_source::start_listing_dir_commits(git_cache &cache) {
+  assert(!is_repeat);
+  if (head) {
+    // The path is empty.
+    if (head == goal)
+      return 0;
 
-    sha1_ref mono;
-    if (!cache.compute_mono(fparents.back().commit, mono))
-      break;
+    std::string start = goal->to_string();
+    std::string stop = head->to_string();
+    start_log(cache,
+              {
+                  "git",
+                  "log",
+                  "--format=tformat:%H %ct %P",
+                  "--ancestry-path",
+                  start.c_str(),
+                  "--not",
+                  stop.c_str(),
+              },
+              /*num_fields=*/0);
+    return 0;
   }
+
+  // Keep a single git-log running until we reach translated commits, rather
+  // than restarting the walk for each batch.
+  sha1_ref start;
+  if (get_next_fparent(cache, start))
+    return 1;
+  if (start)
+    start_first_parents(cache, "", start);
   return 0;
 }
 
-int commit_source::list_first_parents_limit(git_cache &cache, int limit) {
-  assert(limit > 0);
-  return list_first_parents_limit(cache, "-" + std::to_string(limit));
+int commit_source::list_first_parents(git_cache &cache) {
+  if (!log && start_listing_dir_commits(cache))
+    return 1;
+  if (!log)
+    return 0;
+
+  sha1_ref last_first_parent;
+  return list_first_parents_limit_impl(cache, last_first_parent,
+                                       /*stop_at_translated=*/true);
+}
+
+void commit_source::start_log(git_cache &cache,
+                              const std::vector<const char *> &argv,
+                              int num_fields) {
+  assert(!log);
+  log.reset(new git_record_prefetcher(cache.big_metadata));
+  log->start(argv, num_fields);
 }
 
 int commit_source::get_next_fparent(git_cache &cache, sha1_ref &sha1) {
@@ -395,83 +451,80 @@ int commit_source::get_next_fparent_impl(const fparent_type &fparent,
   return 0;
 }
 
-int commit_source::list_first_parents_limit(git_cache &cache,
-                                            const std::string &limitter) {
-  sha1_ref last_first_parent;
-  sha1_ref start;
-  if (get_next_fparent(cache, start))
-    return 1;
-  if (!start)
-    return 0;
-
-  return list_first_parents_limit_impl(cache, limitter, start->to_string(),
-                                       last_first_parent);
-}
-
-int commit_source::list_first_parents_limit_impl(git_cache &cache,
-                                                 const std::string &limitter,
-                                                 std::string start,
-                                                 sha1_ref &last_first_parent,
-                                                 std::vector<sha1_ref> stops) {
-  assert(!start.empty());
+void commit_source::start_first_parents(git_cache &cache,
+                                        const std::string &limitter,
+                                        sha1_ref start) {
+  assert(start);
 
   // Repeat fparents don't have the right metadata to make this work.
   assert(!is_repeat);
 
-  auto &git_reply = cache.git_reply;
+  std::string start_sha1 = start->to_string();
   std::vector<const char *> argv = {
       "git",
       "log",
       "--first-parent",
       "--date=raw",
       "--format=tformat:%H %ct %P%x00%an%n%cn%n%ad%n%cd%n%ae%n%ce%n%B%x00",
-      start.c_str(),
+      start_sha1.c_str(),
   };
   if (!limitter.empty())
     argv.push_back(limitter.c_str());
-  std::vector<std::string> stop_sha1s;
-  if (!stops.empty()) {
-    argv.push_back("--not");
-    for (auto &stop : stops)
-      stop_sha1s.push_back(stop->to_string());
-    for (auto &stop : stop_sha1s)
-      argv.push_back(stop.c_str());
-  }
-  argv.push_back(nullptr);
-  git_reply.clear();
-  if (call_git(argv.data(), nullptr, "", git_reply))
-    return error("git failed");
-  git_reply.push_back(0);
+  start_log(cache, argv, /*num_fields=*/2);
+}
 
-  const char *current = git_reply.data();
-  const char *end = git_reply.data() + git_reply.size() - 1;
-  while (current != end) {
-    fparents.emplace_back(source_index);
-    fparents.back().is_translated = extra_commits_have_been_translated;
-    if (cache.pool.parse_sha1(current, fparents.back().commit) ||
-        parse_space(current) || parse_ct(current, fparents.back().ct) ||
-        parse_space(current))
-      return error("failed to parse commit and ct");
-    validate_last_ct();
+int commit_source::list_first_parents_limit_impl(git_cache &cache,
+                                                 sha1_ref &last_first_parent,
+                                                 bool stop_at_translated) {
+  assert(log);
+
+  // Parse each commit as soon as git prints it.
+  size_t next_stop_check = fparents.size() + 50;
+  auto parse_log = [&]() {
+    const char *current, *end;
+    while (true) {
+      if (log->next(current, end))
+        return error("git failed");
+      if (!current)
+        return 0;
 
-    last_first_parent = sha1_ref();
-    const char *metadata = current;
-    const char *end_metadata = end;
-    if (cache.parse_for_store_metadata(fparents.back().commit, metadata,
-                                       end_metadata, fparents.back().is_merge,
-                                       last_first_parent))
-      return 1;
-    cache.store_metadata_if_new(fparents.back().commit, metadata, end_metadata,
-                                fparents.back().is_merge, last_first_parent);
-    current = end_metadata;
-    if (last_first_parent) {
-      fparents.back().has_parents = true;
-      fparents.back().head_p = 0;
+      fparents.emplace_back(source_index);
+      fparents.back().is_translated = extra_commits_have_been_translated;
+      if (cache.pool.parse_sha1(current, fparents.back().commit) ||
+          parse_space(current) || parse_ct(current, fparents.back().ct) ||
+          parse_space(current))
+        return error("failed to parse commit and ct");
+      validate_last_ct();
+
+      last_first_parent = sha1_ref();
+      const char *metadata = current;
+      const char *end_metadata = end;
+      if (cache.parse_for_store_metadata(fparents.back().commit, metadata,
+                                         end_metadata, fparents.back().is_merge,
+                                         last_first_parent))
+        return 1;
+      cache.adopt_metadata_if_new(*log, fparents.back().commit, metadata,
+                                  end_metadata, fparents.back().is_merge,
+                                  last_first_parent);
+      current = end_metadata;
+      if (last_first_parent) {
+        fparents.back().has_parents = true;
+        fparents.back().head_p = 0;
+      }
+      if (parse_null(current) || parse_newline(current))
+        return 1;
+
+      if (!stop_at_translated || fparents.size() != next_stop_check)
+        continue;
+      next_stop_check += 1000;
+      sha1_ref mono;
+      if (!cache.compute_mono(fparents.back().commit, mono))
+        return 0;
     }
-    if (parse_null(current) || parse_newline(current))
-      return 1;
-  }
-  return 0;
+  };
+  int status = parse_log();
+  log.reset();
+  return status;
 }
 
 int commit_source::list_first_ancestry_path(git_cache &cache) {
@@ -482,46 +535,53 @@ int commit_source::list_first_ancestry_path(git_cache &cache) {
   }
 
   assert(!extra_commits_have_been_translated);
-  std::string start = goal->to_string();
-  std::string stop = head->to_string();
-  auto &git_reply = cache.git_reply;
-  const char *argv[] = {
-      "git",
-      "log",
-      "--format=tformat:%H %ct %P",
-      "--ancestry-path",
-      start.c_str(),
-      "--not",
-      stop.c_str(),
-      nullptr,
-  };
-  git_reply.clear();
-  if (call_git(argv, nullptr, "", git_reply))
+  if (!log && start_listing_dir_commits(cache))
     return 1;
-  git_reply.push_back(0);
 
   struct ancestry_node {
     sha1_ref commit;
     long long ct = -1;
-    const char *parents = nullptr;
+    int first_parent = 0;
+    int num_parents = 0;
   };
 
+  // Parse the parents right away, since the log's chunks don't stay around.
   std::vector<ancestry_node> ancestry;
+  std::vector<sha1_ref> parents;
   auto in_ancestry = std::make_unique<sha1_trie<git_cache::sha1_single>>();
   bool was_inserted;
-  const char *current = git_reply.data();
-  const char *end = git_reply.data() + git_reply.size() - 1;
-  while (current != end) {
-    ancestry.emplace_back();
-    if (cache.pool.parse_sha1(current, ancestry.back().commit) ||
-        parse_space(current) || parse_ct(current, ancestry.back().ct) ||
-        parse_space(current))
-      return 1;
-    in_ancestry->insert(*ancestry.back().commit, was_inserted);
-    ancestry.back().parents = current;
-    if (parse_through_newline(current))
-      return 1;
-  }
+  auto parse_log = [&]() {
+    const char *current, *end;
+    while (true) {
+      if (log->next(current, end))
+        return 1;
+      if (!current)
+        return 0;
+
+      ancestry.emplace_back();
+      if (cache.pool.parse_sha1(current, ancestry.back().commit) ||
+          parse_space(current) || parse_ct(current, ancestry.back().ct) ||
+          parse_space(current))
+        return 1;
+      in_ancestry->insert(*ancestry.back().commit, was_inserted);
+
+      // Should always have at least one parent.
+      ancestry.back().first_parent = parents.size();
+      do {
+        parents.emplace_back();
+        if (cache.pool.parse_sha1(current, parents.back()))
+          return error("failed to parse parent in ancestry path");
+      } while (!parse_space(current));
+      if (parse_newline(current))
+        return error("failed to parse parents in ancestry path");
+      ancestry.back().num_parents =
+          parents.size() - ancestry.back().first_parent;
+    }
+  };
+  int status = parse_log();
+  log.reset();
+  if (status)
+    return 1;
 
   auto included = std::make_unique<sha1_trie<git_cache::sha1_single>>();
   in_ancestry->insert(*head, was_inserted);
@@ -537,30 +597,17 @@ int commit_source::list_first_ancestry_path(git_cache &cache) {
     fparents.back().has_parents = true;
     validate_last_ct();
 
-    // Should always have at least one parent.
-    const char *current = an.parents;
-    int p = 0;
-    auto handle_parent = [&]() {
+    for (int p = 0; p != an.num_parents; ++p) {
       if (p == 1)
         fparents.back().is_merge = true;
-      sha1_ref parent;
-      if (cache.pool.parse_sha1(current, parent))
-        return 1;
       if (fparents.back().head_p != -1)
-        return 0;
+        continue;
+      sha1_ref parent = parents[an.first_parent + p];
       if (!in_ancestry->lookup(*parent))
-        return 0;
+        continue;
       fparents.back().head_p = p;
       included->insert(*parent, was_inserted);
-      return 0;
-    };
-    if (handle_parent())
-      return error("failed to parse first parent in ancestry path");
-    for (++p; !parse_space(current); ++p)
-      if (handle_parent())
-        return error("failed to parse parent in ancestry path");
-    if (*current != '\n')
-      return error("failed to parse parents in ancestry path");
+    }
     if (fparents.back().head_p == -1)
       return error("failed to traverse ancestry path");
   }
@@ -614,7 +661,6 @@ int commit_source::find_repeat_commits_and_head(git_cache &cache,
       "--first-parent",
       "--date=raw",
       "--format=%x01%H %ct %P%x00%an%n%cn%n%ad%n%cd%n%ae%n%ce%n%B%x00",
-      "-1000",
       start_sha1.c_str(),
   };
   int start_index = argv.size() - 1;
@@ -661,77 +707,79 @@ int commit_source::find_repeat_commits_and_head(git_cache &cache,
 int commit_source::find_repeat_commits_and_head_impl(
     git_cache &cache, long long min_ct_to_merge,
     std::vector<const char *> &argv, sha1_ref &next) {
-  auto &git_reply = cache.git_reply;
-  git_reply.clear();
-  if (call_git(argv.data(), nullptr, "", git_reply))
-    return 1;
-  git_reply.push_back(0);
-
   // Unset "next", in case there are no search results.
   next = sha1_ref();
 
-  const char *current = git_reply.data();
-  const char *end = git_reply.data() + git_reply.size() - 1;
-  while (current != end) {
-    fparents.emplace_back(source_index);
-    if (parse_ch(current, 1) ||
-        cache.pool.parse_sha1(current, fparents.back().commit) ||
-        parse_space(current) || parse_num(current, fparents.back().ct) ||
-        parse_space(current))
-      return error("failed to parse repeat commit");
-
-    // Set the goal, if this is the first commit we found.
-    if (!goal)
-      goal = fparents.front().commit;
+  // Parse each commit as soon as git prints it.  Once we've found what we're
+  // looking for, stop git instead of letting it finish the walk.
+  auto parse_log = [&](int fd) {
+    git_record_reader reader(cache.name_alloc, fd, /*num_fields=*/2);
+    const char *current, *end;
+    while (true) {
+      if (reader.next(current, end))
+        return 1;
+      if (!current)
+        return 0;
 
-    long long real_ct = fparents.back().ct;
-    validate_last_ct();
+      fparents.emplace_back(source_index);
+      if (parse_ch(current, 1) ||
+          cache.pool.parse_sha1(current, fparents.back().commit) ||
+          parse_space(current) || parse_num(current, fparents.back().ct) ||
+          parse_space(current))
+        return error("failed to parse repeat commit");
 
-    // Reinitialize "next"; it'll be left unset if there's no first-parent.
-    next = sha1_ref();
-
-    // Mark all repeat commits as already translated, so that
-    // by_non_increasing_commit_timestamp will put them at the back of the
-    // pile.
-    fparents.back().is_translated = true;
-
-    // Save the metadata.
-    const char *metadata = current;
-    const char *end_metadata = end;
-    if (cache.parse_for_store_metadata(fparents.back().commit, metadata,
-                                       end_metadata, fparents.back().is_merge,
-                                       next))
-      return error("failed to parse metadata in repeat commit '" +
-                   fparents.back().commit->to_string() + "'");
-    cache.store_metadata_if_new(fparents.back().commit, metadata, end_metadata,
-                                fparents.back().is_merge,
-                                next);
-    current = end_metadata;
-    if (parse_null(current) || parse_newline(current))
-      return error("missing terminator for repeat commit '" +
-                   fparents.back().commit->to_string() + "'");
-
-    // Break once we're one past the earliest other commit timestamp.  This is
-    // critical for fast-forwarding downstream branches that have no changes
-    // (yet) from upstream.
-    if (real_ct <= min_ct_to_merge) {
-      // Rewind the search by one and set the head if it's not already set.
-      if (!head)
-        head = fparents.back().commit;
-      fparents.pop_back();
-      next = sha1_ref();
-      return 0;
-    }
+      // Set the goal, if this is the first commit we found.
+      if (!goal)
+        goal = fparents.front().commit;
 
-    if (!next)
-      return 0;
+      long long real_ct = fparents.back().ct;
+      validate_last_ct();
 
-    // Point out which parent to override.
-    fparents.back().head_p = 0;
-    fparents.back().has_parents = true;
-  }
+      // Reinitialize "next"; it'll be left unset if there's no first-parent.
+      next = sha1_ref();
 
-  return 0;
+      // Mark all repeat commits as already translated, so that
+      // by_non_increasing_commit_timestamp will put them at the back of the
+      // pile.
+      fparents.back().is_translated = true;
+
+      // Save the metadata.
+      const char *metadata = current;
+      const char *end_metadata = end;
+      if (cache.parse_for_store_metadata(fparents.back().commit, metadata,
+                                         end_metadata,
+                                         fparents.back().is_merge, next))
+        return error("failed to parse metadata in repeat commit '" +
+                     fparents.back().commit->to_string() + "'");
+      cache.adopt_metadata_if_new(reader, fparents.back().commit, metadata,
+                                  end_metadata, fparents.back().is_merge,
+                                  next);
+      current = end_metadata;
+      if (parse_null(current) || parse_newline(current))
+        return error("missing terminator for repeat commit '" +
+                     fparents.back().commit->to_string() + "'");
+
+      // Break once we're one past the earliest other commit timestamp.  This
+      // is critical for fast-forwarding downstream branches that have no
+      // changes (yet) from upstream.
+      if (real_ct <= min_ct_to_merge) {
+        // Rewind the search by one and set the head if it's not already set.
+        if (!head)
+          head = fparents.back().commit;
+        fparents.pop_back();
+        next = sha1_ref();
+        return call_git_stop_reading;
+      }
+
+      if (!next)
+        return call_git_stop_reading;
+
+      // Point out which parent to override.
+      fparents.back().head_p = 0;
+      fparents.back().has_parents = true;
+    }
+  };
+  return call_git_streaming(argv.data(), nullptr, parse_log);
 }
 
 int commit_source::add_repeat_search_names(git_cache &cache, sha1_ref start,
@@ -748,7 +796,7 @@ int commit_source::add_repeat_search_names(git_cache &cache, sha1_ref start,
     return error("could not ls-tree repeat '" + start->to_string() + "'");
   for (int i = 0, ie = tree.num_items; i != ie; ++i) {
     const char *name = tree.items[i].name;
-    int d = cache.dirs.find_dir(name);
+    int d = cache.find_dir(name);
     if (d == -1)
       return error("unexpected root item in '" + start->to_string() + "'");
     if (cache.dirs.repeated_dirs.test(d))
@@ -795,9 +843,7 @@ int commit_source::extract_mtsplits(git_cache &cache,
   return 0;
 }
 
-int commit_source::find_dir_commit_parents_to_translate(
-    git_cache &cache, bump_allocator &parent_alloc,
-    std::vector<commit_type> &untranslated) {
+int commit_source::start_finding_dir_commit_parents(git_cache &cache) {
   assert(!is_repeat);
   assert(goal);
 
@@ -818,52 +864,65 @@ int commit_source::find_dir_commit_parents_to_translate(
   };
   for (auto &mtsplit : mtsplits)
     argv.push_back(mtsplit.c_str());
-  argv.push_back(nullptr);
+  start_log(cache, argv, /*num_fields=*/2);
+  return 0;
+}
 
-  auto &git_reply = cache.git_reply;
-  git_reply.clear();
-  if (call_git(argv.data(), nullptr, "", git_reply))
+int commit_source::find_dir_commit_parents_to_translate(
+    git_cache &cache, bump_allocator &parent_alloc,
+    std::vector<commit_type> &untranslated) {
+  if (!log && start_finding_dir_commit_parents(cache))
     return 1;
-  git_reply.push_back(0);
 
-  // Translate the commits.
+  // Translate the commits as soon as git prints them.
   commits.first = untranslated.size();
   std::vector<sha1_ref> parents;
-  const char *current = git_reply.data();
-  const char *end = git_reply.data() + git_reply.size() - 1;
-  while (current != end) {
-    // line ::= ( GT | MINUS ) commit SP tree ( SP parent )*
-    bool is_boundary = false;
-    sha1_ref commit, tree;
-    if (parse_boundary(current, is_boundary) ||
-        cache.pool.parse_sha1(current, commit) || parse_space(current) ||
-        cache.pool.parse_sha1(current, tree))
-      return 1;
+  auto parse_log = [&]() {
+    const char *current, *end;
+    while (true) {
+      if (log->next(current, end))
+        return 1;
+      if (!current)
+        return 0;
 
-    // Warm the cache.
-    assert(commit);
-    assert(tree);
-    cache.note_commit_tree(commit, tree);
-    if (is_boundary) {
-      // If this is a boundary commit, skip ahead after warming the cache.
-      if (parse_boundary_metadata(cache, commit, current, end))
+      // line ::= ( GT | MINUS ) commit SP tree ( SP parent )*
+      bool is_boundary = false;
+      sha1_ref commit, tree;
+      if (parse_boundary(current, is_boundary) ||
+          cache.pool.parse_sha1(current, commit) || parse_space(current) ||
+          cache.pool.parse_sha1(current, tree))
         return 1;
-      continue;
-    }
 
-    // Parse the commit.
-    bool should_skip = false;
-    untranslated.emplace_back();
-    untranslated.back().commit = commit;
-    untranslated.back().tree = tree;
-    if (parse_untranslated_commit(cache, parent_alloc, commit, current, end,
-                                  untranslated.back(), parents, should_skip))
-      return 1;
+      // Warm the cache.
+      assert(commit);
+      assert(tree);
+      cache.note_commit_tree(commit, tree);
+      if (is_boundary) {
+        // If this is a boundary commit, skip ahead after warming the cache.
+        if (parse_boundary_metadata(cache, *log, commit, current, end))
+          return 1;
+        continue;
+      }
+
+      // Parse the commit.
+      bool should_skip = false;
+      untranslated.emplace_back();
+      untranslated.back().commit = commit;
+      untranslated.back().tree = tree;
+      if (parse_untranslated_commit(cache, *log, parent_alloc, commit,
+                                    current, end, untranslated.back(), parents,
+                                    should_skip))
+        return 1;
 
-    // Pop off the commit if it's being skipped.
-    if (should_skip)
-      untranslated.pop_back();
-  }
+      // Pop off the commit if it's being skipped.
+      if (should_skip)
+        untranslated.pop_back();
+    }
+  };
+  int status = parse_log();
+  log.reset();
+  if (status)
+    return 1;
 
   // Store the number of commits.
   commits.count = untranslated.size() - commits.first;
@@ -875,7 +934,9 @@ int commit_source::find_dir_commit_parents_to_translate(
   return 0;
 }
 
-int commit_source::parse_boundary_metadata(git_cache &cache, sha1_ref commit,
+int commit_source::parse_boundary_metadata(git_cache &cache,
+                                           git_record_prefetcher &log,
+                                           sha1_ref commit,
                                            const char *&current,
                                            const char *end) {
   const char *metadata = current;
@@ -887,7 +948,7 @@ int commit_source::parse_boundary_metadata(git_cache &cache, sha1_ref commit,
                                      first_parent))
     return error("failed to store boundary metadata for '" +
                  commit->to_string() + "'");
-  cache.store_metadata_if_new(commit, metadata, end_metadata, is_merge,
+  cache.adopt_metadata_if_new(log, commit, metadata, end_metadata, is_merge,
                               first_parent);
   current = end_metadata;
   if (parse_null(current) || parse_newline(current))
@@ -897,9 +958,10 @@ int commit_source::parse_boundary_metadata(git_cache &cache, sha1_ref commit,
 }
 
 int commit_source::parse_untranslated_commit(
-    git_cache &cache, bump_allocator &parent_alloc, sha1_ref commit,
-    const char *&current, const char *end, commit_type &untranslated,
-    std::vector<sha1_ref> &parents, bool &should_skip) {
+    git_cache &cache, git_record_prefetcher &log, bump_allocator &parent_alloc,
+    sha1_ref commit, const char *&current, const char *end,
+    commit_type &untranslated, std::vector<sha1_ref> &parents,
+    bool &should_skip) {
   parents.clear();
   while (!parse_space(current)) {
     // Check for a null character after the space, in case there are no
@@ -935,7 +997,7 @@ int commit_source::parse_untranslated_commit(
   const char *metadata = current;
   if (parse_through_null(current, end))
     return error("missing null character after metadata");
-  cache.store_metadata_if_new(commit, metadata, current - 1,
+  cache.adopt_metadata_if_new(log, commit, metadata, current - 1,
                               /*is_merge=*/parents.size() > 1,
                               parents.empty() ? sha1_ref() : parents.front());
 
@@ -963,8 +1025,10 @@ int commit_source::parse_untranslated_commit(
 }
 
 int commit_source::queue_boundary_commit(git_cache &cache, sha1_ref commit) {
-  if (!worker)
+  if (!worker) {
     worker.reset(new monocommit_worker);
+    worker->snapshot = &cache.snapshot;
+  }
 
   // Look up the monorepo commit.  Needs to be after noting the metadata to
   // avoid needing to shell out to git-log.
@@ -13,10 +13,16 @@ struct table_streams {
 
   explicit table_streams(std::string &&name) : name(std::move(name)) {}
 
+  /// Open the data and index files.  If \a is_optional, a read-only table
+  /// whose files don't exist yet (e.g., in a database created before the
+  /// table was added) is treated as empty.
   int init(int dbfd, bool is_read_only, const unsigned char *magic,
-           int record_offset, int record_size);
+           int record_offset, int record_size, bool is_optional = false);
   int close_files();
 
+  /// Hand buffered writes to the OS, so they survive the process dying.
+  int flush();
+
   ~table_streams() { close_files(); }
 };
 
@@ -87,8 +93,21 @@ template <class T> struct data_query : index_query {
                                                existing_num);
   }
 };
+struct splitrev_table : data_entry_impl<splitrev_table> {
+  static constexpr const long table_offset = magic_size;
+  typedef svnbaserev value_type;
+  static constexpr const char *const table_name = "splitrev";
+  static constexpr const char *const key_name = "commit";
+  static constexpr const char *const value_name = "svnrev";
+
+  static std::string to_dump_string(const svnbaserev &bin) {
+    return std::to_string(bin.get_rev());
+  }
+};
+
 typedef data_query<commits_table> commits_query;
 typedef data_query<svnbase_table> svnbase_query;
+typedef data_query<splitrev_table> splitrev_query;
 } // end namespace
 
 int table_streams::close_files() {
@@ -101,12 +120,26 @@ int table_streams::close_files() {
   return failed;
 }
 
+int table_streams::flush() {
+  int failed = 0;
+  if (data.flush())
+    failed |= error("failed to flush " + name + " data: " + strerror(errno));
+  if (index.flush())
+    failed |= error("failed to flush " + name + " index: " + strerror(errno));
+  return failed;
+}
+
 int table_streams::init(int dbfd, bool is_read_only, const unsigned char *magic,
-                        int record_offset, int record_size) {
+                        int record_offset, int record_size, bool is_optional) {
   int flags = is_read_only ? O_RDONLY : (O_RDWR | O_CREAT);
   std::string index_name = name + ".index";
   int datafd = openat(dbfd, name.c_str(), flags);
+  int data_errno = errno;
   int indexfd = openat(dbfd, index_name.c_str(), flags);
+  if (is_optional && is_read_only && datafd == -1 && indexfd == -1 &&
+      data_errno == ENOENT && errno == ENOENT)
+    return data.init_empty() || index.init_empty();
+
   int has_error = 0;
   if (datafd == -1)
     has_error |= is_read_only ? 1 : error("could not open <dbdir>/" + name);
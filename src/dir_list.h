@@ -4,16 +4,54 @@
 #include "bisect_first_match.h"
 #include "sha1_pool.h"
 #include <bitset>
+#include <cassert>
+#include <cstdint>
+
+#ifndef MT_MAX_DIRS
+#define MT_MAX_DIRS 256
+#endif
 
 namespace {
-struct dir_mask {
-  static constexpr const int max_size = 64;
-  std::bitset<max_size> bits;
+/// A set of dir indices, stored in \a NumWords 64-bit words.  The loops over
+/// the words have constant trip counts, so the compiler unrolls them (and
+/// vectorizes them for wider masks), and a one-word mask costs the same as a
+/// plain uint64_t.
+template <int NumWords> struct basic_dir_mask {
+  static constexpr const int num_words = NumWords;
+  static constexpr const int max_size = 64 * NumWords;
+  uint64_t words[NumWords] = {};
+
+  bool any() const {
+    uint64_t any_bits = 0;
+    for (int w = 0; w != num_words; ++w)
+      any_bits |= words[w];
+    return any_bits;
+  }
+  bool test(int i) const {
+    assert(i >= 0 && i < max_size);
+    return words[i / 64] >> (i % 64) & 1;
+  }
+  void reset(int i) {
+    assert(i >= 0 && i < max_size);
+    words[i / 64] &= ~(uint64_t(1) << (i % 64));
+  }
+  void set(int i, bool value = true) {
+    if (!value)
+      return reset(i);
+    assert(i >= 0 && i < max_size);
+    words[i / 64] |= uint64_t(1) << (i % 64);
+  }
 
-  bool any() const { return bits.any(); }
-  bool test(int i) const { return bits.test(i); }
-  void reset(int i) { bits.reset(i); }
-  void set(int i, bool value = true) { bits.set(i, value); }
+  basic_dir_mask &operator|=(const basic_dir_mask &x) {
+    for (int w = 0; w != num_words; ++w)
+      words[w] |= x.words[w];
+    return *this;
+  }
+  basic_dir_mask &operator&=(const basic_dir_mask &x) {
+    for (int w = 0; w != num_words; ++w)
+      words[w] &= x.words[w];
+    return *this;
+  }
 
   /// Container-like insertion.
   ///
@@ -23,20 +61,21 @@ struct dir_mask {
   /// \post \a test(i) returns false.
   void insert(int i) {
     // TODO: add a unit test.
-    assert(i < max_size);
-    if (bits.none())
-      return;
-    if (i == 0) {
-      bits <<= 1;
-      return;
-    }
-    auto high = bits >> i << i << 1;
-    auto low = bits << (max_size - i) >> (max_size - i);
-    bits = high | low;
-    assert(!bits.test(i));
+    assert(i >= 0 && i < max_size);
+    int iw = i / 64;
+    assert(!(words[num_words - 1] >> 63) && "dropping the last bit");
+    for (int w = num_words - 1; w > iw; --w)
+      words[w] = words[w] << 1 | words[w - 1] >> 63;
+    uint64_t low_mask = (uint64_t(1) << (i % 64)) - 1;
+    uint64_t low = words[iw] & low_mask;
+    words[iw] = (words[iw] & ~low_mask) << 1 | low;
+    assert(!test(i));
   }
 };
 
+/// Configure the number of dirs with -DMT_MAX_DIRS.
+typedef basic_dir_mask<(MT_MAX_DIRS + 63) / 64> dir_mask;
+
 struct dir_name_range {
   const char *const *first = nullptr;
   const char *const *last = nullptr;
@@ -67,6 +106,10 @@ struct dir_list {
   dir_mask tracked_dirs;
   dir_mask repeated_dirs;
 
+  /// Bumped by add_dir for each new dir, since that renumbers the ones after
+  /// it.  Lets callers cache the results of find_dir.
+  int generation = 0;
+
   int add_dir(const char *name, bool &is_new, int &d);
   int lookup_dir(const char *name, const char *end, bool &found) const;
   bool is_dir(const char *name) const;
@@ -134,6 +177,7 @@ int dir_list::add_dir(const char *name, bool &is_new, int &d) {
       active_dirs.insert(d);
     }
     list.insert(list.begin() + d, dir);
+    ++generation;
   }
   if (name[0] == '-' && name[1] == 0)
     list[d].is_root = true;
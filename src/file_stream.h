@@ -21,6 +21,7 @@ public:
   }
   int init_stream(int fd);
   int init_mmap(int fd);
+  int init_empty();
 
   size_t get_num_bytes_on_open() const { return num_bytes_on_open; }
 
@@ -30,6 +31,7 @@ public:
   int read(unsigned char *bytes, int count);
   int seek_and_read(long pos, unsigned char *bytes, int count);
   int write(const unsigned char *bytes, int count);
+  int flush();
 
   int close();
   ~file_stream() { close(); }
@@ -57,6 +59,13 @@ int file_stream::init_mmap(int fd) {
   num_bytes_on_open = mmapped.num_bytes;
   return 0;
 }
+int file_stream::init_empty() {
+  assert(!is_initialized);
+  is_initialized = true;
+  is_stream = false;
+  num_bytes_on_open = 0;
+  return 0;
+}
 int file_stream::seek_end() {
   assert(is_initialized);
   if (is_stream)
@@ -112,6 +121,12 @@ int file_stream::write(const unsigned char *bytes, int count) {
   assert(is_stream);
   return fwrite(bytes, 1, count, stream);
 }
+int file_stream::flush() {
+  assert(is_initialized);
+  if (is_stream)
+    return fflush(stream);
+  return 0;
+}
 
 int file_stream::close() {
   if (!is_initialized)
@@ -2,12 +2,20 @@
 #pragma once
 
 #include "bisect_first_match.h"
+#include "cache_snapshot.h"
 #include "call_git.h"
 #include "dir_list.h"
 #include "error.h"
+#include "git_record_reader.h"
+#include "name_table.h"
+#include "object_store.h"
+#include "object_writer.h"
 #include "parsers.h"
+#include "sha1_hash.h"
 #include "sha1_pool.h"
 #include "split2monodb.h"
+#include "svn2gitdb.h"
+#include "trace_events.h"
 
 namespace {
 struct git_tree {
@@ -41,7 +49,8 @@ struct git_tree {
         return true;
       if (x.type < type)
         return false;
-      return strcmp(name, x.name) < 0;
+      // Names are interned, so any order on the pointers will do.
+      return std::less<const char *>()(name, x.name);
     }
   };
 
@@ -52,6 +61,11 @@ struct git_tree {
   sha1_ref sha1;
   item_type *items = nullptr;
   int num_items = 0;
+
+  /// Set if this came from the cache snapshot and hasn't been seen in the
+  /// repository yet.  An earlier run may have written it without any ref
+  /// reaching it, so git may have pruned it since.
+  bool is_from_snapshot = false;
 };
 
 struct git_cache {
@@ -61,13 +75,21 @@ struct git_cache {
 
   void note_commit_tree(sha1_ref commit, sha1_ref tree);
   void note_mono(sha1_ref split, sha1_ref mono, bool is_based_on_rev);
-  void note_rev(sha1_ref commit, int rev);
+  void note_rev(sha1_ref commit, int rev, bool is_split = false);
   void note_tree(const git_tree &tree);
   void note_metadata(sha1_ref commit, const char *metadata, bool is_merge,
                      sha1_ref first_parent);
   void store_metadata_if_new(sha1_ref commit, const char *metadata,
                              const char *metadata_end, bool is_merge,
                              sha1_ref first_parent);
+
+  /// Like store_metadata_if_new, but keep the metadata where \a reader read
+  /// it instead of copying it.  \a reader is a git_record_reader or a
+  /// git_record_prefetcher.
+  template <class ReaderT>
+  void adopt_metadata_if_new(ReaderT &reader, sha1_ref commit,
+                             const char *metadata, const char *metadata_end,
+                             bool is_merge, sha1_ref first_parent);
   const char *store_metadata_impl(sha1_ref commit, const char *metadata,
                                   const char *metadata_end, bool is_merge,
                                   sha1_ref first_parent);
@@ -98,10 +120,18 @@ struct git_cache {
 
   /// Add an entry to the svnbaserev table.
   int set_base_rev(sha1_ref commit, int rev);
+  int insert_base_rev(sha1_ref commit, int rev);
 
-  /// Figure out the base rev by looking in the svnbaserev table.
+  /// Figure out the base rev by looking in the svnbaserev table, or in the
+  /// svn2git reverse index for upstream commits.
   int compute_base_rev(sha1_ref commit, int &rev);
 
+  /// Look up / record the rev of a split commit in the splitrev table, which
+  /// remembers the result of parsing git-svn-id across processes.  A rev of 0
+  /// means the commit is not an upstream SVN commit.
+  int lookup_split_rev(sha1_ref commit, int &rev);
+  int set_split_rev(sha1_ref commit, int rev);
+
   /// Figure out the monorepo commit without doing any rev-based heroics.  Note
   /// that this still hits the in-memory cache.  If a previous call to
   /// compute_mono cached a result based on the rev, then is_based_on_rev will
@@ -113,9 +143,30 @@ struct git_cache {
   int compute_mono(sha1_ref split, sha1_ref &mono);
 
   int set_mono(sha1_ref split, sha1_ref mono);
+  int insert_mono(sha1_ref split, sha1_ref mono);
   int ls_tree(git_tree &tree);
   int mktree(git_tree &tree);
 
+  /// Compute the raw object git would write for \a tree, and its name.
+  static void format_tree(const git_tree &tree, std::string &raw);
+  static void hash_tree(const git_tree &tree, std::string &raw,
+                        binary_sha1 &sha1);
+
+  /// Name new trees and commits here and have \a writer write them in the
+  /// background.  Database updates wait for finish_pipeline(), so the
+  /// database never points at a commit that git hasn't written.
+  void start_pipeline();
+
+  /// Wait for pipelined objects to be written, before asking git about them.
+  int wait_for_objects();
+
+  /// Wait for pipelined objects and apply the database updates so far,
+  /// leaving the pipeline running.
+  int flush_pipeline();
+
+  /// Wait for pipelined objects, then apply the database updates.
+  int finish_pipeline();
+
   int merge_base(sha1_ref a, sha1_ref b, sha1_ref &base);
   int rev_parse(const std::string &rev, sha1_ref &result);
   bool merge_base_is_ancestor(sha1_ref a, sha1_ref b);
@@ -124,7 +175,21 @@ struct git_cache {
   static int ls_tree_impl(sha1_ref sha1, std::vector<char> &reply);
   int note_tree_raw(sha1_ref sha1, const char *rawtree);
 
-  const char *make_name(const char *name, size_t len);
+  /// Intern \a len bytes of \a name, which need not be null-terminated.
+  /// Interned names can be compared by pointer and have a name_info.
+  const char *make_name(const char *name, size_t len) {
+    return names.intern(name, len);
+  }
+
+  /// Return dirs.find_dir for an interned name, cached in its name_info.
+  int find_dir(const char *name) {
+    name_info &info = name_info::get(name);
+    if (info.dir_generation != dirs.generation) {
+      info.dir_index = dirs.find_dir(name);
+      info.dir_generation = dirs.generation;
+    }
+    return info.dir_index;
+  }
   int parse_name(const char *&current, const char *&name);
 
   git_tree::item_type *make_items(git_tree::item_type *first,
@@ -134,8 +199,7 @@ struct git_cache {
     // These are %cn, %cd, %ce, etc., from `man git-log`.
     std::string cn, cd, ce;
     std::string an, ad, ae;
-    std::vector<textual_sha1> parents;
-    std::vector<const char *> args;
+    commit_object object;
     std::string message;
   };
   struct parsed_metadata {
@@ -165,6 +229,7 @@ struct git_cache {
                   commit_tree_buffers &buffers, dir_name_range dir_names);
   int commit_tree_impl(sha1_ref tree, const std::vector<sha1_ref> &parents,
                        sha1_ref &commit, commit_tree_buffers &buffers);
+
   void apply_merge_authorship(commit_tree_buffers &buffers,
                               parsed_metadata::string_ref cd);
   void apply_authorship(commit_tree_buffers &buffers,
@@ -207,13 +272,46 @@ struct git_cache {
     sha1_ref commit;
     int rev = -1;
 
+    /// Set for split commits, whose revs can depend on the database (see
+    /// compute_rev_with_metadata).  They're left out of the snapshot.
+    bool is_split = false;
+
     explicit git_svn_base_rev(const binary_sha1 &sha1) : commit(&sha1) {}
     explicit operator const binary_sha1 &() const { return *commit; }
   };
 
-  git_cache(split2monodb &db, mmapped_file &svn2git, sha1_pool &pool,
+  git_cache(split2monodb &db, svn2git_reader &svn2git, sha1_pool &pool,
             dir_list &dirs)
-      : db(db), svn2git(svn2git), pool(pool), dirs(dirs) {}
+      : db(db), svn2git(svn2git), pool(pool), dirs(dirs),
+        has_unwritten_objects(!object_store::get().persists_objects()) {
+    // These grow to millions of entries on big runs; keep them on huge pages
+    // to save TLB misses in trie walks.
+    trees.use_huge_pages();
+    commit_trees.use_huge_pages();
+    revs.use_huge_pages();
+    monos.use_huge_pages();
+    metadata.use_huge_pages();
+    name_alloc.use_huge_pages();
+    tree_item_alloc.use_huge_pages();
+  }
+
+  /// Load a snapshot saved by an earlier run.  Lookups that miss in memory
+  /// check it before asking git.
+  int load_snapshot(const char *path);
+
+  /// Save everything learned from git (plus anything still unused from the
+  /// loaded snapshot, up to MT_CACHE_MAX_RECORDS records in all) to the path
+  /// given to load_snapshot.  Does nothing if the database is read-only.
+  int save_snapshot();
+
+  int lookup_snapshot_commit_tree(sha1_ref commit, sha1_ref &tree);
+  int lookup_snapshot_tree(git_tree &tree);
+  int lookup_snapshot_rev(sha1_ref commit, int &rev);
+  int lookup_snapshot_metadata(sha1_ref commit, const char *&metadata,
+                               bool &is_merge, sha1_ref &first_parent);
+
+  /// Print bytes used and wasted by each allocator.
+  void print_allocator_stats(FILE *file) const;
 
   static constexpr const int num_cache_bits = 20;
 
@@ -234,17 +332,30 @@ struct git_cache {
   sha1_trie<sha1_metadata> metadata;
   sha1_trie<sha1_single> being_translated;
 
-  std::vector<const char *> names;
+  name_table names;
   std::vector<std::unique_ptr<char[]>> big_metadata;
 
   bump_allocator name_alloc;
   bump_allocator tree_item_alloc;
   split2monodb &db;
-  mmapped_file &svn2git;
+  svn2git_reader &svn2git;
+  svn2git_rindex svn2git_index;
   sha1_pool &pool;
   dir_list &dirs;
   std::vector<char> git_reply;
   std::string git_input;
+
+  std::unique_ptr<object_writer> writer;
+  std::vector<std::pair<sha1_ref, sha1_ref>> pending_monos;
+  std::vector<std::pair<sha1_ref, int>> pending_base_revs;
+
+  /// Set if the pipeline failed, or the object store keeps new objects in
+  /// memory, leaving objects in the cache that git never wrote.  The
+  /// database must not point at them.
+  bool has_unwritten_objects = false;
+
+  cache_snapshot snapshot;
+  std::string snapshot_path;
 };
 } // end namespace
 
@@ -283,6 +394,176 @@ constexpr const char *git_tree::item_type::get_type(type_enum type) {
   return nullptr;
 }
 
+void git_cache::print_allocator_stats(FILE *file) const {
+  pool.root.print_allocator_stats(file, "sha1s");
+  trees.print_allocator_stats(file, "trees");
+  commit_trees.print_allocator_stats(file, "commit-trees");
+  revs.print_allocator_stats(file, "revs");
+  monos.print_allocator_stats(file, "monos");
+  metadata.print_allocator_stats(file, "metadata");
+  being_translated.print_allocator_stats(file, "being-translated");
+  name_alloc.print_stats(file, "names");
+  names.print_stats(file, "name-table");
+  tree_item_alloc.print_stats(file, "tree-items");
+}
+
+int git_cache::load_snapshot(const char *path) {
+  // A missing or unreadable cache is not fatal; it'll be rewritten by
+  // save_snapshot.
+  snapshot_path = path;
+  return snapshot.load(path);
+}
+
+int git_cache::lookup_snapshot_commit_tree(sha1_ref commit, sha1_ref &tree) {
+  auto *record = snapshot.find_record<cache_snapshot::commit_tree_record>(
+      cache_snapshot::commit_trees_section, *commit);
+  if (!record)
+    return 1;
+  tree = pool.lookup(snapshot.get_sha1(record->tree));
+  note_commit_tree(commit, tree);
+  return 0;
+}
+
+int git_cache::lookup_snapshot_tree(git_tree &tree) {
+  auto *record = snapshot.find_record<cache_snapshot::tree_record>(
+      cache_snapshot::trees_section, *tree.sha1);
+  if (!record)
+    return 1;
+
+  constexpr const int max_items = dir_mask::max_size;
+  if (record->num_items > max_items ||
+      record->first_item + uint64_t(record->num_items) >
+          snapshot.get_count(cache_snapshot::tree_items_section))
+    return 1;
+  git_tree::item_type items[max_items];
+  auto *first = snapshot.get_section<cache_snapshot::tree_item_record>(
+                    cache_snapshot::tree_items_section) +
+                record->first_item;
+  for (uint32_t i = 0; i != record->num_items; ++i) {
+    const cache_snapshot::tree_item_record &item = first[i];
+    if (item.type > git_tree::item_type::submodule ||
+        item.name >= snapshot.get_count(cache_snapshot::names_section))
+      return 1;
+    const char *name = snapshot.get_name(item.name);
+    items[i].sha1 = pool.lookup(snapshot.get_sha1(item.sha1));
+    items[i].name = make_name(name, strlen(name));
+    items[i].type = git_tree::item_type::type_enum(item.type);
+  }
+
+  tree.num_items = record->num_items;
+  tree.items = make_items(items, items + record->num_items);
+  tree.is_from_snapshot = true;
+  note_tree(tree);
+  return 0;
+}
+
+int git_cache::lookup_snapshot_rev(sha1_ref commit, int &rev) {
+  auto *record = snapshot.find_record<cache_snapshot::rev_record>(
+      cache_snapshot::revs_section, *commit);
+  if (!record)
+    return 1;
+  rev = record->rev;
+  note_rev(commit, rev);
+  return 0;
+}
+
+int git_cache::lookup_snapshot_metadata(sha1_ref commit, const char *&metadata,
+                                        bool &is_merge,
+                                        sha1_ref &first_parent) {
+  auto *record = snapshot.find_record<cache_snapshot::metadata_record>(
+      cache_snapshot::metadata_section, *commit);
+  if (!record ||
+      record->text >= snapshot.get_count(cache_snapshot::text_section))
+    return 1;
+
+  // Point straight into the mapping; the text is already null-terminated.
+  metadata = snapshot.get_text(record->text);
+  is_merge = record->is_merge;
+  first_parent = record->first_parent == cache_snapshot::no_sha1
+                     ? sha1_ref()
+                     : pool.lookup(snapshot.get_sha1(record->first_parent));
+  note_metadata(commit, metadata, is_merge, first_parent);
+  return 0;
+}
+
+int git_cache::save_snapshot() {
+  assert(!snapshot_path.empty());
+  if (db.is_read_only)
+    return 0;
+
+  cache_snapshot_builder builder;
+  commit_trees.for_each([&](const sha1_pair &pair) {
+    builder.add_commit_tree(*pair.key, *pair.value);
+  });
+  revs.for_each([&](const git_svn_base_rev &rev) {
+    if (!rev.is_split)
+      builder.add_rev(*rev.commit, rev.rev);
+  });
+  trees.for_each([&](const git_tree &tree) {
+    builder.start_tree(*tree.sha1);
+    for (int i = 0; i != tree.num_items; ++i)
+      builder.add_tree_item(*tree.items[i].sha1, tree.items[i].name,
+                            tree.items[i].type);
+  });
+  metadata.for_each([&](const sha1_metadata &m) {
+    if (m.metadata)
+      builder.add_metadata(*m.commit, m.metadata, m.is_merge,
+                           m.first_parent ? &*m.first_parent : nullptr);
+  });
+
+  // Carry over what the old snapshot knew that this run didn't look at, as
+  // long as there's room.  What this run looked at is always kept, so the
+  // bound only evicts records that went unused.
+  size_t max_records = 1 << 24;
+  if (const char *var = getenv("MT_CACHE_MAX_RECORDS"))
+    max_records = strtoul(var, nullptr, 10);
+  auto has_room = [&builder, max_records]() {
+    return builder.commit_trees.size() + builder.revs.size() +
+               builder.trees.size() + builder.metadata.size() <
+           max_records;
+  };
+  if (!snapshot.empty()) {
+    typedef cache_snapshot cs;
+    auto &old = snapshot;
+    auto *ct =
+        old.get_section<cs::commit_tree_record>(cs::commit_trees_section);
+    for (size_t i = 0, ie = old.get_count(cs::commit_trees_section);
+         i != ie && has_room(); ++i)
+      if (!commit_trees.lookup(old.get_sha1(ct[i].commit)))
+        builder.add_commit_tree(old.get_sha1(ct[i].commit),
+                                old.get_sha1(ct[i].tree));
+    auto *r = old.get_section<cs::rev_record>(cs::revs_section);
+    for (size_t i = 0, ie = old.get_count(cs::revs_section);
+         i != ie && has_room(); ++i)
+      if (!revs.lookup(old.get_sha1(r[i].commit)))
+        builder.add_rev(old.get_sha1(r[i].commit), r[i].rev);
+    auto *t = old.get_section<cs::tree_record>(cs::trees_section);
+    auto *items = old.get_section<cs::tree_item_record>(cs::tree_items_section);
+    for (size_t i = 0, ie = old.get_count(cs::trees_section);
+         i != ie && has_room(); ++i) {
+      if (trees.lookup(old.get_sha1(t[i].tree)))
+        continue;
+      builder.start_tree(old.get_sha1(t[i].tree));
+      for (uint32_t j = 0; j != t[i].num_items; ++j) {
+        auto &item = items[t[i].first_item + j];
+        builder.add_tree_item(old.get_sha1(item.sha1), old.get_name(item.name),
+                              item.type);
+      }
+    }
+    auto *m = old.get_section<cs::metadata_record>(cs::metadata_section);
+    for (size_t i = 0, ie = old.get_count(cs::metadata_section);
+         i != ie && has_room(); ++i)
+      if (!metadata.lookup(old.get_sha1(m[i].commit)))
+        builder.add_metadata(old.get_sha1(m[i].commit), old.get_text(m[i].text),
+                             m[i].is_merge,
+                             m[i].first_parent == cs::no_sha1
+                                 ? nullptr
+                                 : &old.get_sha1(m[i].first_parent));
+  }
+
+  return builder.write(snapshot_path.c_str());
+}
+
 void git_cache::note_being_translated(sha1_ref commit) {
   assert(commit);
   bool was_inserted = false;
@@ -299,11 +580,12 @@ void git_cache::note_commit_tree(sha1_ref commit, sha1_ref tree) {
   inserted->value = tree;
 }
 
-void git_cache::note_rev(sha1_ref commit, int rev) {
+void git_cache::note_rev(sha1_ref commit, int rev, bool is_split) {
   bool was_inserted = false;
   git_svn_base_rev *inserted = revs.insert(*commit, was_inserted);
   assert(inserted);
   inserted->rev = rev;
+  inserted->is_split = is_split;
 }
 
 void git_cache::note_mono(sha1_ref split, sha1_ref mono, bool is_based_on_rev) {
@@ -387,10 +669,22 @@ int git_cache::lookup_metadata(sha1_ref commit, const char *&metadata,
 }
 
 int git_cache::set_mono(sha1_ref split, sha1_ref mono) {
+  if (writer)
+    pending_monos.emplace_back(split, mono);
+  else if (insert_mono(split, mono))
+    return 1;
+  note_mono(split, mono, /*is_based_on_rev=*/false);
+  return 0;
+}
+
+int git_cache::insert_mono(sha1_ref split, sha1_ref mono) {
+  if (has_unwritten_objects || db.is_read_only)
+    return 0;
+
+  trace_scope scope("db", "insert commits");
   if (commits_query(*split).insert_data_or_check_equal(db.commits, *mono))
     return error("failed to map split " + split->to_string() + " to mono " +
                  mono->to_string());
-  note_mono(split, mono, /*is_based_on_rev=*/false);
   return 0;
 }
 
@@ -401,6 +695,7 @@ int git_cache::compute_mono_from_table(sha1_ref split, sha1_ref &mono,
 
   is_based_on_rev = false;
   binary_sha1 sha1;
+  trace_scope scope("db", "lookup commits");
   if (commits_query(*split).lookup_data(db.commits, sha1))
     return 1;
 
@@ -422,13 +717,12 @@ int git_cache::compute_mono(sha1_ref split, sha1_ref &mono) {
   // monorepo commit for it.  Not all historical branches got translated.
   // Unfortunately this makes it impossible to differentiate "not mapped" and
   // "no monorepo commit" from here.
-  auto *bytes = reinterpret_cast<const unsigned char *>(svn2git.bytes);
-  long offset = 20 * rev;
-  if (offset + 20 > svn2git.num_bytes)
+  const unsigned char *bytes = svn2git.lookup(rev);
+  if (!bytes)
     return 1;
 
   binary_sha1 sha1;
-  sha1.from_binary(bytes + offset);
+  sha1.from_binary(bytes);
   mono = pool.lookup(sha1);
   if (!mono)
     return 1;
@@ -440,22 +734,15 @@ int git_cache::compute_mono(sha1_ref split, sha1_ref &mono) {
 int git_cache::compute_commit_tree(sha1_ref commit, sha1_ref &tree) {
   if (!lookup_commit_tree(commit, tree))
     return 0;
+  if (!lookup_snapshot_commit_tree(commit, tree))
+    return 0;
 
   assert(commit);
-  std::string ref = textual_sha1(*commit).bytes;
-  ref += "^{tree}";
-  const char *argv[] = {"git", "rev-parse", "--verify", ref.c_str(), nullptr};
-  git_reply.clear();
-  if (call_git(argv, nullptr, "", git_reply))
-    return 1;
-
-  git_reply.push_back(0);
-  const char *end = nullptr;
-  textual_sha1 text;
-  if (text.from_input(&git_reply[0], &end) || *end++ != '\n' || *end)
+  binary_sha1 sha1;
+  if (object_store::get().read_commit_tree(*commit, sha1))
     return 1;
 
-  tree = pool.lookup(text);
+  tree = pool.lookup(sha1);
   note_commit_tree(commit, tree);
   return 0;
 }
@@ -464,25 +751,13 @@ int git_cache::compute_metadata(sha1_ref commit, const char *&metadata,
                                 bool &is_merge, sha1_ref &first_parent) {
   if (!lookup_metadata(commit, metadata, is_merge, first_parent))
     return 0;
+  if (!lookup_snapshot_metadata(commit, metadata, is_merge, first_parent))
+    return 0;
 
-  textual_sha1 sha1(*commit);
-  const char *args[] = {
-      "git",
-      "log",
-      "--date=raw",
-      "--no-walk",
-      "--format=%P%x00%an%n%cn%n%ad%n%cd%n%ae%n%ce%n%B%x00",
-      sha1.bytes,
-      nullptr,
-  };
-  git_reply.clear();
-  if (call_git(args, nullptr, "", git_reply))
-    return error(std::string("failed to read commit metadata for ") +
-                 sha1.bytes);
-  if (git_reply.empty())
-    return error("missing commit metadata for " + sha1.to_string());
-
-  git_reply.push_back(0);
+  if (object_store::get().read_commit(*commit, git_reply))
+    return error("failed to read commit metadata for " + commit->to_string());
+  if (git_reply.size() <= 1)
+    return error("missing commit metadata for " + commit->to_string());
 
   metadata = git_reply.data();
   const char *end_metadata = metadata + git_reply.size() - 1;
@@ -535,6 +810,21 @@ void git_cache::store_metadata_if_new(sha1_ref commit, const char *metadata,
                             first_parent);
 }
 
+template <class ReaderT>
+void git_cache::adopt_metadata_if_new(ReaderT &reader, sha1_ref commit,
+                                      const char *metadata,
+                                      const char *metadata_end, bool is_merge,
+                                      sha1_ref first_parent) {
+  if (this->metadata.lookup(*commit))
+    return;
+
+  // The field is already null-terminated, so there's nothing to copy.
+  assert(!*metadata_end);
+  (void)metadata_end;
+  reader.pin();
+  note_metadata(commit, metadata, is_merge, first_parent);
+}
+
 const char *git_cache::store_metadata_impl(sha1_ref commit,
                                            const char *metadata,
                                            const char *metadata_end,
@@ -562,17 +852,28 @@ int git_cache::set_base_rev(sha1_ref commit, int rev) {
   if (rev > 0)
     return error("unexpected upstream mapping from r" + std::to_string(rev) +
                  " to " + commit->to_string());
+  if (writer)
+    pending_base_revs.emplace_back(commit, rev);
+  else if (insert_base_rev(commit, rev))
+    return 1;
+  note_rev(commit, rev);
+  return 0;
+}
 
+int git_cache::insert_base_rev(sha1_ref commit, int rev) {
   // It's a little unfortunate to be storing something that is never positive
   // as a negative number, but a long-standing bug means that existing
   // databases have negative numbers in them.  It's not clear there's good
   // motivation to change now.
+  if (has_unwritten_objects || db.is_read_only)
+    return 0;
+
   svnbaserev dbrev;
   dbrev.set_rev(rev);
+  trace_scope scope("db", "insert svnbase");
   if (svnbase_query(*commit).insert_data_or_check_equal(db.svnbase, dbrev))
     return error("failed to map commit " + commit->to_string() + " to rev " +
                  std::to_string(rev));
-  note_rev(commit, rev);
   return 0;
 }
 
@@ -584,10 +885,19 @@ int git_cache::compute_rev(sha1_ref commit, bool is_split, int &rev) {
 int git_cache::compute_base_rev(sha1_ref commit, int &rev) {
   if (!lookup_rev(commit, rev))
     return 0;
+  if (!lookup_snapshot_rev(commit, rev))
+    return 0;
 
   svnbaserev dbrev;
-  if (svnbase_query(*commit).lookup_data(db.svnbase, dbrev))
-    return 1;
+  trace_scope scope("db", "lookup svnbase");
+  if (svnbase_query(*commit).lookup_data(db.svnbase, dbrev)) {
+    // llvm.org upstream commits aren't in svnbase, but they are in svn2git.
+    // The reverse index saves parsing llvm-rev out of the commit message.
+    if (svn2git_index.lookup(*commit, svn2git, rev))
+      return 1;
+    note_rev(commit, rev);
+    return 0;
+  }
 
   // We expect this to always be negative, since llvm.org upstream commits
   // don't get mapped.
@@ -596,12 +906,38 @@ int git_cache::compute_base_rev(sha1_ref commit, int &rev) {
   return 0;
 }
 
+int git_cache::lookup_split_rev(sha1_ref commit, int &rev) {
+  svnbaserev dbrev;
+  trace_scope scope("db", "lookup splitrev");
+  if (splitrev_query(*commit).lookup_data(db.splitrev, dbrev))
+    return 1;
+  rev = dbrev.get_rev();
+  note_rev(commit, rev, /*is_split=*/true);
+  return 0;
+}
+
+int git_cache::set_split_rev(sha1_ref commit, int rev) {
+  assert(rev >= 0);
+  note_rev(commit, rev, /*is_split=*/true);
+  if (db.is_read_only)
+    return 0;
+
+  svnbaserev dbrev;
+  dbrev.set_rev(rev);
+  trace_scope scope("db", "insert splitrev");
+  if (splitrev_query(*commit).insert_data_or_check_equal(db.splitrev, dbrev))
+    return error("failed to map split commit " + commit->to_string() +
+                 " to rev " + std::to_string(rev));
+  return 0;
+}
+
 int git_cache::compute_rev_with_metadata(sha1_ref commit, bool is_split,
                                          int &rev, const char *raw_metadata,
                                          bool is_merge, sha1_ref first_parent) {
   if (is_split) {
-    // Split commits aren't mapped in the svnbaserev table.
-    if (!lookup_rev(commit, rev))
+    // Split commits aren't mapped in the svnbaserev table, but the result of
+    // parsing them is remembered in the splitrev table.
+    if (!lookup_rev(commit, rev) || !lookup_split_rev(commit, rev))
       return 0;
   } else {
     // Starts with a call to lookup_rev.
@@ -615,21 +951,26 @@ int git_cache::compute_rev_with_metadata(sha1_ref commit, bool is_split,
 
   // Merges cannot be upstream SVN commits.
   if (is_merge)
-    return 1;
+    return is_split ? set_split_rev(commit, 0) | 1 : 1;
 
+  // Only remember a parsed rev in the splitrev table if it doesn't depend on
+  // what's in the split2mono database.
+  bool depends_on_db = false;
   if (is_split && first_parent) {
     // If first_parent is in the split2mono database, then commit is not an
     // upstream SVN commit.  This helps to avoid mapping commits like
     // 8bf1494af87f222db2b637a3be6cee40a9a51a62 from swift-clang to commit
     // being cherry-picked (in this case, r354826), since the cherry-pick's
-    // parent will not be upstream.
+    // parent will not be upstream.  Either answer can change once
+    // first_parent is translated, so don't remember it.
     if (is_being_translated(first_parent))
       return 1;
     sha1_ref mono;
     bool is_based_on_rev = false;
-    if (!compute_mono_from_table(first_parent, mono, is_based_on_rev))
-      if (!is_based_on_rev)
-        return 1;
+    if (compute_mono_from_table(first_parent, mono, is_based_on_rev))
+      depends_on_db = true;
+    else if (!is_based_on_rev)
+      return 1;
   }
 
   parsed_metadata parsed;
@@ -639,7 +980,7 @@ int git_cache::compute_rev_with_metadata(sha1_ref commit, bool is_split,
   // Check that committer and author match.
   if (parsed.an != parsed.cn || parsed.ae != parsed.ce ||
       parsed.ad != parsed.cd)
-    return 1;
+    return is_split ? set_split_rev(commit, 0) | 1 : 1;
 
   const char *current = parsed.message;
   while (*current) {
@@ -670,8 +1011,11 @@ int git_cache::compute_rev_with_metadata(sha1_ref commit, bool is_split,
       break;
 
     rev = parsed_rev;
-    note_rev(commit, rev);
-    return 0;
+    if (depends_on_db) {
+      note_rev(commit, rev, /*is_split=*/true);
+      return 0;
+    }
+    return set_split_rev(commit, rev);
   }
 
   // Monorepo commits should always have a rev, either from the 'llvm-rev:' tag
@@ -681,35 +1025,7 @@ int git_cache::compute_rev_with_metadata(sha1_ref commit, bool is_split,
 
   // This is a split commit that's not an upstream commit.
   rev = 0;
-  note_rev(commit, rev);
-  return 0;
-}
-
-const char *git_cache::make_name(const char *name, size_t len) {
-  bool found = false;
-  auto d = bisect_first_match(dirs.list.begin(), dirs.list.end(),
-                              [&name, &found](const dir_type &dir) {
-                                int diff = strcmp(name, dir.name);
-                                found |= !diff;
-                                return diff <= 0;
-                              });
-  assert(!found || d != dirs.list.end());
-  if (found)
-    return d->name;
-
-  auto n = bisect_first_match(names.begin(), names.end(),
-                              [&name, &found](const char *x) {
-                                int diff = strcmp(name, x);
-                                found |= !diff;
-                                return diff <= 0;
-                              });
-  assert(!found || n != names.end());
-  if (found)
-    return *n;
-  char *allocated = new (name_alloc) char[len + 1];
-  strncpy(allocated, name, len);
-  allocated[len] = 0;
-  return *names.insert(n, allocated);
+  return set_split_rev(commit, rev);
 }
 
 git_tree::item_type *git_cache::make_items(git_tree::item_type *first,
@@ -727,14 +1043,17 @@ int git_cache::ls_tree(git_tree &tree) {
 
   // Check if this is a commit whose tree we have, likely because we built it.
   sha1_ref tree_sha1;
-  if (!lookup_commit_tree(tree.sha1, tree_sha1)) {
+  if (!lookup_commit_tree(tree.sha1, tree_sha1) ||
+      !lookup_snapshot_commit_tree(tree.sha1, tree_sha1)) {
     sha1_ref commit = tree.sha1;
     tree.sha1 = tree_sha1;
-    int status = lookup_tree(tree);
+    int status = lookup_tree(tree) && lookup_snapshot_tree(tree);
     tree.sha1 = commit;
     if (!status)
       return 0;
   }
+  if (!lookup_snapshot_tree(tree))
+    return 0;
 
   if (ls_tree_impl(tree.sha1, git_reply) ||
       note_tree_raw(tree.sha1, git_reply.data()))
@@ -746,13 +1065,7 @@ int git_cache::ls_tree(git_tree &tree) {
 
 int git_cache::ls_tree_impl(sha1_ref sha1, std::vector<char> &git_reply) {
   assert(!sha1->is_zeros());
-  std::string ref = sha1->to_string();
-  const char *args[] = {"git", "ls-tree", "--full-tree", ref.c_str(), nullptr};
-  git_reply.clear();
-  if (call_git(args, nullptr, "", git_reply))
-    return 1;
-  git_reply.push_back(0);
-  return 0;
+  return object_store::get().read_tree(*sha1, git_reply);
 }
 
 int git_cache::note_tree_raw(sha1_ref sha1, const char *rawtree) {
@@ -838,37 +1151,77 @@ int git_cache::parse_name(const char *&current, const char *&name) {
   return 1;
 }
 
+void git_cache::format_tree(const git_tree &tree, std::string &raw) {
+  // Git sorts tree entries as if subtrees had a trailing '/'.
+  constexpr const int max_items = dir_mask::max_size;
+  assert(tree.num_items <= max_items);
+  const git_tree::item_type *sorted[max_items];
+  for (int i = 0; i != tree.num_items; ++i)
+    sorted[i] = &tree.items[i];
+  auto get_suffix = [](const git_tree::item_type &item) {
+    return item.type == git_tree::item_type::tree ? '/' : '\0';
+  };
+  std::sort(sorted, sorted + tree.num_items,
+            [&get_suffix](const git_tree::item_type *lhs,
+                          const git_tree::item_type *rhs) {
+              const char *l = lhs->name, *r = rhs->name;
+              for (; *l && *l == *r; ++l, ++r)
+                ;
+              unsigned char lch = *l ? *l : get_suffix(*lhs);
+              unsigned char rch = *r ? *r : get_suffix(*rhs);
+              return lch < rch;
+            });
+
+  // Git writes tree modes without leading zeros.
+  raw.clear();
+  for (int i = 0; i != tree.num_items; ++i) {
+    const char *mode = sorted[i]->get_mode();
+    mode += *mode == '0';
+    raw += mode;
+    raw += ' ';
+    raw.append(sorted[i]->name, strlen(sorted[i]->name) + 1);
+    raw.append(reinterpret_cast<const char *>(sorted[i]->sha1->bytes), 20);
+  }
+}
+
+void git_cache::hash_tree(const git_tree &tree, std::string &raw,
+                          binary_sha1 &sha1) {
+  format_tree(tree, raw);
+  object_store::hash_object("tree", raw, sha1);
+}
+
 int git_cache::mktree(git_tree &tree) {
   assert(!tree.sha1);
 
-  git_input.clear();
-  git_input.reserve(tree.num_items *
-                    (sizeof("tree") + sizeof("100644") + sizeof(textual_sha1) +
-                     sizeof("somedirname") + sizeof("  \t\n")));
-  for (auto i = 0; i != tree.num_items; ++i) {
-    assert(tree.items[i].sha1);
-    git_input += tree.items[i].get_mode();
-    git_input += ' ';
-    git_input += tree.items[i].get_type();
-    git_input += ' ';
-    git_input += textual_sha1(*tree.items[i].sha1).bytes;
-    git_input += '\t';
-    git_input += tree.items[i].name;
-    git_input += '\n';
+  // Trees are content-addressed, so if this combination of items was seen
+  // before (e.g., by a repeated merge or a fast cherry-pick) there is no need
+  // to ask git to write it again.
+  binary_sha1 computed;
+  hash_tree(tree, git_input, computed);
+  git_tree existing;
+  existing.sha1 = pool.lookup(computed);
+  if (!lookup_tree(existing) || !lookup_snapshot_tree(existing)) {
+    // Only trust a tree from the snapshot if git still has it.
+    if (!existing.is_from_snapshot ||
+        !object_store::get().check_object(*existing.sha1)) {
+      trees.lookup(*existing.sha1)->is_from_snapshot = false;
+      tree.sha1 = existing.sha1;
+      return 0;
+    }
   }
 
-  const char *argv[] = {"git", "mktree", nullptr};
-  git_reply.clear();
-  if (call_git(argv, nullptr, git_input, git_reply))
-    return 1;
-  git_reply.push_back(0);
+  if (writer) {
+    tree.sha1 = pool.lookup(computed);
+    note_tree(tree);
+    writer->push(object_writer::job_type{tree.sha1, true, git_input, {}});
+    return 0;
+  }
 
-  textual_sha1 text;
-  const char *end = nullptr;
-  if (text.from_input(&git_reply[0], &end) || *end++ != '\n' || *end)
+  binary_sha1 written;
+  if (object_store::get().write_tree(git_input, written))
     return 1;
 
-  tree.sha1 = pool.lookup(text);
+  tree.sha1 = pool.lookup(written);
   note_tree(tree);
   return 0;
 }
@@ -886,70 +1239,33 @@ int git_cache::merge_base(sha1_ref a, sha1_ref b, sha1_ref &base) {
   assert(b);
   assert(!base);
 
-  textual_sha1 a_text(*a);
-  textual_sha1 b_text(*b);
-  const char *argv[] = {"git", "merge-base", a_text.bytes, b_text.bytes,
-                        nullptr};
-  git_reply.clear();
-  if (call_git(argv, nullptr, "", git_reply, /*ignore_errors=*/true))
-    return 1;
-  git_reply.push_back(0);
-
-  textual_sha1 base_text;
-  const char *end = nullptr;
-  if (base_text.from_input(&git_reply[0], &end) || *end++ != '\n' || *end)
-    return 1;
-
   // Doesn't seem like we need a cache for the response; just put the SHA-1 in
   // the pool and return.
-  base = pool.lookup(base_text);
+  binary_sha1 sha1;
+  if (object_store::get().merge_base(*a, *b, sha1))
+    return 1;
+  base = pool.lookup(sha1);
   return 0;
 }
 
 int git_cache::rev_parse(const std::string &rev, sha1_ref &result) {
-  const char *argv[] = {"git", "rev-parse", "--verify", rev.c_str(), nullptr};
-  git_reply.clear();
-  if (call_git(argv, nullptr, "", git_reply, /*ignore_errors=*/true))
-    return 1;
-  git_reply.push_back(0);
-
-  textual_sha1 base_text;
-  const char *end = nullptr;
-  if (base_text.from_input(&git_reply[0], &end) || *end++ != '\n' || *end)
+  binary_sha1 sha1;
+  if (object_store::get().rev_parse(rev, sha1))
     return 1;
-
-  result = pool.lookup(base_text);
+  result = pool.lookup(sha1);
   return 0;
 }
 
 int git_cache::merge_base_independent(std::vector<sha1_ref> &commits) {
-  // Fill these first to avoid memory corruption.
-  std::vector<textual_sha1> sha1s;
+  std::vector<binary_sha1> sha1s;
   for (auto &sha1 : commits)
-    sha1s.emplace_back(*sha1);
+    sha1s.push_back(*sha1);
   commits.clear();
 
-  std::vector<const char *> argv;
-  argv.push_back("git");
-  argv.push_back("merge-base");
-  argv.push_back("--independent");
-  for (auto &sha1 : sha1s)
-    argv.push_back(sha1.bytes);
-  argv.push_back(nullptr);
-
-  git_reply.clear();
-  if (call_git(argv.data(), nullptr, "", git_reply))
+  if (object_store::get().merge_base_independent(sha1s))
     return 1;
-
-  git_reply.push_back(0);
-  const char *current = git_reply.data();
-  while (*current) {
-    textual_sha1 text;
-    if (text.from_input(current, &current) || *current++ != '\n')
-      return 1;
-
-    commits.push_back(pool.lookup(text));
-  }
+  for (auto &sha1 : sha1s)
+    commits.push_back(pool.lookup(sha1));
   return 0;
 }
 
@@ -1212,41 +1528,77 @@ int git_cache::commit_tree_impl(sha1_ref tree,
                                 const std::vector<sha1_ref> &parents,
                                 sha1_ref &commit,
                                 commit_tree_buffers &buffers) {
-  const char *envp[] = {buffers.an.c_str(),
-                        buffers.ae.c_str(),
-                        buffers.ad.c_str(),
-                        buffers.cn.c_str(),
-                        buffers.ce.c_str(),
-                        buffers.cd.c_str(),
-                        nullptr};
-
-  buffers.parents.clear();
+  commit_object &object = buffers.object;
+  object.tree = *tree;
+  object.parents.clear();
   for (sha1_ref p : parents)
-    buffers.parents.emplace_back(*p);
-
-  textual_sha1 text_tree(*tree);
-  buffers.args.clear();
-  buffers.args.push_back("git");
-  buffers.args.push_back("commit-tree");
-  buffers.args.push_back("-F");
-  buffers.args.push_back("-");
-  buffers.args.push_back(text_tree.bytes);
-  for (auto &p : buffers.parents) {
-    buffers.args.push_back("-p");
-    buffers.args.push_back(p.bytes);
+    object.parents.push_back(*p);
+  object.envp.resize(6);
+  object.envp[0] = buffers.an;
+  object.envp[1] = buffers.ae;
+  object.envp[2] = buffers.ad;
+  object.envp[3] = buffers.cn;
+  object.envp[4] = buffers.ce;
+  object.envp[5] = buffers.cd;
+  object.message = buffers.message;
+
+  binary_sha1 sha1;
+  if (writer) {
+    object_store::hash_object("commit", object.format(), sha1);
+    commit = pool.lookup(sha1);
+    note_commit_tree(commit, tree);
+    writer->push(
+        object_writer::job_type{commit, false, std::string(), object});
+    return 0;
   }
-  buffers.args.push_back(nullptr);
 
-  git_reply.clear();
-  if (call_git(buffers.args.data(), envp, buffers.message, git_reply))
+  if (object_store::get().write_commit(object, sha1))
     return 1;
-  git_reply.push_back(0);
-
-  textual_sha1 sha1;
-  const char *end = nullptr;
-  if (sha1.from_input(git_reply.data(), &end) || *end++ != '\n' || *end)
-    return error("invalid sha1 for new commit");
   commit = pool.lookup(sha1);
   note_commit_tree(commit, tree);
   return 0;
 }
+
+void git_cache::start_pipeline() {
+  assert(!writer);
+  writer.reset(new object_writer);
+}
+
+int git_cache::wait_for_objects() {
+  if (!writer)
+    return 0;
+  if (writer->wait()) {
+    has_unwritten_objects = true;
+    return error("failed to write pipelined objects");
+  }
+  return 0;
+}
+
+int git_cache::flush_pipeline() {
+  if (!writer)
+    return 0;
+  if (wait_for_objects())
+    return 1;
+
+  // Everything is written, so the database can point at it.  Each table gets
+  // the same records in the same order as without the pipeline.
+  for (auto &commit_rev : pending_base_revs)
+    if (insert_base_rev(commit_rev.first, commit_rev.second))
+      return 1;
+  for (auto &split_mono : pending_monos)
+    if (insert_mono(split_mono.first, split_mono.second))
+      return 1;
+  pending_base_revs.clear();
+  pending_monos.clear();
+  return 0;
+}
+
+int git_cache::finish_pipeline() {
+  if (!writer)
+    return 0;
+  int status = flush_pipeline();
+  writer.reset();
+  pending_base_revs.clear();
+  pending_monos.clear();
+  return status;
+}
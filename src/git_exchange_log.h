@@ -0,0 +1,179 @@
+// git_exchange_log.h
+#pragma once
+
+#include "error.h"
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace {
+/// Record every exchange with git, or answer from a recording without running
+/// git at all, so that a captured workload can be benchmarked offline and the
+/// CPU-side work profiled apart from git's.
+///
+/// Set MT_GIT_RECORD to the file to write.  Set MT_GIT_REPLAY to a recorded
+/// file to replay it; the database has to start out as it was when recording.
+/// An exchange is keyed by its arguments (except the git executable), its
+/// environment, and what was written to git.  Identical calls are answered
+/// in the order they were recorded, so that threads can race.
+///
+/// The file starts with "mt-git-record 1", followed by one entry per
+/// exchange:
+///
+///     exchange <key-size> <output-size> <exit-status>
+///     <key><output>
+///
+/// where an exit status of -1 means git didn't exit normally.
+struct git_exchange_log {
+  struct exchange_type {
+    std::string output;
+    int exit_status = -1;
+  };
+
+  bool is_recording = false;
+  bool is_replaying = false;
+
+  /// Never destroyed, since recording goes on until exit.
+  static git_exchange_log &get() {
+    static git_exchange_log *log = new git_exchange_log;
+    return *log;
+  }
+
+  static std::string make_key(char *argv[], char *envp[],
+                              const std::string &input);
+
+  void record(const std::string &key, const std::string &output,
+              int exit_status);
+
+  /// Find the next answer for \a key.  Returns non-zero if there's none.
+  int replay(const std::string &key, exchange_type &exchange);
+
+private:
+  git_exchange_log();
+  int read_recording(const char *path);
+  static void append_field(std::string &key, const char *field, size_t size);
+
+  std::mutex mutex;
+  FILE *record_file = nullptr;
+  std::unordered_map<std::string, std::deque<exchange_type>> exchanges;
+};
+} // end namespace
+
+git_exchange_log::git_exchange_log() {
+  const char *record_path = getenv("MT_GIT_RECORD");
+  const char *replay_path = getenv("MT_GIT_REPLAY");
+  if (replay_path && *replay_path) {
+    is_replaying = true;
+    if (read_recording(replay_path))
+      error("failed to read MT_GIT_REPLAY '" + std::string(replay_path) +
+            "'");
+    return;
+  }
+  if (!record_path || !*record_path)
+    return;
+
+  record_file = fopen(record_path, "w");
+  if (!record_file) {
+    error("failed to open MT_GIT_RECORD '" + std::string(record_path) +
+          "': " + strerror(errno));
+    return;
+  }
+  is_recording = true;
+  fprintf(record_file, "mt-git-record 1\n");
+}
+
+void git_exchange_log::append_field(std::string &key, const char *field,
+                                    size_t size) {
+  key += ' ';
+  key += std::to_string(size);
+  key += ':';
+  key.append(field, size);
+}
+
+std::string git_exchange_log::make_key(char *argv[], char *envp[],
+                                       const std::string &input) {
+  std::string key = "argv";
+  for (char **x = argv + 1; *x; ++x)
+    append_field(key, *x, strlen(*x));
+  key += "\nenv";
+  if (envp)
+    for (char **x = envp; *x; ++x)
+      append_field(key, *x, strlen(*x));
+  key += "\nstdin";
+  append_field(key, input.data(), input.size());
+  return key;
+}
+
+void git_exchange_log::record(const std::string &key,
+                              const std::string &output, int exit_status) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!record_file)
+    return;
+  fprintf(record_file, "exchange %zu %zu %d\n", key.size(), output.size(),
+          exit_status);
+  fwrite(key.data(), 1, key.size(), record_file);
+  fwrite(output.data(), 1, output.size(), record_file);
+  if (fputc('\n', record_file) == EOF || fflush(record_file)) {
+    error("failed to write to MT_GIT_RECORD");
+    fclose(record_file);
+    record_file = nullptr;
+  }
+}
+
+int git_exchange_log::read_recording(const char *path) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return error(std::string("git-exchange-log: ") + strerror(errno));
+
+  int version = 0;
+  if (fscanf(file, "mt-git-record %d\n", &version) != 1 || version != 1) {
+    fclose(file);
+    return error("git-exchange-log: not a recording");
+  }
+
+  int status = 0;
+  size_t key_size, output_size;
+  int exit_status;
+  while (true) {
+    int num_scanned = fscanf(file, "exchange %zu %zu %d", &key_size,
+                             &output_size, &exit_status);
+    if (num_scanned == EOF)
+      break;
+    if (num_scanned != 3 || fgetc(file) != '\n') {
+      status = error("git-exchange-log: bad exchange header");
+      break;
+    }
+
+    std::string key(key_size, '\0');
+    exchange_type exchange;
+    exchange.output.resize(output_size);
+    exchange.exit_status = exit_status;
+    if (fread(&key[0], 1, key_size, file) != key_size ||
+        fread(&exchange.output[0], 1, output_size, file) != output_size ||
+        fgetc(file) != '\n') {
+      status = error("git-exchange-log: truncated exchange");
+      break;
+    }
+    exchanges[std::move(key)].push_back(std::move(exchange));
+  }
+  fclose(file);
+  return status;
+}
+
+int git_exchange_log::replay(const std::string &key,
+                             exchange_type &exchange) {
+  std::lock_guard<std::mutex> lock(mutex);
+  auto found = exchanges.find(key);
+  if (found == exchanges.end() || found->second.empty()) {
+    std::string command = key.substr(0, key.find('\n'));
+    return error("git-exchange-log: nothing recorded for " + command);
+  }
+  exchange = std::move(found->second.front());
+  found->second.pop_front();
+  return 0;
+}
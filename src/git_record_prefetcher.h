@@ -0,0 +1,187 @@
+// git_record_prefetcher.h
+#pragma once
+
+#include "call_git.h"
+#include "git_record_reader.h"
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+/// Run git-log on a background thread, splitting its output into records
+/// with git_record_reader, so that several walks can run at once while their
+/// records are parsed in order on one thread.
+///
+/// Each prefetcher has its own chunks.  A chunk is freed once the parser has
+/// moved past it, unless the parser called \a pin(), in which case it's handed
+/// to \a kept_chunks (typically git_cache::big_metadata) and outlives the
+/// prefetcher.  Git is left blocked once too much is buffered.
+struct git_record_prefetcher {
+  static constexpr const size_t max_buffered_bytes = 16u << 20;
+
+  explicit git_record_prefetcher(
+      std::vector<std::unique_ptr<char[]>> &kept_chunks)
+      : kept_chunks(kept_chunks) {}
+  ~git_record_prefetcher() { stop(); }
+
+  /// Spawn the thread.  \a argv is copied.
+  void start(const std::vector<const char *> &argv, int num_fields);
+
+  /// Wait for the next complete record.  Sets \a record to nullptr at the end
+  /// of the output, and returns non-zero if git failed.
+  int next(const char *&record, const char *&end);
+
+  /// Keep the chunk holding the most recent record.
+  void pin();
+
+  /// Stop git after its next record, if it's still running, and wait for the
+  /// thread.
+  void stop();
+
+private:
+  struct chunk_type {
+    std::unique_ptr<char[]> bytes;
+    size_t size = 0;
+    bool is_pinned = false;
+  };
+  struct record_type {
+    const char *record = nullptr;
+    const char *end = nullptr;
+    size_t chunk = 0;
+  };
+
+  void run(std::vector<std::string> args, int num_fields);
+  static char *allocate_chunk(void *context, size_t size);
+  void release_chunks_before(size_t chunk);
+
+  std::vector<std::unique_ptr<char[]>> &kept_chunks;
+  std::thread thread;
+
+  // Guarded by the mutex.
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<chunk_type> chunks;
+  std::deque<record_type> records;
+  size_t first_chunk = 0;   // Index of chunks.front().
+  size_t current_chunk = 0; // Chunk holding the most recent record.
+  size_t num_buffered_bytes = 0;
+  bool should_stop = false;
+  bool is_done = false;
+  bool has_error = false;
+};
+} // end namespace
+
+void git_record_prefetcher::start(const std::vector<const char *> &argv,
+                                  int num_fields) {
+  assert(!thread.joinable());
+  std::vector<std::string> args;
+  for (const char *arg : argv)
+    if (arg)
+      args.emplace_back(arg);
+  thread = std::thread([this, args = std::move(args), num_fields]() mutable {
+    run(std::move(args), num_fields);
+  });
+}
+
+void git_record_prefetcher::run(std::vector<std::string> args,
+                                int num_fields) {
+  std::vector<const char *> argv;
+  for (auto &arg : args)
+    argv.push_back(arg.c_str());
+  argv.push_back(nullptr);
+
+  auto read_records = [&](int fd) {
+    git_record_reader reader(allocate_chunk, this, fd, num_fields);
+    const char *record, *end;
+    while (true) {
+      if (reader.next(record, end))
+        return 1;
+      if (!record)
+        return 0;
+
+      // The reader is always filling the newest chunk.
+      std::lock_guard<std::mutex> lock(mutex);
+      records.push_back(
+          record_type{record, end, first_chunk + chunks.size() - 1});
+      cv.notify_all();
+      if (should_stop)
+        return call_git_stop_reading;
+    }
+  };
+  int status = call_git_streaming(argv.data(), nullptr, read_records);
+
+  std::lock_guard<std::mutex> lock(mutex);
+  is_done = true;
+  has_error = status;
+  cv.notify_all();
+}
+
+char *git_record_prefetcher::allocate_chunk(void *context, size_t size) {
+  auto &self = *static_cast<git_record_prefetcher *>(context);
+  std::unique_lock<std::mutex> lock(self.mutex);
+
+  // Wait for the parser to catch up, as long as it has something to parse.
+  self.cv.wait(lock, [&]() {
+    return self.num_buffered_bytes < max_buffered_bytes ||
+           self.records.empty() || self.should_stop;
+  });
+  self.chunks.emplace_back();
+  self.chunks.back().bytes.reset(new char[size]);
+  self.chunks.back().size = size;
+  self.num_buffered_bytes += size;
+  return self.chunks.back().bytes.get();
+}
+
+void git_record_prefetcher::release_chunks_before(size_t chunk) {
+  for (; first_chunk < chunk; ++first_chunk) {
+    auto &front = chunks.front();
+    num_buffered_bytes -= front.size;
+    if (front.is_pinned)
+      kept_chunks.push_back(std::move(front.bytes));
+    chunks.pop_front();
+  }
+}
+
+int git_record_prefetcher::next(const char *&record, const char *&end) {
+  record = end = nullptr;
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return !records.empty() || is_done; });
+  if (records.empty())
+    return has_error;
+
+  // The reader has moved on from any chunk before this record's.
+  record_type next = records.front();
+  records.pop_front();
+  release_chunks_before(next.chunk);
+  current_chunk = next.chunk;
+  cv.notify_all();
+  record = next.record;
+  end = next.end;
+  return 0;
+}
+
+void git_record_prefetcher::pin() {
+  std::lock_guard<std::mutex> lock(mutex);
+  assert(current_chunk >= first_chunk);
+  chunks[current_chunk - first_chunk].is_pinned = true;
+}
+
+void git_record_prefetcher::stop() {
+  if (!thread.joinable())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_stop = true;
+    cv.notify_all();
+  }
+  thread.join();
+
+  // Free everything, except what has been pinned.
+  std::lock_guard<std::mutex> lock(mutex);
+  release_chunks_before(first_chunk + chunks.size());
+  records.clear();
+}
@@ -0,0 +1,148 @@
+// git_record_reader.h
+#pragma once
+
+#include "bump_allocator.h"
+#include "error.h"
+#include "git_stats.h"
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+namespace {
+/// Split the output of git-log into records as it arrives, instead of waiting
+/// for all of it.  A record is \a num_fields NUL-terminated fields followed by
+/// a newline, e.g., from a format like "%H %P%x00%an...%B%x00".  With no
+/// fields, a record is just a line.
+///
+/// Bytes are read into chunks from \a alloc, so a parser can keep a
+/// NUL-terminated field in place (typically commit metadata) by calling \a
+/// pin(); the chunk is then never reused or moved.  Unpinned chunks are
+/// recycled, so only the chunks with something in them stay allocated.
+///
+/// Alternatively, chunks can come from \a allocate_chunk, for when another
+/// thread parses the records; those chunks are never recycled or reused, and
+/// it's up to the owner to free them.
+struct git_record_reader {
+  static constexpr const size_t default_chunk_size = 1u << 16;
+
+  bump_allocator *alloc = nullptr;
+  char *(*allocate_chunk)(void *context, size_t size) = nullptr;
+  void *chunk_context = nullptr;
+  int fd = -1;
+  int num_fields = 0;
+
+  git_record_reader(bump_allocator &alloc, int fd, int num_fields)
+      : alloc(&alloc), fd(fd), num_fields(num_fields) {}
+  git_record_reader(char *(*allocate_chunk)(void *context, size_t size),
+                    void *chunk_context, int fd, int num_fields)
+      : allocate_chunk(allocate_chunk), chunk_context(chunk_context), fd(fd),
+        num_fields(num_fields) {}
+
+  /// Find the next complete record.  Sets \a record to nullptr at the end of
+  /// the output.  \a end points past the record's trailing newline.
+  int next(const char *&record, const char *&end);
+
+  /// Keep the chunk holding the most recent record.
+  void pin() { is_pinned = true; }
+
+private:
+  int fill();
+  void new_chunk(size_t min_size);
+
+  char *chunk = nullptr;
+  size_t chunk_size = 0;
+  size_t begin = 0;    // Start of the next record.
+  size_t scanned = 0;  // Bytes of the next record already scanned.
+  size_t filled = 0;   // Bytes read into the chunk.
+  int num_nulls = 0;   // NULs seen in the next record.
+  bool is_pinned = false;
+  bool is_eof = false;
+};
+} // end namespace
+
+void git_record_reader::new_chunk(size_t min_size) {
+  size_t size = default_chunk_size;
+  while (size < min_size)
+    size <<= 1;
+
+  // Move the partial record to the front of the new chunk.
+  char *old = chunk;
+  size_t partial = filled - begin;
+  chunk = allocate_chunk ? allocate_chunk(chunk_context, size)
+                         : static_cast<char *>(alloc->allocate(size, 1));
+  chunk_size = size;
+  if (partial)
+    memcpy(chunk, old + begin, partial);
+  scanned -= begin;
+  begin = 0;
+  filled = partial;
+  is_pinned = false;
+}
+
+int git_record_reader::fill() {
+  if (!chunk)
+    new_chunk(default_chunk_size);
+  else if (filled == chunk_size) {
+    // Leave room to grow records that don't fit.
+    if (is_pinned || !begin || allocate_chunk)
+      new_chunk(2 * (filled - begin));
+    else {
+      // Recycle this chunk.
+      memmove(chunk, chunk + begin, filled - begin);
+      scanned -= begin;
+      filled -= begin;
+      begin = 0;
+    }
+  }
+
+  int num_interrupts = 0;
+  while (true) {
+    ssize_t num_bytes = read(fd, chunk + filled, chunk_size - filled);
+    if (num_bytes == -1) {
+      if (errno == EINTR && ++num_interrupts <= 20)
+        continue;
+      return error("git-record-reader: failed to read from git");
+    }
+    if (!num_bytes)
+      is_eof = true;
+    git_stats::note_bytes_read(num_bytes);
+    filled += num_bytes;
+    return 0;
+  }
+}
+
+int git_record_reader::next(const char *&record, const char *&end) {
+  record = end = nullptr;
+  while (true) {
+    // Scan for the end of the record.
+    for (; scanned != filled; ++scanned) {
+      if (num_nulls < num_fields) {
+        if (!chunk[scanned])
+          ++num_nulls;
+        continue;
+      }
+      if (chunk[scanned] != '\n')
+        continue;
+
+      // Found the newline after the last field.
+      record = chunk + begin;
+      end = chunk + ++scanned;
+      begin = scanned;
+      num_nulls = 0;
+      return 0;
+    }
+
+    if (is_eof) {
+      if (begin != filled)
+        return error("git-record-reader: truncated record from git");
+      return 0;
+    }
+
+    // Nothing new is needed from an unpinned chunk that has been fully
+    // parsed, so start again from the front.
+    if (begin == filled && !is_pinned && !allocate_chunk)
+      begin = scanned = filled = 0;
+    if (fill())
+      return 1;
+  }
+}
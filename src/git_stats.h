@@ -0,0 +1,197 @@
+// git_stats.h
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <string>
+
+namespace {
+/// A log-linear histogram in the style of HdrHistogram.  A value is bucketed
+/// by its highest set bit and the \a sub_bits bits after it, so every bucket
+/// is within 1/8 of the values in it, and any uint64_t fits in a few KB.
+struct log_histogram {
+  static constexpr const int sub_bits = 3;
+  static constexpr const int num_sub_buckets = 1 << sub_bits;
+
+  std::array<uint64_t, 64 * num_sub_buckets> counts{};
+  uint64_t count = 0;
+  uint64_t total = 0;
+  uint64_t max = 0;
+
+  static int bucket(uint64_t value) {
+    if (value < num_sub_buckets)
+      return value;
+    int high_bit = 63 - __builtin_clzll(value);
+    int sub_bucket = (value >> (high_bit - sub_bits)) & (num_sub_buckets - 1);
+    return ((high_bit - sub_bits + 1) << sub_bits) + sub_bucket;
+  }
+  static uint64_t lowest_value(int bucket) {
+    if (bucket < num_sub_buckets)
+      return bucket;
+    int high_bit = (bucket >> sub_bits) + sub_bits - 1;
+    uint64_t sub_bucket = bucket & (num_sub_buckets - 1);
+    return (num_sub_buckets | sub_bucket) << (high_bit - sub_bits);
+  }
+
+  void add(uint64_t value) {
+    ++counts[bucket(value)];
+    ++count;
+    total += value;
+    if (value > max)
+      max = value;
+  }
+
+  /// The highest value in the bucket holding the \a percent'th percentile.
+  uint64_t percentile(double percent) const {
+    if (!count)
+      return 0;
+    uint64_t rank = (percent * count + 99) / 100;
+    if (!rank)
+      rank = 1;
+    uint64_t seen = 0;
+    for (int b = 0, be = counts.size(); b != be; ++b) {
+      seen += counts[b];
+      if (seen < rank)
+        continue;
+      if (b + 1 == be)
+        return max;
+      uint64_t highest = lowest_value(b + 1) - 1;
+      return highest < max ? highest : max;
+    }
+    return max;
+  }
+};
+
+/// Per-subcommand accounting for call_git, for finding which git calls to
+/// batch or replace.  Set MT_GIT_STATS to print a table to stderr at exit.
+struct git_stats {
+  struct subcommand_stats {
+    log_histogram spawn_us;
+    log_histogram wall_us;
+    log_histogram bytes_written;
+    log_histogram bytes_read;
+  };
+
+  std::mutex mutex;
+  std::map<std::string, subcommand_stats> subcommands;
+  bool is_enabled = false;
+
+  /// Never destroyed, since the table is printed by an atexit handler.
+  static git_stats &get() {
+    static git_stats *stats = new git_stats;
+    return *stats;
+  }
+
+  /// Count bytes read from git by the current thread's call_git, if any.
+  static size_t *&current_bytes_read() {
+    thread_local size_t *bytes_read = nullptr;
+    return bytes_read;
+  }
+  static void note_bytes_read(size_t num_bytes) {
+    if (size_t *bytes_read = current_bytes_read())
+      *bytes_read += num_bytes;
+  }
+
+  void add(const char *subcommand, uint64_t spawn_us, uint64_t wall_us,
+           uint64_t bytes_written, uint64_t bytes_read);
+  void print(FILE *file);
+
+private:
+  git_stats();
+};
+
+/// Time one call to git, from before it's spawned until it's reaped.
+struct git_call_stats {
+  typedef std::chrono::steady_clock clock;
+  const char *subcommand;
+  bool is_enabled;
+  clock::time_point start;
+  clock::time_point spawned;
+  size_t bytes_written = 0;
+  size_t bytes_read = 0;
+  size_t *outer_bytes_read = nullptr;
+
+  explicit git_call_stats(const char *subcommand)
+      : subcommand(subcommand), is_enabled(git_stats::get().is_enabled) {
+    if (!is_enabled)
+      return;
+    start = spawned = clock::now();
+    outer_bytes_read = git_stats::current_bytes_read();
+    git_stats::current_bytes_read() = &bytes_read;
+  }
+  ~git_call_stats() {
+    if (!is_enabled)
+      return;
+    git_stats::current_bytes_read() = outer_bytes_read;
+    git_stats::get().add(subcommand, to_us(spawned - start),
+                         to_us(clock::now() - start), bytes_written,
+                         bytes_read);
+  }
+
+  void note_spawned() {
+    if (is_enabled)
+      spawned = clock::now();
+  }
+
+private:
+  static uint64_t to_us(clock::duration d) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(d).count();
+  }
+};
+} // end namespace
+
+git_stats::git_stats() {
+  if (const char *var = getenv("MT_GIT_STATS"))
+    is_enabled = strcmp(var, "0");
+  if (is_enabled)
+    atexit([]() { get().print(stderr); });
+}
+
+void git_stats::add(const char *subcommand, uint64_t spawn_us,
+                    uint64_t wall_us, uint64_t bytes_written,
+                    uint64_t bytes_read) {
+  // Keep the ones we care about apart, and lump the rest together.
+  static const char *const known[] = {
+      "log",       "ls-tree",   "mktree",   "commit-tree",
+      "merge-base", "rev-parse", "show-ref",
+  };
+  const char *name = "other";
+  for (const char *k : known)
+    if (subcommand && !strcmp(subcommand, k))
+      name = k;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  auto &stats = subcommands[name];
+  stats.spawn_us.add(spawn_us);
+  stats.wall_us.add(wall_us);
+  stats.bytes_written.add(bytes_written);
+  stats.bytes_read.add(bytes_read);
+}
+
+void git_stats::print(FILE *file) {
+  std::lock_guard<std::mutex> lock(mutex);
+  fprintf(file,
+          "git-stats: %-11s %7s %9s %23s %15s %10s %10s\n", "subcommand",
+          "calls", "wall-ms", "wall p50/p90/p99 (us)", "spawn p50/p99",
+          "read-KiB", "write-KiB");
+  for (auto &entry : subcommands) {
+    auto &stats = entry.second;
+    std::string wall = std::to_string(stats.wall_us.percentile(50)) + "/" +
+                       std::to_string(stats.wall_us.percentile(90)) + "/" +
+                       std::to_string(stats.wall_us.percentile(99));
+    std::string spawn = std::to_string(stats.spawn_us.percentile(50)) + "/" +
+                        std::to_string(stats.spawn_us.percentile(99));
+    fprintf(file, "git-stats: %-11s %7llu %9llu %23s %15s %10llu %10llu\n",
+            entry.first.c_str(), (unsigned long long)stats.wall_us.count,
+            (unsigned long long)(stats.wall_us.total / 1000), wall.c_str(),
+            spawn.c_str(),
+            (unsigned long long)(stats.bytes_read.total / 1024),
+            (unsigned long long)(stats.bytes_written.total / 1024));
+  }
+}
@@ -0,0 +1,133 @@
+// name_table.h
+#pragma once
+
+#include "bump_allocator.h"
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+/// Stored just before each name interned by name_table, so that tree
+/// assembly can find a name's dir without a lookup.
+struct name_info {
+  /// Cached result of dir_list::find_dir, valid while dir_generation
+  /// matches dir_list::generation.
+  int dir_index = -1;
+  int dir_generation = -1;
+
+  uint32_t hash = 0;
+
+  static name_info &get(const char *name) {
+    assert(name);
+    return *reinterpret_cast<name_info *>(const_cast<char *>(name) -
+                                          sizeof(name_info));
+  }
+};
+
+/// Arena-backed open-addressing hash table of names.  Equal names intern to
+/// the same pointer, so they can be compared by pointer.
+///
+/// Lookups don't lock, and can run on any thread.  Insertions take a lock.
+/// When the table grows the old slots are kept alive, so a concurrent lookup
+/// that misses there just retries under the lock.
+struct name_table {
+  name_table() { publish(min_num_slots); }
+  name_table(const name_table &) = delete;
+
+  /// Intern \a len bytes of \a name, which need not be null-terminated.
+  const char *intern(const char *name, size_t len);
+
+  void print_stats(FILE *file, const char *name) const {
+    alloc.print_stats(file, name);
+  }
+
+private:
+  typedef std::atomic<const char *> slot_type;
+  struct slots_type {
+    std::unique_ptr<slot_type[]> slots;
+    size_t mask = 0;
+  };
+  static constexpr const size_t min_num_slots = 1024;
+
+  static uint32_t hash_name(const char *name, size_t len) {
+    // FNV-1a.
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i != len; ++i)
+      hash = (hash ^ (unsigned char)name[i]) * 16777619u;
+    return hash;
+  }
+  static bool is_equal(const char *interned, const char *name, size_t len,
+                       uint32_t hash) {
+    return name_info::get(interned).hash == hash &&
+           !strncmp(interned, name, len) && !interned[len];
+  }
+  static const char *find(const slots_type &table, const char *name,
+                          size_t len, uint32_t hash, size_t &slot);
+  void publish(size_t num_slots);
+
+  std::atomic<const slots_type *> current{nullptr};
+  std::vector<std::unique_ptr<slots_type>> all_slots;
+  std::vector<const char *> names;
+  std::mutex mutex;
+  bump_allocator alloc;
+};
+} // end namespace
+
+const char *name_table::find(const slots_type &table, const char *name,
+                             size_t len, uint32_t hash, size_t &slot) {
+  for (slot = hash & table.mask;; slot = (slot + 1) & table.mask) {
+    const char *interned = table.slots[slot].load(std::memory_order_acquire);
+    if (!interned || is_equal(interned, name, len, hash))
+      return interned;
+  }
+}
+
+void name_table::publish(size_t num_slots) {
+  auto table = std::make_unique<slots_type>();
+  table->slots.reset(new slot_type[num_slots]);
+  table->mask = num_slots - 1;
+  for (size_t i = 0; i != num_slots; ++i)
+    table->slots[i].store(nullptr, std::memory_order_relaxed);
+  for (const char *interned : names) {
+    size_t slot;
+    uint32_t hash = name_info::get(interned).hash;
+    (void)find(*table, interned, strlen(interned), hash, slot);
+    table->slots[slot].store(interned, std::memory_order_relaxed);
+  }
+  current.store(table.get(), std::memory_order_release);
+  all_slots.push_back(std::move(table));
+}
+
+const char *name_table::intern(const char *name, size_t len) {
+  uint32_t hash = hash_name(name, len);
+  size_t slot;
+  if (const char *interned =
+          find(*current.load(std::memory_order_acquire), name, len, hash,
+               slot))
+    return interned;
+
+  std::lock_guard<std::mutex> lock(mutex);
+  const slots_type *table = current.load(std::memory_order_relaxed);
+  if (const char *interned = find(*table, name, len, hash, slot))
+    return interned;
+
+  auto *info = new (alloc.allocate(sizeof(name_info) + len + 1,
+                                   alignof(name_info))) name_info;
+  info->hash = hash;
+  char *allocated = reinterpret_cast<char *>(info + 1);
+  memcpy(allocated, name, len);
+  allocated[len] = 0;
+  names.push_back(allocated);
+
+  // Keep the load factor under a half.
+  if (names.size() * 2 > table->mask + 1)
+    publish((table->mask + 1) * 2);
+  else
+    table->slots[slot].store(allocated, std::memory_order_release);
+  return allocated;
+}
@@ -0,0 +1,987 @@
+// object_store.h
+#pragma once
+
+#include "call_git.h"
+#include "error.h"
+#include "parsers.h"
+#include "sha1_hash.h"
+#include "sha1convert.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/wait.h>
+#include <unordered_map>
+#include <vector>
+
+namespace {
+/// A commit to write, as git-commit-tree takes it.
+struct commit_object {
+  binary_sha1 tree;
+  std::vector<binary_sha1> parents;
+
+  /// GIT_AUTHOR_NAME, GIT_AUTHOR_EMAIL, GIT_AUTHOR_DATE, GIT_COMMITTER_NAME,
+  /// GIT_COMMITTER_EMAIL, and GIT_COMMITTER_DATE, in that order, as
+  /// environment variables.
+  std::vector<std::string> envp;
+  std::string message;
+
+  /// The raw object, without its header, as git would write it.
+  std::string format() const;
+};
+
+/// Where git_cache reads and writes objects, and asks about ancestry.  Set
+/// MT_OBJECT_STORE to choose:
+///
+///   - "subprocess" (the default) runs git once per request;
+///   - "batch" keeps a 'git cat-file --batch' and two 'git hash-object
+///     --stdin-paths' running and answers ancestry itself; and
+///   - "memory" is like "batch", except that new objects are kept in memory
+///     instead of being written, for benchmarks and tests.
+///
+/// Requests can come from several threads at once.
+struct object_store {
+  virtual ~object_store() = default;
+
+  static object_store &get();
+
+  /// Read \a commit's metadata into \a reply, in the format of
+  /// "%P%x00%an%n%cn%n%ad%n%cd%n%ae%n%ce%n%B%x00" with --date=raw.
+  virtual int read_commit(const binary_sha1 &commit,
+                          std::vector<char> &reply) = 0;
+  virtual int read_commit_tree(const binary_sha1 &commit,
+                               binary_sha1 &tree) = 0;
+
+  /// Read \a tree into \a reply as 'git ls-tree --full-tree' would list it,
+  /// followed by a null character.
+  virtual int read_tree(const binary_sha1 &tree, std::vector<char> &reply) = 0;
+
+  /// Write a tree from \a raw, its raw object without the header.
+  virtual int write_tree(const std::string &raw, binary_sha1 &tree) = 0;
+  virtual int write_commit(const commit_object &commit,
+                           binary_sha1 &sha1) = 0;
+
+  /// Find the best common ancestor.  Returns non-zero, quietly, if there's
+  /// none.
+  virtual int merge_base(const binary_sha1 &a, const binary_sha1 &b,
+                         binary_sha1 &base) = 0;
+
+  /// Remove commits that are reachable from the others.
+  virtual int merge_base_independent(std::vector<binary_sha1> &commits) = 0;
+
+  /// Returns non-zero, quietly, if \a rev doesn't name a commit.
+  virtual int rev_parse(const std::string &rev, binary_sha1 &sha1) = 0;
+
+  /// Returns non-zero, quietly, if \a sha1 isn't in the repository.
+  virtual int check_object(const binary_sha1 &sha1) = 0;
+
+  /// Whether new objects end up in the repository, so that the database can
+  /// point at them.
+  virtual bool persists_objects() const { return true; }
+
+  /// Hash an object the way git does.
+  static void hash_object(const char *type, const std::string &raw,
+                          binary_sha1 &sha1);
+
+protected:
+  /// Parse one 40-character SHA-1 followed by a newline, and nothing else.
+  static int parse_sha1_line(std::vector<char> &reply, binary_sha1 &sha1);
+};
+
+/// Run git for everything.
+struct subprocess_object_store : object_store {
+  int read_commit(const binary_sha1 &commit,
+                  std::vector<char> &reply) override;
+  int read_commit_tree(const binary_sha1 &commit, binary_sha1 &tree) override;
+  int read_tree(const binary_sha1 &tree, std::vector<char> &reply) override;
+  int write_tree(const std::string &raw, binary_sha1 &tree) override;
+  int write_commit(const commit_object &commit, binary_sha1 &sha1) override;
+  int merge_base(const binary_sha1 &a, const binary_sha1 &b,
+                 binary_sha1 &base) override;
+  int merge_base_independent(std::vector<binary_sha1> &commits) override;
+  int rev_parse(const std::string &rev, binary_sha1 &sha1) override;
+  int check_object(const binary_sha1 &sha1) override;
+};
+
+/// A long-lived git that answers requests one at a time, with buffered
+/// reads.  Spawned on first use.
+struct git_batch_process {
+  explicit git_batch_process(std::vector<const char *> argv)
+      : argv(std::move(argv)) {}
+  ~git_batch_process();
+
+  int start();
+  int write_all(const char *data, size_t size);
+  int read_line(std::string &line);
+  int read_exact(std::string &data, size_t size);
+
+  std::mutex mutex;
+
+private:
+  int fill();
+
+  std::vector<const char *> argv;
+  pid_t pid = -1;
+  int to_git = -1;
+  int from_git = -1;
+  std::vector<char> buffer;
+  size_t begin = 0;
+  size_t end = 0;
+};
+
+/// Answer reads from raw objects and ancestry by walking parents, only
+/// falling back to git for revisions more complicated than "<sha1>^<n>".
+struct raw_object_store : subprocess_object_store {
+  /// Read the raw object \a sha1 and its \a type.
+  virtual int read_object(const binary_sha1 &sha1, std::string &type,
+                          std::string &raw) = 0;
+
+  int read_commit(const binary_sha1 &commit,
+                  std::vector<char> &reply) override;
+  int read_commit_tree(const binary_sha1 &commit, binary_sha1 &tree) override;
+  int read_tree(const binary_sha1 &tree, std::vector<char> &reply) override;
+  int merge_base(const binary_sha1 &a, const binary_sha1 &b,
+                 binary_sha1 &base) override;
+  int merge_base_independent(std::vector<binary_sha1> &commits) override;
+  int rev_parse(const std::string &rev, binary_sha1 &sha1) override;
+
+private:
+  int read_object_of_type(const binary_sha1 &sha1, const char *type,
+                          std::string &raw);
+  int read_parents(const binary_sha1 &commit, std::vector<binary_sha1> &parents,
+                   long long &ct);
+};
+
+/// Keep git's batch modes running instead of spawning per request.
+struct batch_object_store : raw_object_store {
+  batch_object_store();
+  ~batch_object_store();
+
+  int read_object(const binary_sha1 &sha1, std::string &type,
+                  std::string &raw) override;
+  int write_tree(const std::string &raw, binary_sha1 &tree) override;
+  int write_commit(const commit_object &commit, binary_sha1 &sha1) override;
+  int check_object(const binary_sha1 &sha1) override;
+
+private:
+  /// Like read_object, but quietly sets \a is_missing if git doesn't have it.
+  int read_object_or_missing(const binary_sha1 &sha1, std::string &type,
+                             std::string &raw, bool &is_missing);
+  int hash_object(git_batch_process &process, std::string &path,
+                  const std::string &raw, binary_sha1 &sha1);
+
+  git_batch_process cat_file;
+  git_batch_process hash_trees;
+  git_batch_process hash_commits;
+  std::string tree_path;
+  std::string commit_path;
+};
+
+/// Keep new objects in memory, never writing them to the repository.
+/// Objects that are already there are read through git's batch modes.
+struct memory_object_store : batch_object_store {
+  int read_object(const binary_sha1 &sha1, std::string &type,
+                  std::string &raw) override;
+  int write_tree(const std::string &raw, binary_sha1 &tree) override;
+  int write_commit(const commit_object &commit, binary_sha1 &sha1) override;
+  int check_object(const binary_sha1 &sha1) override;
+  bool persists_objects() const override { return false; }
+
+private:
+  struct object_type {
+    const char *type;
+    std::string raw;
+  };
+  struct sha1_hash {
+    size_t operator()(const binary_sha1 &sha1) const {
+      return sha1.get_word(0);
+    }
+  };
+
+  std::mutex mutex;
+  std::unordered_map<binary_sha1, object_type, sha1_hash> objects;
+};
+} // end namespace
+
+std::string commit_object::format() const {
+  // The environment variables hold the values after the '='.
+  auto value = [this](int i) {
+    return envp[i].c_str() + envp[i].find('=') + 1;
+  };
+  auto append_ident = [&](std::string &object, const char *role, int name,
+                          int email, int date) {
+    object += role;
+    object += ' ';
+    object += value(name);
+    object += " <";
+    object += value(email);
+    object += "> ";
+    object += value(date);
+    object += '\n';
+  };
+
+  assert(envp.size() == 6);
+  std::string object = "tree ";
+  object += textual_sha1(tree).bytes;
+  object += '\n';
+  for (const binary_sha1 &p : parents) {
+    object += "parent ";
+    object += textual_sha1(p).bytes;
+    object += '\n';
+  }
+  append_ident(object, "author", 0, 1, 2);
+  append_ident(object, "committer", 3, 4, 5);
+  object += '\n';
+  object += message;
+  return object;
+}
+
+object_store &object_store::get() {
+  static object_store *store = []() -> object_store * {
+    const char *var = getenv("MT_OBJECT_STORE");
+    if (!var || !*var || !strcmp(var, "subprocess"))
+      return new subprocess_object_store;
+    if (!strcmp(var, "batch"))
+      return new batch_object_store;
+    if (!strcmp(var, "memory"))
+      return new memory_object_store;
+    error("unknown MT_OBJECT_STORE '" + std::string(var) +
+          "'; using 'subprocess'");
+    return new subprocess_object_store;
+  }();
+  return *store;
+}
+
+void object_store::hash_object(const char *type, const std::string &raw,
+                               binary_sha1 &sha1) {
+  std::string header = std::string(type) + " " + std::to_string(raw.size());
+  sha1_hasher hasher;
+  hasher.update(header.c_str(), header.size() + 1);
+  hasher.update(raw.data(), raw.size());
+  hasher.finish(sha1);
+}
+
+int object_store::parse_sha1_line(std::vector<char> &reply,
+                                  binary_sha1 &sha1) {
+  reply.push_back(0);
+  const char *end = nullptr;
+  textual_sha1 text;
+  if (text.from_input(reply.data(), &end) || *end++ != '\n' || *end)
+    return 1;
+  sha1 = binary_sha1(text);
+  return 0;
+}
+
+int subprocess_object_store::read_commit(const binary_sha1 &commit,
+                                         std::vector<char> &reply) {
+  textual_sha1 sha1(commit);
+  const char *args[] = {
+      "git",
+      "log",
+      "--date=raw",
+      "--no-walk",
+      "--format=%P%x00%an%n%cn%n%ad%n%cd%n%ae%n%ce%n%B%x00",
+      sha1.bytes,
+      nullptr,
+  };
+  reply.clear();
+  if (call_git(args, nullptr, "", reply))
+    return 1;
+  reply.push_back(0);
+  return 0;
+}
+
+int subprocess_object_store::read_commit_tree(const binary_sha1 &commit,
+                                              binary_sha1 &tree) {
+  std::string ref = textual_sha1(commit).bytes;
+  ref += "^{tree}";
+  const char *argv[] = {"git", "rev-parse", "--verify", ref.c_str(), nullptr};
+  std::vector<char> reply;
+  if (call_git(argv, nullptr, "", reply))
+    return 1;
+  return parse_sha1_line(reply, tree);
+}
+
+int subprocess_object_store::read_tree(const binary_sha1 &tree,
+                                       std::vector<char> &reply) {
+  std::string ref = tree.to_string();
+  const char *args[] = {"git", "ls-tree", "--full-tree", ref.c_str(), nullptr};
+  reply.clear();
+  if (call_git(args, nullptr, "", reply))
+    return 1;
+  reply.push_back(0);
+  return 0;
+}
+
+int subprocess_object_store::write_tree(const std::string &raw,
+                                        binary_sha1 &tree) {
+  // Turn the raw tree back into what git-mktree reads.  Git drops leading
+  // zeros from modes, and git-mktree doesn't care about the order.
+  std::string input;
+  input.reserve(raw.size() * 2);
+  for (const char *current = raw.data(), *end = current + raw.size();
+       current < end;) {
+    const char *mode = current;
+    const char *space = strchr(mode, ' ');
+    const char *name = space + 1;
+    const unsigned char *sha1 =
+        reinterpret_cast<const unsigned char *>(name + strlen(name) + 1);
+    current = reinterpret_cast<const char *>(sha1) + 20;
+
+    std::string mode_text(mode, space);
+    const char *type = mode_text == "40000"    ? "tree"
+                       : mode_text == "160000" ? "commit"
+                                               : "blob";
+    if (mode_text.size() < 6)
+      input.append(6 - mode_text.size(), '0');
+    input += mode_text;
+    input += ' ';
+    input += type;
+    input += ' ';
+    input += textual_sha1(binary_sha1::make_from_binary(sha1)).bytes;
+    input += '\t';
+    input += name;
+    input += '\n';
+  }
+
+  const char *argv[] = {"git", "mktree", nullptr};
+  std::vector<char> reply;
+  if (call_git(argv, nullptr, input, reply))
+    return 1;
+  return parse_sha1_line(reply, tree);
+}
+
+int subprocess_object_store::write_commit(const commit_object &commit,
+                                          binary_sha1 &sha1) {
+  std::vector<const char *> envp;
+  for (const std::string &var : commit.envp)
+    envp.push_back(var.c_str());
+  envp.push_back(nullptr);
+
+  textual_sha1 tree(commit.tree);
+  std::vector<textual_sha1> parents;
+  for (const binary_sha1 &p : commit.parents)
+    parents.emplace_back(p);
+
+  std::vector<const char *> args = {"git", "commit-tree", "-F", "-",
+                                    tree.bytes};
+  for (auto &p : parents) {
+    args.push_back("-p");
+    args.push_back(p.bytes);
+  }
+  args.push_back(nullptr);
+
+  std::vector<char> reply;
+  if (call_git(args.data(), envp.data(), commit.message, reply))
+    return 1;
+  if (parse_sha1_line(reply, sha1))
+    return error("invalid sha1 for new commit");
+  return 0;
+}
+
+int subprocess_object_store::merge_base(const binary_sha1 &a,
+                                        const binary_sha1 &b,
+                                        binary_sha1 &base) {
+  textual_sha1 a_text(a);
+  textual_sha1 b_text(b);
+  const char *argv[] = {"git", "merge-base", a_text.bytes, b_text.bytes,
+                        nullptr};
+  std::vector<char> reply;
+  if (call_git(argv, nullptr, "", reply, /*ignore_errors=*/true))
+    return 1;
+  return parse_sha1_line(reply, base);
+}
+
+int subprocess_object_store::merge_base_independent(
+    std::vector<binary_sha1> &commits) {
+  // Fill these first to avoid memory corruption.
+  std::vector<textual_sha1> sha1s;
+  for (auto &sha1 : commits)
+    sha1s.emplace_back(sha1);
+  commits.clear();
+
+  std::vector<const char *> argv;
+  argv.push_back("git");
+  argv.push_back("merge-base");
+  argv.push_back("--independent");
+  for (auto &sha1 : sha1s)
+    argv.push_back(sha1.bytes);
+  argv.push_back(nullptr);
+
+  std::vector<char> reply;
+  if (call_git(argv.data(), nullptr, "", reply))
+    return 1;
+
+  reply.push_back(0);
+  const char *current = reply.data();
+  while (*current) {
+    textual_sha1 text;
+    if (text.from_input(current, &current) || *current++ != '\n')
+      return 1;
+    commits.push_back(binary_sha1(text));
+  }
+  return 0;
+}
+
+int subprocess_object_store::rev_parse(const std::string &rev,
+                                       binary_sha1 &sha1) {
+  const char *argv[] = {"git", "rev-parse", "--verify", rev.c_str(), nullptr};
+  std::vector<char> reply;
+  if (call_git(argv, nullptr, "", reply, /*ignore_errors=*/true))
+    return 1;
+  return parse_sha1_line(reply, sha1);
+}
+
+int subprocess_object_store::check_object(const binary_sha1 &sha1) {
+  textual_sha1 text(sha1);
+  const char *argv[] = {"git", "cat-file", "-e", text.bytes, nullptr};
+  std::vector<char> reply;
+  return call_git(argv, nullptr, "", reply, /*ignore_errors=*/true);
+}
+
+git_batch_process::~git_batch_process() {
+  if (pid == -1)
+    return;
+
+  // Hang up and reap it.
+  close(to_git);
+  close(from_git);
+  int status;
+  while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+    continue;
+}
+
+int git_batch_process::start() {
+  if (pid != -1)
+    return 0;
+  if (call_git_spawn_process(argv.data(), pid, to_git, from_git)) {
+    pid = -1;
+    return 1;
+  }
+  return 0;
+}
+
+int git_batch_process::write_all(const char *data, size_t size) {
+  if (start())
+    return 1;
+  int num_interrupts = 0;
+  while (size) {
+    ssize_t num_bytes = write(to_git, data, size);
+    if (num_bytes == -1) {
+      if (errno == EINTR && ++num_interrupts <= 20)
+        continue;
+      return error(std::string("git-batch-process: failed to write to git ") +
+                   argv[1]);
+    }
+    data += num_bytes;
+    size -= num_bytes;
+  }
+  return 0;
+}
+
+int git_batch_process::fill() {
+  // Move what's left to the front, and grow if that's not enough room.
+  if (begin) {
+    memmove(buffer.data(), buffer.data() + begin, end - begin);
+    end -= begin;
+    begin = 0;
+  }
+  if (buffer.size() - end < 4096)
+    buffer.resize(std::max(buffer.size() * 2, size_t(1) << 16));
+
+  int num_interrupts = 0;
+  while (true) {
+    ssize_t num_bytes =
+        read(from_git, buffer.data() + end, buffer.size() - end);
+    if (num_bytes == -1 && errno == EINTR && ++num_interrupts <= 20)
+      continue;
+    if (num_bytes <= 0)
+      return error(std::string("git-batch-process: failed to read from git ") +
+                   argv[1]);
+    end += num_bytes;
+    return 0;
+  }
+}
+
+int git_batch_process::read_line(std::string &line) {
+  line.clear();
+  while (true) {
+    // The buffer is empty until the first fill, and memchr can't take null.
+    if (begin != end) {
+      char *first = buffer.data() + begin;
+      char *newline = static_cast<char *>(memchr(first, '\n', end - begin));
+      if (newline) {
+        line.assign(first, newline);
+        begin += newline - first + 1;
+        return 0;
+      }
+      line.append(first, end - begin);
+      begin = end;
+    }
+    if (fill())
+      return 1;
+  }
+}
+
+int git_batch_process::read_exact(std::string &data, size_t size) {
+  data.clear();
+  data.reserve(size);
+  while (data.size() < size) {
+    if (begin == end && fill())
+      return 1;
+    size_t num_bytes = std::min(size - data.size(), end - begin);
+    data.append(buffer.data() + begin, num_bytes);
+    begin += num_bytes;
+  }
+  return 0;
+}
+
+int raw_object_store::read_object_of_type(const binary_sha1 &sha1,
+                                          const char *type, std::string &raw) {
+  std::string actual;
+  if (read_object(sha1, actual, raw))
+    return 1;
+  if (actual != type)
+    return error("raw-object-store: " + sha1.to_string() + " is a " +
+                 actual + ", not a " + type);
+  return 0;
+}
+
+int raw_object_store::read_commit(const binary_sha1 &commit,
+                                  std::vector<char> &reply) {
+  std::string raw;
+  if (read_object_of_type(commit, "commit", raw))
+    return 1;
+
+  // Split the ident into "name <email> date", like git-log does.
+  struct ident_type {
+    std::string name, email, date;
+  } author, committer;
+  auto parse_ident = [](const char *ident, const char *end, ident_type &out) {
+    const char *lt = std::find(ident, end, '<');
+    const char *gt = std::find(lt, end, '>');
+    if (lt == end || gt == end)
+      return 1;
+    const char *name_end = lt;
+    while (name_end != ident && name_end[-1] == ' ')
+      --name_end;
+    const char *date = gt + 1;
+    while (date != end && *date == ' ')
+      ++date;
+    out.name.assign(ident, name_end);
+    out.email.assign(lt + 1, gt);
+    out.date.assign(date, end);
+    return 0;
+  };
+
+  std::string parents;
+  const char *current = raw.c_str();
+  const char *raw_end = current + raw.size();
+  while (current != raw_end && *current != '\n') {
+    const char *line_end = std::find(current, raw_end, '\n');
+    if (line_end == raw_end)
+      return error("raw-object-store: bad commit " + commit.to_string());
+    const char *value = std::find(current, line_end, ' ');
+    std::string key(current, value);
+    value += value != line_end;
+    if (key == "parent") {
+      if (!parents.empty())
+        parents += ' ';
+      parents.append(value, line_end);
+    } else if (key == "author") {
+      if (parse_ident(value, line_end, author))
+        return error("raw-object-store: bad author in " + commit.to_string());
+    } else if (key == "committer") {
+      if (parse_ident(value, line_end, committer))
+        return error("raw-object-store: bad committer in " +
+                     commit.to_string());
+    }
+    current = line_end + 1;
+  }
+  current += current != raw_end;
+
+  reply.clear();
+  auto append = [&reply](const std::string &s, char terminator) {
+    reply.insert(reply.end(), s.begin(), s.end());
+    reply.push_back(terminator);
+  };
+  append(parents, 0);
+  append(author.name, '\n');
+  append(committer.name, '\n');
+  append(author.date, '\n');
+  append(committer.date, '\n');
+  append(author.email, '\n');
+  append(committer.email, '\n');
+  reply.insert(reply.end(), current, raw_end);
+  reply.push_back(0);
+  reply.push_back('\n');
+  reply.push_back(0);
+  return 0;
+}
+
+int raw_object_store::read_commit_tree(const binary_sha1 &commit,
+                                       binary_sha1 &tree) {
+  std::string raw;
+  if (read_object_of_type(commit, "commit", raw))
+    return 1;
+  if (raw.compare(0, 5, "tree ") || tree.from_textual(raw.c_str() + 5))
+    return error("raw-object-store: no tree in " + commit.to_string());
+  return 0;
+}
+
+int raw_object_store::read_tree(const binary_sha1 &tree,
+                                std::vector<char> &reply) {
+  // Like git-ls-tree, take the tree of a commit.
+  std::string type, raw;
+  if (read_object(tree, type, raw))
+    return 1;
+  if (type == "commit") {
+    binary_sha1 commit_tree;
+    if (raw.compare(0, 5, "tree ") || commit_tree.from_textual(raw.c_str() + 5))
+      return error("raw-object-store: no tree in " + tree.to_string());
+    if (read_object(commit_tree, type, raw))
+      return 1;
+  }
+  if (type != "tree")
+    return error("raw-object-store: " + tree.to_string() + " is a " + type +
+                 ", not a tree");
+
+  reply.clear();
+  auto append = [&reply](const char *s) {
+    reply.insert(reply.end(), s, s + strlen(s));
+  };
+  for (const char *current = raw.data(), *end = current + raw.size();
+       current < end;) {
+    const char *mode = current;
+    const char *space = strchr(mode, ' ');
+    const char *name = space + 1;
+    const unsigned char *sha1 =
+        reinterpret_cast<const unsigned char *>(name + strlen(name) + 1);
+    current = reinterpret_cast<const char *>(sha1) + 20;
+    if (current > end)
+      return error("raw-object-store: bad tree " + tree.to_string());
+
+    // Match git-ls-tree, which pads modes to six digits.
+    std::string mode_text(mode, space);
+    const char *type = mode_text == "40000"    ? "tree"
+                       : mode_text == "160000" ? "commit"
+                                               : "blob";
+    if (mode_text.size() < 6)
+      mode_text.insert(0, 6 - mode_text.size(), '0');
+    append(mode_text.c_str());
+    append(" ");
+    append(type);
+    append(" ");
+    append(textual_sha1(binary_sha1::make_from_binary(sha1)).bytes);
+    append("\t");
+    append(name);
+    append("\n");
+  }
+  reply.push_back(0);
+  return 0;
+}
+
+int raw_object_store::read_parents(const binary_sha1 &commit,
+                                   std::vector<binary_sha1> &parents,
+                                   long long &ct) {
+  std::string raw;
+  if (read_object_of_type(commit, "commit", raw))
+    return 1;
+
+  parents.clear();
+  ct = 0;
+  const char *current = raw.c_str();
+  while (*current && *current != '\n') {
+    if (!strncmp(current, "parent ", 7)) {
+      parents.emplace_back();
+      if (parents.back().from_textual(current + 7))
+        return error("raw-object-store: bad parent in " + commit.to_string());
+    } else if (!strncmp(current, "committer ", 10)) {
+      const char *gt = strchr(current, '>');
+      if (!gt || parse_space(++gt) || parse_num(gt, ct))
+        return error("raw-object-store: bad committer in " +
+                     commit.to_string());
+    }
+    current = strchr(current, '\n');
+    if (!current)
+      break;
+    ++current;
+  }
+  return 0;
+}
+
+int raw_object_store::merge_base(const binary_sha1 &a, const binary_sha1 &b,
+                                 binary_sha1 &base) {
+  if (a == b) {
+    base = a;
+    return 0;
+  }
+
+  // Paint down from both sides, newest first, like git-merge-base.  A commit
+  // reached from both is a candidate, and its ancestors are stale.
+  enum : int { from_a = 1, from_b = 2, stale = 4, result = 8 };
+  struct node_type {
+    int flags = 0;
+    long long ct = 0;
+    std::vector<binary_sha1> parents;
+  };
+  struct entry_type {
+    long long ct;
+    binary_sha1 sha1;
+    bool operator<(const entry_type &x) const { return ct < x.ct; }
+  };
+  struct sha1_hash {
+    size_t operator()(const binary_sha1 &sha1) const {
+      return sha1.get_word(0);
+    }
+  };
+  std::unordered_map<binary_sha1, node_type, sha1_hash> nodes;
+  std::vector<entry_type> queue;
+  std::vector<entry_type> results;
+  auto push = [&](const binary_sha1 &sha1, int f) {
+    auto inserted = nodes.emplace(sha1, node_type());
+    node_type &node = inserted.first->second;
+    if (inserted.second)
+      if (read_parents(sha1, node.parents, node.ct))
+        return 1;
+    node.flags |= f;
+    queue.push_back(entry_type{node.ct, sha1});
+    std::push_heap(queue.begin(), queue.end());
+    return 0;
+  };
+  auto has_nonstale = [&]() {
+    for (const entry_type &entry : queue)
+      if (!(nodes[entry.sha1].flags & stale))
+        return true;
+    return false;
+  };
+
+  if (push(a, from_a) || push(b, from_b))
+    return 1;
+  while (has_nonstale()) {
+    std::pop_heap(queue.begin(), queue.end());
+    entry_type entry = queue.back();
+    queue.pop_back();
+
+    node_type &node = nodes[entry.sha1];
+    int f = node.flags & (from_a | from_b | stale);
+    if (f == (from_a | from_b)) {
+      if (!(node.flags & result)) {
+        node.flags |= result;
+        results.push_back(entry);
+      }
+      f |= stale;
+    }
+    for (const binary_sha1 &p : node.parents) {
+      auto found = nodes.find(p);
+      if (found != nodes.end() && (found->second.flags & f) == f)
+        continue;
+      if (push(p, f))
+        return 1;
+    }
+  }
+
+  // Take the newest candidate that isn't an ancestor of another.
+  const entry_type *best = nullptr;
+  for (const entry_type &entry : results)
+    if (!(nodes[entry.sha1].flags & stale))
+      if (!best || best->ct < entry.ct)
+        best = &entry;
+  if (!best)
+    return 1;
+  base = best->sha1;
+  return 0;
+}
+
+int raw_object_store::merge_base_independent(
+    std::vector<binary_sha1> &commits) {
+  std::vector<binary_sha1> independent;
+  for (size_t i = 0, ie = commits.size(); i != ie; ++i) {
+    bool is_independent = true;
+    for (size_t j = 0; j != ie && is_independent; ++j) {
+      if (commits[i] == commits[j]) {
+        // Keep the first of any duplicates.
+        is_independent = i <= j;
+        continue;
+      }
+      binary_sha1 base;
+      is_independent = merge_base(commits[i], commits[j], base) ||
+                       !(base == commits[i]);
+    }
+    if (is_independent)
+      independent.push_back(commits[i]);
+  }
+  commits.swap(independent);
+  return 0;
+}
+
+int raw_object_store::rev_parse(const std::string &rev, binary_sha1 &sha1) {
+  // Handle "<sha1>^<n>" here, since that's what the interleaver asks for.
+  binary_sha1 commit;
+  int n = 0;
+  bool is_parent = rev.size() > 41 && rev[40] == '^' &&
+                   !commit.from_textual(rev.c_str());
+  if (is_parent) {
+    const char *current = rev.c_str() + 41;
+    is_parent = !parse_num(current, n) && !*current && n > 0;
+  }
+  if (!is_parent)
+    return subprocess_object_store::rev_parse(rev, sha1);
+
+  std::vector<binary_sha1> parents;
+  long long ct;
+  if (read_parents(commit, parents, ct) || size_t(n) > parents.size())
+    return 1;
+  sha1 = parents[n - 1];
+  return 0;
+}
+
+batch_object_store::batch_object_store()
+    : cat_file({"git", "cat-file", "--batch", nullptr}),
+      hash_trees(
+          {"git", "hash-object", "-w", "-t", "tree", "--stdin-paths", nullptr}),
+      hash_commits({"git", "hash-object", "-w", "-t", "commit",
+                    "--stdin-paths", nullptr}) {}
+
+batch_object_store::~batch_object_store() {
+  if (!tree_path.empty())
+    unlink(tree_path.c_str());
+  if (!commit_path.empty())
+    unlink(commit_path.c_str());
+}
+
+int batch_object_store::read_object(const binary_sha1 &sha1,
+                                    std::string &type, std::string &raw) {
+  bool is_missing = false;
+  if (read_object_or_missing(sha1, type, raw, is_missing))
+    return 1;
+  if (is_missing)
+    return error("batch-object-store: " + sha1.to_string() + " is missing");
+  return 0;
+}
+
+int batch_object_store::check_object(const binary_sha1 &sha1) {
+  std::string type, raw;
+  bool is_missing = false;
+  return read_object_or_missing(sha1, type, raw, is_missing) || is_missing;
+}
+
+int batch_object_store::read_object_or_missing(const binary_sha1 &sha1,
+                                               std::string &type,
+                                               std::string &raw,
+                                               bool &is_missing) {
+  std::lock_guard<std::mutex> lock(cat_file.mutex);
+  textual_sha1 text(sha1);
+  text.bytes[40] = '\n';
+  int status = cat_file.write_all(text.bytes, 41);
+  text.bytes[40] = 0;
+  if (status)
+    return 1;
+
+  // Expect "<sha1> <type> <size>", or "<sha1> missing".
+  std::string header;
+  if (cat_file.read_line(header))
+    return 1;
+  is_missing = header == text.to_string() + " missing";
+  if (is_missing)
+    return 0;
+  size_t type_end = header.find(' ', 41);
+  if (header.compare(0, 41, text.to_string() + " ") ||
+      type_end == std::string::npos)
+    return error("batch-object-store: failed to read " + text.to_string() +
+                 ": '" + header + "'");
+  type = header.substr(41, type_end - 41);
+  size_t size = strtoull(header.c_str() + type_end + 1, nullptr, 10);
+
+  std::string newline;
+  if (cat_file.read_exact(raw, size) || cat_file.read_exact(newline, 1) ||
+      newline != "\n")
+    return error("batch-object-store: failed to read " + text.to_string());
+  return 0;
+}
+
+int batch_object_store::hash_object(git_batch_process &process,
+                                    std::string &path, const std::string &raw,
+                                    binary_sha1 &sha1) {
+  std::lock_guard<std::mutex> lock(process.mutex);
+
+  // Git reads the object from a file, which can be reused once it answers.
+  if (path.empty()) {
+    const char *tmpdir = getenv("TMPDIR");
+    std::string pattern =
+        std::string(tmpdir && *tmpdir ? tmpdir : "/tmp") + "/mt-object-XXXXXX";
+    int fd = mkstemp(&pattern[0]);
+    if (fd == -1)
+      return error("batch-object-store: failed to create a temporary file");
+    close(fd);
+    path = pattern;
+  }
+  FILE *file = fopen(path.c_str(), "w");
+  if (!file)
+    return error("batch-object-store: failed to open " + path);
+  bool failed = fwrite(raw.data(), 1, raw.size(), file) != raw.size();
+  failed |= bool(fclose(file));
+  if (failed)
+    return error("batch-object-store: failed to write " + path);
+
+  std::string request = path + "\n";
+  std::string line;
+  textual_sha1 text;
+  const char *end = nullptr;
+  if (process.write_all(request.data(), request.size()) ||
+      process.read_line(line) || text.from_input(line.c_str(), &end) || *end)
+    return error("batch-object-store: failed to write an object");
+  sha1 = binary_sha1(text);
+  return 0;
+}
+
+int batch_object_store::write_tree(const std::string &raw, binary_sha1 &tree) {
+  return hash_object(hash_trees, tree_path, raw, tree);
+}
+
+int batch_object_store::write_commit(const commit_object &commit,
+                                     binary_sha1 &sha1) {
+  return hash_object(hash_commits, commit_path, commit.format(), sha1);
+}
+
+int memory_object_store::read_object(const binary_sha1 &sha1,
+                                     std::string &type, std::string &raw) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto found = objects.find(sha1);
+    if (found != objects.end()) {
+      type = found->second.type;
+      raw = found->second.raw;
+      return 0;
+    }
+  }
+  return batch_object_store::read_object(sha1, type, raw);
+}
+
+int memory_object_store::check_object(const binary_sha1 &sha1) {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (objects.count(sha1))
+      return 0;
+  }
+  return batch_object_store::check_object(sha1);
+}
+
+int memory_object_store::write_tree(const std::string &raw,
+                                    binary_sha1 &tree) {
+  object_store::hash_object("tree", raw, tree);
+  std::lock_guard<std::mutex> lock(mutex);
+  objects.emplace(tree, object_type{"tree", raw});
+  return 0;
+}
+
+int memory_object_store::write_commit(const commit_object &commit,
+                                      binary_sha1 &sha1) {
+  std::string raw = commit.format();
+  object_store::hash_object("commit", raw, sha1);
+  std::lock_guard<std::mutex> lock(mutex);
+  objects.emplace(sha1, object_type{"commit", std::move(raw)});
+  return 0;
+}
@@ -0,0 +1,103 @@
+// object_writer.h
+#pragma once
+
+#include "error.h"
+#include "object_store.h"
+#include "sha1_pool.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+/// Write trees and commits whose names are already known on a background
+/// thread, so that the next tree can be built while git writes the last
+/// commit.  Jobs run in order, so a commit's tree and parents are written
+/// before it is.  Git's answer is checked against the expected name, and
+/// nothing more is written after a failure.
+struct object_writer {
+  /// Write the raw \a tree if \a is_tree, and otherwise \a commit.
+  struct job_type {
+    sha1_ref expected;
+    bool is_tree = false;
+    std::string tree;
+    commit_object commit;
+  };
+
+  object_writer() : thread([this]() { run(); }) {}
+  ~object_writer();
+
+  void push(job_type job);
+
+  /// Wait for all the jobs pushed so far.  Returns non-zero if any failed.
+  int wait();
+
+private:
+  void run();
+  static int write(const job_type &job);
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<job_type> jobs;
+  bool is_busy = false;
+  bool should_stop = false;
+  bool has_error = false;
+  std::thread thread;
+};
+} // end namespace
+
+object_writer::~object_writer() {
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    should_stop = true;
+    cv.notify_all();
+  }
+  thread.join();
+}
+
+void object_writer::push(job_type job) {
+  std::lock_guard<std::mutex> lock(mutex);
+  jobs.push_back(std::move(job));
+  cv.notify_all();
+}
+
+int object_writer::wait() {
+  std::unique_lock<std::mutex> lock(mutex);
+  cv.wait(lock, [&]() { return (jobs.empty() && !is_busy) || has_error; });
+  return has_error;
+}
+
+int object_writer::write(const job_type &job) {
+  binary_sha1 written;
+  auto &store = object_store::get();
+  if (job.is_tree ? store.write_tree(job.tree, written)
+                  : store.write_commit(job.commit, written))
+    return error("object-writer: failed to write " +
+                 job.expected->to_string());
+
+  if (!(written == *job.expected))
+    return error("object-writer: git wrote '" + written.to_string() +
+                 "', expected " + job.expected->to_string());
+  return 0;
+}
+
+void object_writer::run() {
+  std::unique_lock<std::mutex> lock(mutex);
+  while (true) {
+    cv.wait(lock, [&]() { return !jobs.empty() || should_stop; });
+    if (jobs.empty() || has_error)
+      return;
+
+    job_type job = std::move(jobs.front());
+    jobs.pop_front();
+    is_busy = true;
+    lock.unlock();
+    int status = write(job);
+    lock.lock();
+    is_busy = false;
+    has_error = status;
+    cv.notify_all();
+  }
+}
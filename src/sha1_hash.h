@@ -0,0 +1,97 @@
+// sha1_hash.h
+#pragma once
+
+#include "sha1convert.h"
+#include <cstdint>
+#include <cstring>
+
+namespace {
+/// Incremental SHA-1, for computing git object names without asking git.
+struct sha1_hasher {
+  uint32_t state[5] = {0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476,
+                       0xc3d2e1f0};
+  unsigned char block[64];
+  uint64_t num_bytes = 0;
+
+  void update(const void *data, size_t count);
+  void finish(binary_sha1 &sha1);
+
+private:
+  void process_block(const unsigned char *bytes);
+  static uint32_t rotl(uint32_t x, int n) { return x << n | x >> (32 - n); }
+};
+} // end namespace
+
+void sha1_hasher::process_block(const unsigned char *bytes) {
+  uint32_t w[80];
+  for (int i = 0; i < 16; ++i)
+    w[i] = uint32_t(bytes[4 * i]) << 24 | uint32_t(bytes[4 * i + 1]) << 16 |
+           uint32_t(bytes[4 * i + 2]) << 8 | uint32_t(bytes[4 * i + 3]);
+  for (int i = 16; i < 80; ++i)
+    w[i] = rotl(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+  uint32_t a = state[0], b = state[1], c = state[2], d = state[3],
+           e = state[4];
+  for (int i = 0; i < 80; ++i) {
+    uint32_t f, k;
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+    uint32_t temp = rotl(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = rotl(b, 30);
+    b = a;
+    a = temp;
+  }
+  state[0] += a;
+  state[1] += b;
+  state[2] += c;
+  state[3] += d;
+  state[4] += e;
+}
+
+void sha1_hasher::update(const void *data, size_t count) {
+  auto *bytes = static_cast<const unsigned char *>(data);
+  size_t used = num_bytes % 64;
+  num_bytes += count;
+
+  // Fill up a partial block first.
+  if (used) {
+    size_t fill = 64 - used < count ? 64 - used : count;
+    memcpy(block + used, bytes, fill);
+    bytes += fill;
+    count -= fill;
+    if (used + fill < 64)
+      return;
+    process_block(block);
+  }
+  for (; count >= 64; bytes += 64, count -= 64)
+    process_block(bytes);
+  memcpy(block, bytes, count);
+}
+
+void sha1_hasher::finish(binary_sha1 &sha1) {
+  uint64_t num_bits = num_bytes * 8;
+  unsigned char padding[72] = {0x80};
+  size_t used = num_bytes % 64;
+  size_t num_padding = (used < 56 ? 56 : 120) - used;
+  for (int i = 0; i < 8; ++i)
+    padding[num_padding + i] = num_bits >> (56 - 8 * i);
+  update(padding, num_padding + 8);
+  assert(num_bytes % 64 == 0);
+
+  for (int i = 0; i < 5; ++i)
+    for (int j = 0; j < 4; ++j)
+      sha1.bytes[4 * i + j] = state[i] >> (24 - 8 * j);
+}
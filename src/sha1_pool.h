@@ -4,6 +4,7 @@
 #include "bump_allocator.h"
 #include "sha1convert.h"
 #include <bitset>
+#include <string>
 
 namespace {
 template <class T> struct sha1_trie {
@@ -47,6 +48,20 @@ template <class T> struct sha1_trie {
                  bool &was_inserted);
 
   bool empty() const { return root.mask.none(); }
+
+  /// Visit every value, in sha1 order.
+  template <class F> void for_each(F visit) const {
+    for (size_t i = 0, ie = root.mask.size(); i != ie; ++i)
+      if (root.mask.test(i))
+        for_each_impl(root.entries[i], visit);
+  }
+  template <class F> static void for_each_impl(entry_type entry, F &visit);
+
+  void use_huge_pages() {
+    subtrie_alloc.use_huge_pages();
+    value_alloc.use_huge_pages();
+  }
+  void print_allocator_stats(FILE *file, const char *name) const;
 };
 template <class T> struct sha1_trie<T>::subtrie_type {
   static constexpr const long num_bits = 6;
@@ -90,6 +105,26 @@ struct sha1_pool {
 };
 } // end namespace
 
+template <class T>
+template <class F>
+void sha1_trie<T>::for_each_impl(entry_type entry, F &visit) {
+  if (!entry.is_subtrie()) {
+    visit(static_cast<const T &>(*entry.as_data()));
+    return;
+  }
+  subtrie_type *subtrie = entry.as_subtrie();
+  for (size_t i = 0, ie = subtrie->mask.size(); i != ie; ++i)
+    if (subtrie->mask.test(i))
+      for_each_impl(subtrie->entries[i], visit);
+}
+
+template <class T>
+void sha1_trie<T>::print_allocator_stats(FILE *file, const char *name) const {
+  std::string prefix = name;
+  subtrie_alloc.print_stats(file, (prefix + ".subtries").c_str());
+  value_alloc.print_stats(file, (prefix + ".values").c_str());
+}
+
 template <class T>
 T *sha1_trie<T>::insert(const binary_sha1 &sha1, bool &was_inserted) {
   return lookup_impl(sha1, true, was_inserted);
@@ -205,10 +240,10 @@ sha1_ref sha1_pool::lookup(const binary_sha1 &sha1) {
 
 int sha1_pool::parse_sha1(const char *&current, sha1_ref &sha1,
                           bool allow_zeros) {
-  textual_sha1 text;
-  if (text.from_input(current, &current))
+  binary_sha1 bin;
+  if (bin.from_input(current, &current))
     return 1;
-  sha1 = lookup(text);
+  sha1 = lookup(bin);
   if (!sha1)
     return allow_zeros ? 0 : 1;
   return 0;
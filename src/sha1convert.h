@@ -3,57 +3,229 @@
 
 #include "bump_allocator.h"
 #include <cassert>
+#include <cstdlib>
 #include <cstring>
 #include <string>
 
-static unsigned char convert(int ch) {
-  switch (ch) {
-  default:
-    __builtin_unreachable();
-  case '0':
-  case '1':
-  case '2':
-  case '3':
-  case '4':
-  case '5':
-  case '6':
-  case '7':
-  case '8':
-  case '9':
-    return ch - '0';
-  case 'a':
-  case 'b':
-  case 'c':
-  case 'd':
-  case 'e':
-  case 'f':
-    return ch - 'a' + 10;
+// The vector kernels deliberately read all 40 bytes of their input before
+// checking it, which can run past the end of a shorter string.  That's safe
+// (see decode_sha1), but sanitizers rightly can't tell, so don't use them in
+// sanitized builds.
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer) || __has_feature(memory_sanitizer)
+#define MT_SHA1_SCALAR_ONLY 1
+#endif
+#endif
+#if defined(__SANITIZE_ADDRESS__)
+#define MT_SHA1_SCALAR_ONLY 1
+#endif
+
+#if defined(__x86_64__) && !defined(MT_SHA1_SCALAR_ONLY)
+#define MT_SHA1_HAS_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__,
+              "binary_sha1 word loads assume a little-endian host");
+
+/// Map characters to nibbles, with 0xff for anything that is not [0-9a-f].
+struct hex_table {
+  unsigned char nibbles[256];
+  constexpr hex_table() : nibbles() {
+    for (int i = 0; i < 256; ++i)
+      nibbles[i] = 0xff;
+    for (int i = 0; i < 10; ++i)
+      nibbles['0' + i] = i;
+    for (int i = 0; i < 6; ++i)
+      nibbles['a' + i] = 10 + i;
+  }
+};
+static constexpr const hex_table hex_nibbles;
+static constexpr const char hex_digits[] = "0123456789abcdef";
+
+/// Decode 40 hex digits into 20 bytes.  Return 0 on success and 1 if any
+/// character is not in [0-9a-f]; characters after the first invalid one are
+/// not read.
+static int decode_sha1_scalar(unsigned char *bin, const char *text) {
+  for (int i = 0; i < 20; ++i) {
+    unsigned char hi = hex_nibbles.nibbles[(unsigned char)text[2 * i]];
+    if (hi == 0xff)
+      return 1;
+    unsigned char lo = hex_nibbles.nibbles[(unsigned char)text[2 * i + 1]];
+    if (lo == 0xff)
+      return 1;
+    bin[i] = (hi << 4) | lo;
   }
+  return 0;
 }
-static int unconvert(unsigned char ch, int index) {
-  unsigned char stripped = index ? ch & 0xf : ch >> 4;
-  assert(stripped >= 0);
-  assert(stripped < 16);
-  // TODO: Add a testcase for a-f.
-  return stripped < 10 ? '0' + stripped : 'a' + (stripped - 10);
+static void encode_sha1_scalar(char *text, const unsigned char *bin) {
+  for (int i = 0; i < 20; ++i) {
+    text[2 * i] = hex_digits[bin[i] >> 4];
+    text[2 * i + 1] = hex_digits[bin[i] & 0xf];
+  }
 }
 
-/// Return 0 (success) except for the "empty" hash (all 0s).
+#if defined(MT_SHA1_HAS_X86_KERNELS)
+/// Turn 16 hex characters into nibbles, clearing \p valid if any of the
+/// characters selected by \p lanes is not in [0-9a-f].
+__attribute__((target("sse4.1"))) static inline __m128i
+hex_to_nibbles_sse4(__m128i chars, int lanes, int &valid) {
+  __m128i digits = _mm_sub_epi8(chars, _mm_set1_epi8('0'));
+  __m128i letters = _mm_sub_epi8(chars, _mm_set1_epi8('a'));
+  __m128i zero = _mm_setzero_si128();
+  __m128i is_digit =
+      _mm_cmpeq_epi8(_mm_subs_epu8(digits, _mm_set1_epi8(9)), zero);
+  __m128i is_letter =
+      _mm_cmpeq_epi8(_mm_subs_epu8(letters, _mm_set1_epi8(5)), zero);
+  valid &= (_mm_movemask_epi8(_mm_or_si128(is_digit, is_letter)) & lanes) ==
+           lanes;
+  return _mm_or_si128(
+      _mm_and_si128(is_digit, digits),
+      _mm_and_si128(is_letter, _mm_add_epi8(letters, _mm_set1_epi8(10))));
+}
+
+/// Combine adjacent nibbles into bytes, leaving them in 16-bit lanes.
+__attribute__((target("sse4.1"))) static inline __m128i
+nibbles_to_words_sse4(__m128i nibbles) {
+  return _mm_maddubs_epi16(nibbles, _mm_set1_epi16(0x0110));
+}
+
+__attribute__((target("sse4.1"))) static int
+decode_sha1_sse4(unsigned char *bin, const char *text) {
+  int valid = 1;
+  __m128i a = hex_to_nibbles_sse4(
+      _mm_loadu_si128((const __m128i *)text), 0xffff, valid);
+  __m128i b = hex_to_nibbles_sse4(
+      _mm_loadu_si128((const __m128i *)(text + 16)), 0xffff, valid);
+  __m128i c = hex_to_nibbles_sse4(
+      _mm_loadl_epi64((const __m128i *)(text + 32)), 0xff, valid);
+  if (!valid)
+    return 1;
+  __m128i ab =
+      _mm_packus_epi16(nibbles_to_words_sse4(a), nibbles_to_words_sse4(b));
+  __m128i cc = nibbles_to_words_sse4(c);
+  _mm_storeu_si128((__m128i *)bin, ab);
+  uint32_t tail = _mm_cvtsi128_si32(_mm_packus_epi16(cc, cc));
+  memcpy(bin + 16, &tail, 4);
+  return 0;
+}
+
+__attribute__((target("avx2"))) static int
+decode_sha1_avx2(unsigned char *bin, const char *text) {
+  __m256i chars = _mm256_loadu_si256((const __m256i *)text);
+  __m256i digits = _mm256_sub_epi8(chars, _mm256_set1_epi8('0'));
+  __m256i letters = _mm256_sub_epi8(chars, _mm256_set1_epi8('a'));
+  __m256i zero = _mm256_setzero_si256();
+  __m256i is_digit = _mm256_cmpeq_epi8(
+      _mm256_subs_epu8(digits, _mm256_set1_epi8(9)), zero);
+  __m256i is_letter = _mm256_cmpeq_epi8(
+      _mm256_subs_epu8(letters, _mm256_set1_epi8(5)), zero);
+  int valid =
+      _mm256_movemask_epi8(_mm256_or_si256(is_digit, is_letter)) == -1;
+  __m128i c = hex_to_nibbles_sse4(
+      _mm_loadl_epi64((const __m128i *)(text + 32)), 0xff, valid);
+  if (!valid)
+    return 1;
+  __m256i nibbles = _mm256_or_si256(
+      _mm256_and_si256(is_digit, digits),
+      _mm256_and_si256(is_letter,
+                       _mm256_add_epi8(letters, _mm256_set1_epi8(10))));
+  __m256i words = _mm256_maddubs_epi16(nibbles, _mm256_set1_epi16(0x0110));
+  __m128i ab = _mm_packus_epi16(_mm256_castsi256_si128(words),
+                                _mm256_extracti128_si256(words, 1));
+  __m128i cc = nibbles_to_words_sse4(c);
+  _mm_storeu_si128((__m128i *)bin, ab);
+  uint32_t tail = _mm_cvtsi128_si32(_mm_packus_epi16(cc, cc));
+  memcpy(bin + 16, &tail, 4);
+  return 0;
+}
+
+/// Turn bytes into pairs of hex characters; \p bytes holds up to 16 bytes,
+/// and the characters for the first (last) 8 are returned in \p lo (\p hi).
+__attribute__((target("sse4.1"))) static inline void
+bytes_to_hex_sse4(__m128i bytes, __m128i &lo, __m128i &hi) {
+  __m128i digits = _mm_loadu_si128((const __m128i *)hex_digits);
+  __m128i mask = _mm_set1_epi8(0xf);
+  __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+  __m128i low = _mm_and_si128(bytes, mask);
+  lo = _mm_shuffle_epi8(digits, _mm_unpacklo_epi8(high, low));
+  hi = _mm_shuffle_epi8(digits, _mm_unpackhi_epi8(high, low));
+}
+
+__attribute__((target("sse4.1"))) static void
+encode_sha1_sse4(char *text, const unsigned char *bin) {
+  __m128i lo, hi;
+  bytes_to_hex_sse4(_mm_loadu_si128((const __m128i *)bin), lo, hi);
+  _mm_storeu_si128((__m128i *)text, lo);
+  _mm_storeu_si128((__m128i *)(text + 16), hi);
+  uint32_t tail;
+  memcpy(&tail, bin + 16, 4);
+  bytes_to_hex_sse4(_mm_cvtsi32_si128(tail), lo, hi);
+  _mm_storel_epi64((__m128i *)(text + 32), lo);
+}
+#endif
+
+typedef int (*decode_sha1_function)(unsigned char *bin, const char *text);
+typedef void (*encode_sha1_function)(char *text, const unsigned char *bin);
+/// The fastest kernels the CPU supports.  Set MT_SHA1_KERNEL to "scalar" or
+/// "sse4.1" to use slower ones, e.g., to test them.
+struct sha1_kernels {
+  decode_sha1_function decode = decode_sha1_scalar;
+  encode_sha1_function encode = encode_sha1_scalar;
+
+  sha1_kernels() {
+#if defined(MT_SHA1_HAS_X86_KERNELS)
+    const char *limit = getenv("MT_SHA1_KERNEL");
+    if (limit && !strcmp(limit, "scalar"))
+      return;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.1")) {
+      decode = decode_sha1_sse4;
+      encode = encode_sha1_sse4;
+    }
+    if (limit && !strcmp(limit, "sse4.1"))
+      return;
+    if (__builtin_cpu_supports("avx2"))
+      decode = decode_sha1_avx2;
+#endif
+  }
+};
+static const sha1_kernels sha1_kernels_for_cpu;
+
+/// Decode and validate 40 hex digits.  The vector kernels read all 40 bytes
+/// even if \p text is shorter, though any NUL makes the result invalid.
+/// Reads that stay within the page of a valid byte can't fault, so fall back
+/// to the scalar loop (which stops at the first invalid character) only when
+/// the 40 bytes could cross into the next page.
+static int decode_sha1(unsigned char *bin, const char *text) {
+  if (((uintptr_t)text & 4095) > 4096 - 40)
+    return decode_sha1_scalar(bin, text);
+  return sha1_kernels_for_cpu.decode(bin, text);
+}
+
+static bool is_zeros_sha1(const unsigned char *bin) {
+  uint64_t a, b;
+  uint32_t c;
+  memcpy(&a, bin, 8);
+  memcpy(&b, bin + 8, 8);
+  memcpy(&c, bin + 16, 4);
+  return !(a | b | c);
+}
+
+/// Return 0 (success) except for the "empty" hash (all 0s) and for invalid
+/// characters.
 static int sha1tobin(unsigned char *bin, const char *text) {
-  bool any = false;
-  for (int i = 0; i < 40; i += 2)
-    any |= bin[i / 2] = (convert(text[i]) << 4) | convert(text[i + 1]);
-  return any ? 0 : 1;
+  if (decode_sha1(bin, text)) {
+    memset(bin, 0, 20);
+    return 1;
+  }
+  return is_zeros_sha1(bin) ? 1 : 0;
 }
 /// Return 0 (success) except for the "empty" hash (all 0s).
 static int bintosha1(char *text, const unsigned char *bin) {
-  bool any = false;
-  for (int i = 0; i < 40; ++i) {
-    text[i] = unconvert(bin[i / 2], i % 2);
-    any |= text[i] != '0';
-  }
+  sha1_kernels_for_cpu.encode(text, bin);
   text[40] = '\0';
-  return any ? 0 : 1;
+  return is_zeros_sha1(bin) ? 1 : 0;
 }
 
 namespace {
@@ -66,6 +238,8 @@ struct binary_sha1 {
   }
   void from_binary(const unsigned char *sha1) { std::memcpy(bytes, sha1, 20); }
   int from_textual(const char *sha1) { return sha1tobin(bytes, sha1); }
+  int from_input(const char *sha1, const char **end = nullptr);
+  uint64_t get_word(int i) const;
   unsigned get_bits(int start, int count) const;
   int get_mismatched_bit(const binary_sha1 &x) const;
   friend bool operator==(const binary_sha1 &lhs, const binary_sha1 &rhs) {
@@ -90,12 +264,7 @@ struct textual_sha1 {
 };
 } // end namespace
 
-bool binary_sha1::is_zeros() const {
-  for (int i = 0; i < 20; ++i)
-    if (bytes[i] != 0)
-      return false;
-  return true;
-}
+bool binary_sha1::is_zeros() const { return is_zeros_sha1(bytes); }
 
 bool textual_sha1::is_zeros() const {
   for (int i = 0; bytes[i] && i < 40; ++i)
@@ -109,6 +278,16 @@ std::string binary_sha1::to_string() const {
   return textual_sha1(*this).to_string();
 }
 
+uint64_t binary_sha1::get_word(int i) const {
+  // Load big-endian so that bit 0 of the sha1 is the top bit of word 0.  The
+  // last word only has 32 bits of data and is padded with zeros.
+  assert(i >= 0);
+  assert(i < 3);
+  uint64_t word = 0;
+  memcpy(&word, bytes + 8 * i, i < 2 ? 8 : 4);
+  return __builtin_bswap64(word);
+}
+
 unsigned binary_sha1::get_bits(int start, int count) const {
   assert(count > 0);
   assert(count <= 32);
@@ -116,48 +295,32 @@ unsigned binary_sha1::get_bits(int start, int count) const {
   assert(start <= 159);
   assert(start + count <= 160);
 
-  // Use unsigned char to avoid weird promitions.
-  // TODO: add a test where this matters.
-  int index = 0;
-  if (start >= 8) {
-    index += start / 8;
-    start = start % 8;
-  }
-  int totake = count + start; // could be more than 32
-  unsigned long long bits = 0;
-  while (totake > 0) {
-    bits <<= 8;
-    bits |= bytes[index++];
-    totake -= 8;
-  }
-  if (totake < 0)
-    bits >>= -totake;
-  bits &= (1ull << count) - 1;
-  return bits;
+  int shift = start % 64;
+  uint64_t bits = get_word(start / 64) << shift;
+  if (shift + count > 64)
+    bits |= get_word(start / 64 + 1) >> (64 - shift);
+  return bits >> (64 - count);
 }
 
 int binary_sha1::get_mismatched_bit(const binary_sha1 &x) const {
-  int i = 0;
-  for (; i < 160; i += 8) {
-    int byte_i = i / 8;
-    if (bytes[byte_i] != x.bytes[byte_i])
-      break;
-  }
-  if (i == 160)
-    return i;
-
-  int byte_i = i / 8;
-  unsigned lhs = bytes[byte_i];
-  unsigned rhs = x.bytes[byte_i];
-  unsigned mismatch = lhs ^ rhs;
-  assert(mismatch & 0x000000ff);
-  assert(!(mismatch & 0xffffff00));
-  mismatch <<= 1;
-  while (!(mismatch & 0x100)) {
-    ++i;
-    mismatch <<= 1;
-  }
-  return i;
+  for (int i = 0; i < 3; ++i)
+    if (uint64_t mismatch = get_word(i) ^ x.get_word(i))
+      return 64 * i + __builtin_clzll(mismatch);
+  return 160;
+}
+
+int binary_sha1::from_input(const char *sha1, const char **end) {
+  // Validate and decode in one pass.  Like textual_sha1::from_input, the
+  // sha1 must be followed by something other than [0-9a-z].
+  if (decode_sha1(bytes, sha1))
+    return 1;
+  char next = sha1[40];
+  if ((next >= '0' && next <= '9') || (next >= 'a' && next <= 'z'))
+    return 1;
+  if (!end)
+    return next ? 1 : 0;
+  *end = sha1 + 40;
+  return 0;
 }
 
 int textual_sha1::from_input(const char *sha1, const char **end) {
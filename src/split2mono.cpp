@@ -9,7 +9,8 @@
 //
 //   <header>::   'name:' SP <name> LF
 //   <upstream>:: 'upstream:' SP <name> SP <num-upstreams>
-//                            SP <commits-size> SP <svnbase-size> LF
+//                            SP <commits-size> SP <svnbase-size>
+//                            [SP <splitrev-size>] LF
 //
 // - blob: commits
 //   0x0000-0x0027: magic
@@ -31,6 +32,30 @@
 // - blob: svnbase.index
 //   <index>
 //
+// - blob: splitrev (optional; missing in older databases)
+//   0x0000-0x0007: magic
+//   0x0008-0x...: commit pairs
+//   - commit: 0x18
+//     0x00-0x13: sha1 (split)
+//     0x14-0x17: llvm svn rev, or 0 if not an upstream commit
+//
+// - blob: splitrev.index
+//   <index>
+//
+// - stream: delta (output of export-since, input to apply)
+//   0x0000-0x0007: magic
+//   <table-delta> for commits, svnbase, and splitrev, in that order
+//   0x0000-0x0007: upstreams size, N
+//   0x0008-0x....: N bytes copied from upstreams
+//
+//   table-delta:
+//   0x0000-0x0007: offset (records already replicated)
+//   0x0008-0x000f: number of records, N
+//   0x0010-0x....: N records, as laid out in the table
+//
+// - file: cache (optional, local to a worktree; never committed)
+//   snapshot of data read from git, see cache_snapshot.h
+//
 //
 // <index>
 //   0x0000-0x0007: magic
@@ -51,12 +76,17 @@
 #include "file_stream.h"
 #include "git_cache.h"
 #include "mmapped_file.h"
+#include "object_store.h"
+#include "read_all.h"
 #include "sha1_pool.h"
 #include "sha1convert.h"
 #include "split2monodb.h"
+#include "split2monofsck.h"
+#include "svn2gitdb.h"
 #include "svnbaserev.h"
 #include <bitset>
 #include <cassert>
+#include <climits>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
@@ -74,18 +104,34 @@ static int usage(const std::string &msg, const char *cmd) {
           "       %s lookup-svnbase     <dbdir> <sha1>\n"
           "       %s upstream           <dbdir> <upstream-dbdir>\n"
           "       %s check-upstream     <dbdir> <upstream-dbdir>\n"
+          "       %s export-since       <dbdir> <commits-offset> \\\n"
+          "                             <svnbase-offset> [<splitrev-offset>]\n"
+          "       %s apply              <dbdir>\n"
           "       %s insert             <dbdir> [<split> <mono>]\n"
           "       %s insert-svnbase     <dbdir> <sha1> <rev>\n"
-          "       %s interleave-commits <dbdir> <svn2git-db>   \\\n"
+          "       %s interleave-commits [--cache] [--plan]     \\\n"
+          "                             [--checkpoint <file>]  \\\n"
+          "                             <dbdir> <svn2git-db>   \\\n"
           "                             <head> (<sha1>:<dir>)+ \\\n"
           "                                 -- (<sha1>:<dir>)+\n"
           "       %s dump               <dbdir>\n"
+          "       %s fsck               [-j <jobs>] <dbdir>\n"
           "\n"
           "special handling for <sha1>:<dir> pairs\n"
           "       <dir>     '-'         root\n"
           "                 000...0     not yet started\n"
-          "       <sha1>    '-'         untracked\n",
-          cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd);
+          "       <sha1>    '-'         untracked\n"
+          "\n"
+          "interleave-commits options\n"
+          "       --cache   reuse git data across runs via <dbdir>/cache\n"
+          "       --checkpoint <file>\n"
+          "                 save progress periodically to <file>, and resume\n"
+          "                 from it if it matches the other arguments\n"
+          "       --plan    stop after discovery and print the commits to\n"
+          "                 translate, the git calls it would make, and\n"
+          "                 a projected runtime; writes nothing, and\n"
+          "                 ignores --checkpoint\n",
+          cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd);
   return 1;
 }
 
@@ -294,10 +340,15 @@ static int main_upstream(const char *cmd, int argc, const char *argv[]) {
   if (existing_entry->second.svnbase_size > upstream.svnbase_size_on_open())
     return error("upstream is missing svnbase revs we already merged");
 
+  if (existing_entry->second.splitrev_size > upstream.splitrev_size_on_open())
+    return error("upstream is missing split revs we already merged");
+
   // Nothing to do if nothing has changed (or the upstream is empty).
   if (existing_entry->second.num_upstreams == (long)upstream.upstreams.size() &&
       existing_entry->second.commits_size == upstream.commits_size_on_open() &&
       existing_entry->second.svnbase_size == upstream.svnbase_size_on_open() &&
+      existing_entry->second.splitrev_size ==
+          upstream.splitrev_size_on_open() &&
       !is_new)
     return 0;
 
@@ -311,7 +362,8 @@ static int main_upstream(const char *cmd, int argc, const char *argv[]) {
     if (!existing_ue.name.empty())
       if (existing_ue.num_upstreams > ue.second.num_upstreams ||
           existing_ue.commits_size > ue.second.commits_size ||
-          existing_ue.svnbase_size > ue.second.svnbase_size)
+          existing_ue.svnbase_size > ue.second.svnbase_size ||
+          existing_ue.splitrev_size > ue.second.splitrev_size)
         return error("upstream's upstream is out-of-date");
 
     // Update.
@@ -324,7 +376,11 @@ static int main_upstream(const char *cmd, int argc, const char *argv[]) {
           upstream.commits_size_on_open()) ||
       merge_tables<svnbase_table>(
           main.svnbase, existing_entry->second.svnbase_size, upstream.svnbase,
-          upstream.svnbase_size_on_open()))
+          upstream.svnbase_size_on_open()) ||
+      merge_tables<splitrev_table>(
+          main.splitrev, existing_entry->second.splitrev_size,
+          upstream.splitrev, upstream.splitrev_size_on_open(),
+          /*keep_existing=*/true))
     return 1;
 
   // Close the streams.
@@ -335,6 +391,7 @@ static int main_upstream(const char *cmd, int argc, const char *argv[]) {
   existing_entry->second.num_upstreams = upstream.upstreams.size();
   existing_entry->second.commits_size = upstream.commits_size_on_open();
   existing_entry->second.svnbase_size = upstream.svnbase_size_on_open();
+  existing_entry->second.splitrev_size = upstream.splitrev_size_on_open();
   int upstreamsfd = openat(main.dbfd, "upstreams", O_WRONLY | O_TRUNC);
   if (upstreamsfd == -1)
     return error("could not reopen upstreams to write merged file");
@@ -343,13 +400,22 @@ static int main_upstream(const char *cmd, int argc, const char *argv[]) {
     return error("could not reopen stream for upstreams");
   if (fprintf(ufile, "name: %s\n", main.name.c_str()) < 0)
     return error("could not write repo name");
-  for (auto &ue : main.upstreams)
+  for (auto &ue : main.upstreams) {
     if (fprintf(ufile,
                 "upstream: %s num-upstreams=%ld commits-size=%ld "
-                "svnbase-size=%ld\n",
+                "svnbase-size=%ld",
                 ue.second.name.c_str(), ue.second.num_upstreams,
                 ue.second.commits_size, ue.second.svnbase_size) < 0)
       return error("could not write upstream");
+
+    // Only mention splitrev when there is something, to avoid churn in
+    // databases that don't have one.
+    if (ue.second.splitrev_size &&
+        fprintf(ufile, " splitrev-size=%ld", ue.second.splitrev_size) < 0)
+      return error("could not write upstream");
+    if (fprintf(ufile, "\n") < 0)
+      return error("could not write upstream");
+  }
   if (fclose(ufile))
     return error("problem closing new upstream");
   return 0;
@@ -374,7 +440,9 @@ static int main_check_upstream(const char *cmd, int argc, const char *argv[]) {
   if (existing_entry == main.upstreams.end() ||
       existing_entry->second.num_upstreams != (long)upstream.upstreams.size() ||
       existing_entry->second.commits_size != upstream.commits_size_on_open() ||
-      existing_entry->second.svnbase_size != upstream.svnbase_size_on_open()) {
+      existing_entry->second.svnbase_size != upstream.svnbase_size_on_open() ||
+      existing_entry->second.splitrev_size !=
+          upstream.splitrev_size_on_open()) {
     fprintf(stderr, "'%s' is not up-to-date with '%s'\n", main.name.c_str(),
             upstream.name.c_str());
     return 1;
@@ -385,6 +453,206 @@ static int main_check_upstream(const char *cmd, int argc, const char *argv[]) {
   return 0;
 }
 
+static const unsigned char delta_magic[] = {'s', 2, 'm', 0xd, 0xe, 0x1,
+                                            0x7, 'a'};
+
+static void append_delta_number(std::vector<unsigned char> &delta,
+                                unsigned long long num) {
+  for (int shift = 56; shift >= 0; shift -= 8)
+    delta.push_back(num >> shift);
+}
+
+static int parse_delta_number(const unsigned char *&cur,
+                              const unsigned char *end, long &num) {
+  if (end - cur < 8)
+    return error("delta is truncated");
+  unsigned long long value = 0;
+  for (int i = 0; i < 8; ++i)
+    value = value << 8 | *cur++;
+  if (value > (unsigned long long)LONG_MAX)
+    return error("delta has an invalid size");
+  num = value;
+  return 0;
+}
+
+static int parse_offset(const char *raw, long &offset) {
+  char *end = nullptr;
+  offset = strtol(raw, &end, 10);
+  return !*raw || *end || offset < 0;
+}
+
+template <class T>
+static int export_table(std::vector<unsigned char> &delta, table_streams &ts,
+                        long offset, long size) {
+  if (offset > size)
+    return error(ts.name + " offset " + std::to_string(offset) +
+                 " is past the end of the table (" + std::to_string(size) +
+                 ")");
+  long num_bytes = (size - offset) * T::size;
+  append_delta_number(delta, offset);
+  append_delta_number(delta, size - offset);
+  if (!num_bytes)
+    return 0;
+
+  size_t first = delta.size();
+  delta.resize(first + num_bytes);
+  if (ts.data.seek_and_read(T::table_offset + offset * T::size,
+                            delta.data() + first, num_bytes) != num_bytes)
+    return error("could not read " + ts.name + " table");
+  return 0;
+}
+
+static int main_export_since(const char *cmd, int argc, const char *argv[]) {
+  if (argc != 3 && argc != 4)
+    return usage("export-since: wrong number of positional arguments", cmd);
+  long commits_offset, svnbase_offset, splitrev_offset = 0;
+  if (parse_offset(argv[1], commits_offset))
+    return usage("export-since: invalid <commits-offset>", cmd);
+  if (parse_offset(argv[2], svnbase_offset))
+    return usage("export-since: invalid <svnbase-offset>", cmd);
+  if (argc == 4 && parse_offset(argv[3], splitrev_offset))
+    return usage("export-since: invalid <splitrev-offset>", cmd);
+
+  split2monodb db;
+  db.is_read_only = true;
+  if (db.opendb(argv[0]))
+    return usage("could not open <dbdir>", cmd);
+
+  std::vector<char> upstreams;
+  int upstreamsfd = db.upstreamsfd;
+  db.upstreamsfd = -1;
+  if (read_all(upstreamsfd, upstreams) | close(upstreamsfd))
+    return error("could not read <dbdir>/upstreams");
+
+  std::vector<unsigned char> delta(delta_magic,
+                                   delta_magic + sizeof(delta_magic));
+  if (export_table<commits_table>(delta, db.commits, commits_offset,
+                                  db.commits_size_on_open()) ||
+      export_table<svnbase_table>(delta, db.svnbase, svnbase_offset,
+                                  db.svnbase_size_on_open()) ||
+      export_table<splitrev_table>(delta, db.splitrev, splitrev_offset,
+                                   db.splitrev_size_on_open()))
+    return 1;
+  append_delta_number(delta, upstreams.size());
+  delta.insert(delta.end(), upstreams.begin(), upstreams.end());
+
+  if (fwrite(delta.data(), 1, delta.size(), stdout) != delta.size() ||
+      fflush(stdout))
+    return error("could not write delta");
+  return 0;
+}
+
+namespace {
+struct table_delta {
+  long offset = 0;
+  long num_records = 0;
+  const unsigned char *records = nullptr;
+};
+} // end namespace
+
+template <class T>
+static int parse_table_delta(const unsigned char *&cur,
+                             const unsigned char *end, table_delta &td) {
+  if (parse_delta_number(cur, end, td.offset) ||
+      parse_delta_number(cur, end, td.num_records))
+    return 1;
+  if (td.num_records > (end - cur) / T::size)
+    return error("delta is truncated");
+  td.records = cur;
+  cur += td.num_records * T::size;
+  return 0;
+}
+
+/// Check that \a td continues the replica table \a ts, which has \a size
+/// records.  Records the replica already has must match; drop them from \a td
+/// so that applying the same delta twice is harmless.
+template <class T>
+static int check_table_delta(table_streams &ts, long size, table_delta &td) {
+  if (size < td.offset)
+    return error(ts.name + " table has " + std::to_string(size) +
+                 " records, but delta starts at " + std::to_string(td.offset));
+
+  unsigned char existing[T::size];
+  for (; td.num_records && td.offset < size; ++td.offset, --td.num_records) {
+    if (ts.data.seek_and_read(T::table_offset + td.offset * T::size, existing,
+                              T::size) != T::size)
+      return error("could not read " + ts.name + " table");
+    if (memcmp(existing, td.records, T::size))
+      return error(ts.name + " table has diverged from delta at record " +
+                   std::to_string(td.offset));
+    td.records += T::size;
+  }
+  return 0;
+}
+
+template <class T>
+static int apply_table_delta(table_streams &ts, const table_delta &td) {
+  return insert_records<T>(ts, td.records,
+                           td.records + td.num_records * T::size,
+                           /*keep_existing=*/false);
+}
+
+static int main_apply(const char *cmd, int argc, const char *argv[]) {
+  if (argc != 1)
+    return usage("apply: wrong number of positional arguments", cmd);
+
+  std::vector<char> input;
+  if (read_all(0, input))
+    return error("apply: could not read delta");
+  const unsigned char *cur =
+      reinterpret_cast<const unsigned char *>(input.data());
+  const unsigned char *end = cur + input.size();
+  if (size_t(end - cur) < sizeof(delta_magic) ||
+      memcmp(cur, delta_magic, sizeof(delta_magic)))
+    return error("apply: invalid delta");
+  cur += sizeof(delta_magic);
+
+  table_delta commits, svnbase, splitrev;
+  long upstreams_size;
+  if (parse_table_delta<commits_table>(cur, end, commits) ||
+      parse_table_delta<svnbase_table>(cur, end, svnbase) ||
+      parse_table_delta<splitrev_table>(cur, end, splitrev) ||
+      parse_delta_number(cur, end, upstreams_size))
+    return error("apply: invalid delta");
+  if (upstreams_size != end - cur)
+    return error("apply: invalid delta");
+
+  split2monodb db;
+  if (db.opendb(argv[0]) || db.parse_upstreams())
+    return usage("could not open <dbdir>", cmd);
+
+  // Only replicate a database into a copy of itself.
+  std::string header = "name: " + db.name + "\n";
+  if (size_t(upstreams_size) < header.size() ||
+      memcmp(cur, header.data(), header.size()))
+    return error("apply: delta is not for '" + db.name + "'");
+
+  // Check everything before writing anything.
+  if (check_table_delta<commits_table>(db.commits, db.commits_size_on_open(),
+                                       commits) ||
+      check_table_delta<svnbase_table>(db.svnbase, db.svnbase_size_on_open(),
+                                       svnbase) ||
+      check_table_delta<splitrev_table>(db.splitrev,
+                                        db.splitrev_size_on_open(), splitrev))
+    return 1;
+
+  if (apply_table_delta<commits_table>(db.commits, commits) ||
+      apply_table_delta<svnbase_table>(db.svnbase, svnbase) ||
+      apply_table_delta<splitrev_table>(db.splitrev, splitrev))
+    return 1;
+  if (db.close_files())
+    return error("error closing tables after writing");
+
+  // Copy upstreams last, so it never claims more than the tables have.
+  int upstreamsfd = openat(db.dbfd, "upstreams", O_WRONLY | O_TRUNC);
+  if (upstreamsfd == -1)
+    return error("could not reopen upstreams to write replicated file");
+  if (write(upstreamsfd, cur, upstreams_size) != upstreams_size ||
+      close(upstreamsfd))
+    return error("could not write upstreams");
+  return 0;
+}
+
 static int main_dump(const char *cmd, int argc, const char *argv[]) {
   if (argc != 1)
     return usage("dump: extra positional arguments", cmd);
@@ -397,30 +665,84 @@ static int main_dump(const char *cmd, int argc, const char *argv[]) {
   has_error |= dump_table<commits_table>(db.commits);
   printf("\n");
   has_error |= dump_table<svnbase_table>(db.svnbase);
+  if (db.splitrev_size_on_open()) {
+    printf("\n");
+    has_error |= dump_table<splitrev_table>(db.splitrev);
+  }
   return has_error ? 1 : 0;
 }
 
+static int main_fsck(const char *cmd, int argc, const char *argv[]) {
+  split2mono_fsck fsck;
+  fsck.num_jobs = std::max(1u, std::thread::hardware_concurrency());
+  if (argc >= 1 && !strcmp(argv[0], "-j")) {
+    long num_jobs;
+    if (argc < 2 || parse_offset(argv[1], num_jobs) || !num_jobs ||
+        num_jobs > 1024)
+      return usage("fsck: invalid <jobs>", cmd);
+    fsck.num_jobs = num_jobs;
+    argc -= 2, argv += 2;
+  }
+  if (argc != 1)
+    return usage("fsck: wrong number of positional arguments", cmd);
+  fsck.dbdir = argv[0];
+  return fsck.run();
+}
+
 static int main_interleave_commits(const char *cmd, int argc,
                                    const char *argv[]) {
+  bool use_cache = false;
+  bool is_planning = false;
+  const char *checkpoint = nullptr;
+  for (; argc && !strncmp(argv[0], "--", 2); --argc, ++argv) {
+    if (!strcmp(argv[0], "--cache"))
+      use_cache = true;
+    else if (!strcmp(argv[0], "--plan"))
+      is_planning = true;
+    else if (!strcmp(argv[0], "--checkpoint")) {
+      if (argc < 2)
+        return usage("interleave-commits: missing <file> for --checkpoint",
+                     cmd);
+      checkpoint = *++argv;
+      --argc;
+    } else
+      return usage("interleave-commits: unknown option '" +
+                       std::string(argv[0]) + "'",
+                   cmd);
+  }
+
   if (argc < 1)
     return usage("interleave-commits: missing <dbdir>", cmd);
   split2monodb db;
   if (db.opendb(argv[0]))
     return usage("could not open <dbdir>", cmd);
+
+  // Every write to the database and the cache snapshot checks this.  A new
+  // database can't be opened read-only, so set it afterwards.  An object
+  // store that doesn't persist objects leaves the database alone, too.
+  db.is_read_only = is_planning || !object_store::get().persists_objects();
+  const char *dbdir = argv[0];
   --argc, ++argv;
 
-  // Copied from svn2git.cpp.
   if (argc < 1)
     return usage("interleave-commits: missing <svn2git-db>", cmd);
-  mmapped_file svn2git;
-  unsigned char svn2git_magic[] = {'s', 2, 'g', 0xd, 0xb, 'm', 0xa, 'p'};
-  if (svn2git.init(argv[0]) ||
-      svn2git.num_bytes < (long)sizeof(svn2git_magic) ||
-      memcmp(svn2git_magic, svn2git.bytes, sizeof(svn2git_magic)))
+  svn2git_reader svn2git;
+  if (svn2git.init(argv[0]) || svn2git.check())
     return usage("invalid <svn2git-db>", cmd);
+  const char *svn2git_path = argv[0];
   --argc, ++argv;
 
   commit_interleaver interleaver(db, svn2git);
+  interleaver.cache.svn2git_index.init(svn2git_path);
+  interleaver.is_planning = is_planning;
+  if (checkpoint && !is_planning) {
+    // A checkpoint is only good for the same heads, dirs, and goals.
+    interleaver.checkpoint_path = checkpoint;
+    for (int i = 0; i != argc; ++i)
+      interleaver.checkpoint_key += (i ? " " : "") + std::string(argv[i]);
+  }
+  if (use_cache)
+    interleaver.cache.load_snapshot((std::string(dbdir) + "/cache").c_str());
 
   if (argc < 1)
     return usage("interleave-commits: missing <head>", cmd);
@@ -503,12 +825,12 @@ static int main_interleave_commits(const char *cmd, int argc,
     }
   }
 
-  if (was_repeated_head_specified && !interleaver.dirs.repeated_dirs.bits.any())
+  if (was_repeated_head_specified && !interleaver.dirs.repeated_dirs.any())
     return usage("head specified for repeated dirs, but no dirs", cmd);
-  if (!was_repeated_head_specified && interleaver.dirs.repeated_dirs.bits.any())
+  if (!was_repeated_head_specified && interleaver.dirs.repeated_dirs.any())
     return usage("repeated dirs specified, but missing head", cmd);
   if (interleaver.repeated_head)
-    interleaver.dirs.active_dirs.bits |= interleaver.dirs.repeated_dirs.bits;
+    interleaver.dirs.active_dirs |= interleaver.dirs.repeated_dirs;
 
   // Create sources now that dirs are stable.
   interleaver.initialize_sources();
@@ -587,10 +909,13 @@ int main(int argc, const char *argv[]) {
   SUB_MAIN(insert);
   SUB_MAIN(upstream);
   SUB_MAIN(dump);
+  SUB_MAIN(apply);
+  SUB_MAIN(fsck);
   SUB_MAIN_SVNBASE(lookup);
   SUB_MAIN_SVNBASE(insert);
   SUB_MAIN_IMPL("interleave-commits", interleave_commits);
   SUB_MAIN_IMPL("check-upstream", check_upstream);
+  SUB_MAIN_IMPL("export-since", export_since);
 #undef SUB_MAIN_IMPL
 #undef SUB_MAIN
 #undef SUB_MAIN_SVNBASE
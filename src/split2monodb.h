@@ -15,6 +15,7 @@ struct upstream_entry {
   long num_upstreams = 0;
   long commits_size = 0;
   long svnbase_size = 0;
+  long splitrev_size = 0;
 };
 struct split2monodb {
   bool is_verbose = false;
@@ -22,7 +23,7 @@ struct split2monodb {
 
   bool has_read_upstreams = false;
 
-  table_streams commits, svnbase;
+  table_streams commits, svnbase, splitrev;
   int upstreamsfd = -1;
   int dbfd = -1;
   std::string name;
@@ -30,7 +31,8 @@ struct split2monodb {
   // FIXME: std::map is way overkill, we just have a few of these.
   std::map<std::string, upstream_entry> upstreams;
 
-  split2monodb() : commits("commits"), svnbase("svnbase") {}
+  split2monodb()
+      : commits("commits"), svnbase("svnbase"), splitrev("splitrev") {}
 
   int opendb(const char *dbdir);
   int parse_upstreams();
@@ -44,8 +46,21 @@ struct split2monodb {
             svnbase_table::table_offset) /
            svnbase_table::size;
   }
+  long splitrev_size_on_open() const {
+    if (splitrev.data.get_num_bytes_on_open() < splitrev_table::table_offset)
+      return 0;
+    return (splitrev.data.get_num_bytes_on_open() -
+            splitrev_table::table_offset) /
+           splitrev_table::size;
+  }
 
-  int close_files() { return commits.close_files() | svnbase.close_files(); }
+  int close_files() {
+    return commits.close_files() | svnbase.close_files() |
+           splitrev.close_files();
+  }
+  int flush() {
+    return commits.flush() | svnbase.flush() | splitrev.flush();
+  }
   ~split2monodb();
 
   void log(std::string x) {
@@ -117,6 +132,20 @@ int split2monodb::parse_upstreams() {
     assert(num >= 0);
     return 0;
   };
+  auto parse_optional_number = [&c, &parse_number](const char *label,
+                                                   long &num) {
+    // Optional fields come after the required ones, each preceded by a space.
+    const char *field = c.cur;
+    while (field != c.end && *field == ' ')
+      ++field;
+    if (field == c.cur)
+      return 0;
+    size_t len = strlen(label);
+    if (size_t(c.end - field) < len || strncmp(field, label, len))
+      return 0;
+    c.cur = field + len;
+    return parse_number(num);
+  };
   auto parse_space = [&c](bool needs_any, bool newlines) {
     // Pull out a separate flag for needing newlines, for simplicity.
     bool needs_newline = newlines && needs_any;
@@ -166,6 +195,7 @@ int split2monodb::parse_upstreams() {
         parse_string("commits-size=") || parse_number(ue.commits_size) ||
         parse_space(/*needs_any=*/true, /*newlines=*/false) ||
         parse_string("svnbase-size=") || parse_number(ue.svnbase_size) ||
+        parse_optional_number("splitrev-size=", ue.splitrev_size) ||
         parse_space(/*needs_any=*/true, /*newlines=*/true))
       return 1;
     if (ue.name == name)
@@ -181,8 +211,10 @@ int split2monodb::parse_upstreams() {
 int split2monodb::opendb(const char *dbdir) {
   const unsigned char commits_magic[] = {'s', 2, 'm', 0xc, 0x0, 'm', 't', 's'};
   const unsigned char svnbase_magic[] = {'s', 2, 'm', 0xb, 0xa, 0x5, 0xe, 'r'};
+  const unsigned char splitrev_magic[] = {'s', 2, 'm', 0x5, 0x9, 0x1, 0x7, 'r'};
   assert(sizeof(commits_magic) == magic_size);
   assert(sizeof(svnbase_magic) == magic_size);
+  assert(sizeof(splitrev_magic) == magic_size);
 
   if (const char *verbose = getenv("VERBOSE"))
     if (strcmp(verbose, "0"))
@@ -196,7 +228,10 @@ int split2monodb::opendb(const char *dbdir) {
   if (db.commits.init(dbfd, db.is_read_only, commits_magic,
                       commits_table::table_offset, commits_table::size) ||
       db.svnbase.init(dbfd, db.is_read_only, svnbase_magic,
-                      svnbase_table::table_offset, svnbase_table::size))
+                      svnbase_table::table_offset, svnbase_table::size) ||
+      db.splitrev.init(dbfd, db.is_read_only, splitrev_magic,
+                       splitrev_table::table_offset, splitrev_table::size,
+                       /*is_optional=*/true))
     return 1;
 
   int upstreamsfd = openat(dbfd, "upstreams", flags);
@@ -209,11 +244,40 @@ int split2monodb::opendb(const char *dbdir) {
   return 0;
 }
 
+/// Insert the serialized records in [\a b, \a be) into \a main, in order.
+/// If \a keep_existing, records whose key is already in \a main with the
+/// same value are skipped instead of being an error.
 template <class T>
-static int merge_tables(table_streams &main, size_t recorded_size,
-                        table_streams &upstream, size_t actual_size) {
+static int insert_records(table_streams &main, const unsigned char *b,
+                          const unsigned char *be, bool keep_existing) {
   typedef T table_type;
   typedef typename table_type::value_type value_type;
+  for (; b != be; b += table_type::size) {
+    auto q = data_query<T>::from_binary(b);
+    auto value = value_type::make_from_binary(b + 20);
+    if (keep_existing) {
+      if (q.insert_data_or_check_equal(main, value)) {
+        textual_sha1 key;
+        key.from_binary(b);
+        return error("error merging data for " + key.to_string());
+      }
+      continue;
+    }
+    if (q.insert_data(main, value))
+      return error("error inserting new data");
+  }
+  return 0;
+}
+
+/// Merge new entries from \a upstream into \a main.  If \a keep_existing,
+/// entries already in \a main are skipped if they agree, instead of being an
+/// error; this is for caches like splitrev that every database fills in
+/// independently.
+template <class T>
+static int merge_tables(table_streams &main, size_t recorded_size,
+                        table_streams &upstream, size_t actual_size,
+                        bool keep_existing = false) {
+  typedef T table_type;
 
   // Read all missing commits and merge them.
   assert(actual_size >= 0);
@@ -231,10 +295,6 @@ static int merge_tables(table_streams &main, size_t recorded_size,
       num_bytes)
     return error("could not read new data from upstream");
 
-  for (const unsigned char *b = bytes.data(), *be = bytes.data() + bytes.size();
-       b != be; b += table_type::size)
-    if (data_query<T>::from_binary(b).insert_data(
-            main, value_type::make_from_binary(b + 20)))
-      return error("error inserting new data from upstream");
-  return 0;
+  return insert_records<T>(main, bytes.data(), bytes.data() + bytes.size(),
+                           keep_existing);
 }
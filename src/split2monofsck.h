@@ -0,0 +1,319 @@
+// split2monofsck.h
+#pragma once
+
+#include "data_query.h"
+#include "error.h"
+#include "index_query.h"
+#include "split2monodb.h"
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace {
+/// Results from one fsck worker.  Workers don't share anything, so these are
+/// merged (in shard order, for stable output) after they're all joined.
+struct fsck_shard {
+  std::vector<std::string> record_problems;
+  std::vector<std::string> index_problems;
+
+  /// Data and subtrie entries reached while walking this shard of the index.
+  std::vector<int> data_nums;
+  std::vector<int> subtrie_nums;
+
+  void report_record(const std::string &table, const std::string &msg) {
+    record_problems.push_back(table + ": " + msg);
+  }
+  void report_index(const std::string &table, const std::string &msg) {
+    index_problems.push_back(table + ": " + msg);
+  }
+};
+
+/// Check a split2mono database for corruption.  Each table's records are
+/// sharded across threads and looked up again through the index, and the
+/// index is walked (sharded by root entry) to find entries that don't point
+/// at the right record.  Each thread opens its own read-only copy of the
+/// database, since file_stream keeps a position.
+struct split2mono_fsck {
+  const char *dbdir = nullptr;
+  int num_jobs = 1;
+  std::vector<std::string> problems;
+
+  int run();
+
+private:
+  typedef table_streams split2monodb::*table_member;
+
+  template <class T> int check_table(table_member table, long num_records);
+  template <class T>
+  static void check_records(table_streams &ts, long first, long last,
+                            fsck_shard &shard);
+  template <class T>
+  static void walk_index(table_streams &ts, long num_records,
+                         long num_subtries, int subtrie, int first, int last,
+                         std::vector<unsigned> &path, fsck_shard &shard);
+  void check_upstreams(split2monodb &db);
+
+  static std::string pad(long num, int width) {
+    std::string s = std::to_string(num);
+    return s.size() < size_t(width) ? std::string(width - s.size(), '0') + s
+                                    : s;
+  }
+};
+} // end namespace
+
+template <class T>
+void split2mono_fsck::check_records(table_streams &ts, long first, long last,
+                                    fsck_shard &shard) {
+  // Only name the record once there's a problem to report.
+  auto report = [&](long i, const std::string &problem) {
+    shard.report_record(ts.name, "record " + pad(i, 8) + problem);
+  };
+  for (long i = first; i != last; ++i) {
+    unsigned char key[20];
+    if (ts.data.seek_and_read(T::table_offset + i * T::size, key, 20) != 20) {
+      report(i, " could not be read");
+      continue;
+    }
+    auto q = data_query<T>::from_binary(key);
+    if (q.lookup_data_impl(ts)) {
+      report(i, " could not be looked up");
+      continue;
+    }
+    if (!q.found_data) {
+      report(i, " is unreachable from the index");
+      continue;
+    }
+    if (q.out.entry.num() != i)
+      report(i, " duplicates the key of record " + pad(q.out.entry.num(), 8));
+  }
+}
+
+template <class T>
+void split2mono_fsck::walk_index(table_streams &ts, long num_records,
+                                 long num_subtries, int subtrie, int first,
+                                 int last, std::vector<unsigned> &path,
+                                 fsck_shard &shard) {
+  bool is_root = subtrie == -1;
+  long bitmap_offset = is_root ? root_index_bitmap_offset
+                               : subtrie_indexes_offset +
+                                     subtrie_index_size * subtrie +
+                                     subtrie_index_bitmap_offset;
+  long entries_offset = is_root ? root_index_entries_offset
+                                : subtrie_indexes_offset +
+                                      subtrie_index_size * subtrie +
+                                      subtrie_index_entries_offset;
+  // Only name the subtrie and entry once there's a problem to report.
+  auto where = [&]() {
+    return is_root ? std::string("index root")
+                   : "index subtrie " + pad(subtrie, 4);
+  };
+  auto report = [&](int i, const std::string &problem) {
+    shard.report_index(ts.name,
+                       where() + " entry " + std::to_string(i) + problem);
+  };
+
+  // Unwritten parts of the index read as zeros.
+  unsigned char bitmap[(1u << num_root_bits) / 8] = {0};
+  ts.index.seek_and_read(bitmap_offset + first / 8, bitmap + first / 8,
+                         (last - first) / 8);
+
+  bool any = false;
+  for (int i = first; i != last; ++i) {
+    if (!bitmap_ref::get_bit(bitmap[i / 8], i % 8))
+      continue;
+    any = true;
+
+    index_entry entry;
+    if (ts.index.seek_and_read(entries_offset + i * index_entry::size,
+                               entry.bytes,
+                               index_entry::size) != index_entry::size) {
+      report(i, " is set in the bitmap but missing");
+      continue;
+    }
+
+    path.push_back(i);
+    if (!entry.is_data()) {
+      if (entry.num() >= num_subtries)
+        report(i, " points past the last subtrie");
+      else if (num_root_bits + path.size() * num_subtrie_bits > 160)
+        report(i, " nests too deeply");
+      else {
+        shard.subtrie_nums.push_back(entry.num());
+        walk_index<T>(ts, num_records, num_subtries, entry.num(), 0,
+                      1u << num_subtrie_bits, path, shard);
+      }
+      path.pop_back();
+      continue;
+    }
+
+    // Check that the record's key has the bits that lead here.
+    if (entry.num() >= num_records) {
+      report(i, " points past the last record");
+      path.pop_back();
+      continue;
+    }
+    shard.data_nums.push_back(entry.num());
+    binary_sha1 key;
+    if (ts.data.seek_and_read(T::table_offset + entry.num() * T::size,
+                              key.bytes, 20) != 20) {
+      report(i, " points at an unreadable record");
+      path.pop_back();
+      continue;
+    }
+    for (size_t level = 0; level != path.size(); ++level) {
+      int start_bit =
+          level ? num_root_bits + (level - 1) * num_subtrie_bits : 0;
+      int num_bits = level ? num_subtrie_bits : num_root_bits;
+      if (key.get_bits(start_bit, num_bits) == path[level])
+        continue;
+      report(i, " points at record " + pad(entry.num(), 8) +
+                    ", whose key belongs elsewhere");
+      break;
+    }
+    path.pop_back();
+  }
+
+  if (!any && !is_root)
+    shard.report_index(ts.name, where() + " has an empty bitmap");
+}
+
+template <class T>
+int split2mono_fsck::check_table(table_member table, long num_records) {
+  // Count the subtries the same way insertion does.
+  long num_subtries = 0;
+  {
+    split2monodb db;
+    db.is_read_only = true;
+    if (db.opendb(dbdir))
+      return error("could not open <dbdir>");
+    long end_offset = (db.*table).index.get_num_bytes_on_open();
+    if (end_offset > subtrie_indexes_offset)
+      num_subtries =
+          1 + (end_offset - subtrie_indexes_offset - 1) / subtrie_index_size;
+  }
+
+  std::vector<fsck_shard> shards(num_jobs);
+  std::vector<std::thread> threads;
+  std::vector<int> open_failed(num_jobs, 0);
+  const int num_root_entries = 1u << num_root_bits;
+  for (int j = 0; j != num_jobs; ++j)
+    threads.emplace_back([&, j]() {
+      split2monodb db;
+      db.is_read_only = true;
+      if (db.opendb(dbdir)) {
+        open_failed[j] = 1;
+        return;
+      }
+      close(db.upstreamsfd);
+      db.upstreamsfd = -1;
+
+      table_streams &ts = db.*table;
+      auto &shard = shards[j];
+      check_records<T>(ts, num_records * j / num_jobs,
+                       num_records * (j + 1) / num_jobs, shard);
+
+      // Keep root shards byte-aligned for reading the bitmap.
+      int first = num_root_entries / 8 * j / num_jobs * 8;
+      int last = num_root_entries / 8 * (j + 1) / num_jobs * 8;
+      std::vector<unsigned> path;
+      walk_index<T>(ts, num_records, num_subtries, -1, first, last, path,
+                    shard);
+    });
+  for (auto &thread : threads)
+    thread.join();
+  for (int failed : open_failed)
+    if (failed)
+      return error("could not open <dbdir>");
+
+  // Merge the shards and look for entries reached more than once.
+  std::vector<int> data_nums, subtrie_nums;
+  for (auto &shard : shards)
+    problems.insert(problems.end(), shard.record_problems.begin(),
+                    shard.record_problems.end());
+  for (auto &shard : shards) {
+    problems.insert(problems.end(), shard.index_problems.begin(),
+                    shard.index_problems.end());
+    data_nums.insert(data_nums.end(), shard.data_nums.begin(),
+                     shard.data_nums.end());
+    subtrie_nums.insert(subtrie_nums.end(), shard.subtrie_nums.begin(),
+                        shard.subtrie_nums.end());
+  }
+  std::string name = T::table_name;
+  std::sort(data_nums.begin(), data_nums.end());
+  for (size_t i = 1; i < data_nums.size(); ++i)
+    if (data_nums[i] == data_nums[i - 1] &&
+        (i == 1 || data_nums[i] != data_nums[i - 2]))
+      problems.push_back(name + ": record " + pad(data_nums[i], 8) +
+                         " has more than one index entry");
+
+  std::sort(subtrie_nums.begin(), subtrie_nums.end());
+  long next = 0;
+  for (size_t i = 0; i != subtrie_nums.size(); ++i) {
+    if (i && subtrie_nums[i] == subtrie_nums[i - 1]) {
+      if (i == 1 || subtrie_nums[i] != subtrie_nums[i - 2])
+        problems.push_back(name + ": index subtrie " +
+                           pad(subtrie_nums[i], 4) +
+                           " has more than one parent");
+      continue;
+    }
+    for (; next < subtrie_nums[i]; ++next)
+      problems.push_back(name + ": index subtrie " + pad(next, 4) +
+                         " is orphaned");
+    next = subtrie_nums[i] + 1;
+  }
+  for (; next < num_subtries; ++next)
+    problems.push_back(name + ": index subtrie " + pad(next, 4) +
+                       " is orphaned");
+  return 0;
+}
+
+void split2mono_fsck::check_upstreams(split2monodb &db) {
+  // Merging an upstream appends all of its commits and svnbase revs, and all
+  // of its upstreams; none of those sizes can exceed what we have.  Split
+  // revs are skipped when they're already known, so they can't be checked.
+  long num_upstreams = db.upstreams.size();
+  long commits_size = db.commits_size_on_open();
+  long svnbase_size = db.svnbase_size_on_open();
+  for (auto &ue : db.upstreams) {
+    std::string name = "upstreams: '" + ue.second.name + "'";
+    if (ue.second.num_upstreams > num_upstreams)
+      problems.push_back(name + " has more upstreams (" +
+                         std::to_string(ue.second.num_upstreams) +
+                         ") than are recorded (" +
+                         std::to_string(num_upstreams) + ")");
+    if (ue.second.commits_size > commits_size)
+      problems.push_back(name + " has more commits (" +
+                         std::to_string(ue.second.commits_size) +
+                         ") than the commits table (" +
+                         std::to_string(commits_size) + ")");
+    if (ue.second.svnbase_size > svnbase_size)
+      problems.push_back(name + " has more svnbase revs (" +
+                         std::to_string(ue.second.svnbase_size) +
+                         ") than the svnbase table (" +
+                         std::to_string(svnbase_size) + ")");
+  }
+}
+
+int split2mono_fsck::run() {
+  split2monodb db;
+  db.is_read_only = true;
+  if (db.opendb(dbdir) || db.parse_upstreams())
+    return error("could not open <dbdir>");
+
+  if (check_table<commits_table>(&split2monodb::commits,
+                                 db.commits_size_on_open()) ||
+      check_table<svnbase_table>(&split2monodb::svnbase,
+                                 db.svnbase_size_on_open()) ||
+      check_table<splitrev_table>(&split2monodb::splitrev,
+                                  db.splitrev_size_on_open()))
+    return 1;
+  check_upstreams(db);
+
+  for (auto &problem : problems)
+    error(problem);
+  if (!problems.empty())
+    return error("fsck: found " + std::to_string(problems.size()) +
+                 " problem(s) in '" + db.name + "'");
+  return 0;
+}
@@ -21,8 +21,19 @@
 // mapped.
 //
 // Or, use the svn2git 'lookup' command.
+//
+// 'svn2git convert' switches <db> to a sparse format that leaves out the
+// holes (see svn2gitdb.h), which all the commands here (and split2mono) read
+// transparently.  Note that xxd doesn't work on that format.
+//
+// 'svn2git insert' also keeps a reverse index in <db>.rindex up-to-date, which
+// 'svn2git reverse-lookup' uses to map a sha1 back to its rev.  See
+// svn2gitdb.h for its format.
 #include "mmapped_file.h"
+#include "read_all.h"
 #include "sha1convert.h"
+#include "svn2gitdb.h"
+#include <algorithm>
 #include <cerrno>
 #include <cstdio>
 #include <cstdlib>
@@ -30,10 +41,9 @@
 #include <fcntl.h>
 #include <limits>
 #include <string>
+#include <vector>
 
 constexpr const unsigned version = 0;
-constexpr const unsigned char magic[] = {'s', 2, 'g', 0xd, 0xb, 'm', 0xa, 'p'};
-static_assert(sizeof(magic) == 8);
 
 static int show_progress(int n, int total) {
   return fprintf(stderr, "   %9d / %d commits mapped\n", n, total) < 0;
@@ -50,15 +60,20 @@ static int usage(const char *msg, const char *cmd) {
           "usage: %s insert <db> [<count>]\n"
           "       %s insert <db> <rev> <sha1>\n"
           "       %s lookup <db> <rev>\n"
+          "       %s reverse-lookup <db> [<sha1>]\n"
+          "       %s reindex <db>\n"
+          "       %s convert <db> (dense|sparse)\n"
           "       %s create <db>\n"
           "       %s dump   <db>\n",
-          cmd, cmd, cmd, cmd, cmd);
+          cmd, cmd, cmd, cmd, cmd, cmd, cmd, cmd);
   return 1;
 }
 
 namespace {
 struct svn2gitdb {
   FILE *out = nullptr;
+  svn2git_stamp stamp_on_open;
+  bool is_sparse = false;
   ~svn2gitdb() {
     if (out)
       fclose(out);
@@ -68,7 +83,7 @@ struct svn2gitdb {
 
 static void build_magic_and_version(unsigned char *bytes) {
   // Magic.
-  memcpy(bytes, magic, 8);
+  memcpy(bytes, svn2git_magic, 8);
 
   // Version.
   unsigned long long long_version = version;
@@ -90,6 +105,18 @@ static int check_db(const unsigned char *bytes, size_t num_bytes_total) {
   return 0;
 }
 
+static int check_db(const svn2git_reader &db) {
+  if (db.is_sparse)
+    return db.check() ? error("<db> has a corrupt sparse layout") : 0;
+  return check_db(db.bytes, db.file.num_bytes);
+}
+
+static int read_db(svn2git_reader &db, const char *dbfile) {
+  if (db.init(dbfile))
+    return error("could not read <db>");
+  return check_db(db);
+}
+
 static int opendb(const char *cmd, svn2gitdb &db, const char *dbfile,
                   bool only_create) {
   int dbfd = open(dbfile, O_RDWR | O_CREAT | (only_create ? O_EXCL : 0));
@@ -106,11 +133,19 @@ static int opendb(const char *cmd, svn2gitdb &db, const char *dbfile,
   if (fseek(db.out, 0, SEEK_END))
     return error("could not compute size of <db>");
   long num_bytes = ftell(db.out);
+  if (db.stamp_on_open.init(dbfile))
+    return error("could not stat <db>");
 
   unsigned char bytes[20] = {0};
   if (num_bytes) {
     if (fseek(db.out, 0, SEEK_SET) || fread(bytes, 1, 20, db.out) != 20)
       return error("could not read svn2git magic and version");
+
+    // Sparse dbs are rewritten rather than updated in place.
+    if (!memcmp(bytes, svn2git_sparse_magic, 8)) {
+      db.is_sparse = true;
+      return 0;
+    }
     return check_db(bytes, num_bytes);
   }
 
@@ -120,6 +155,108 @@ static int opendb(const char *cmd, svn2gitdb &db, const char *dbfile,
   return 0;
 }
 
+namespace {
+struct bulk_entry {
+  int rev = 0;
+  binary_sha1 sha1;
+};
+} // end namespace
+
+/// Write a new <db> with \a entries, which must be sorted by rev and unique.
+/// Entries with all-0 sha1s are left out.
+static int write_db(const char *dbfile, const std::vector<bulk_entry> &entries,
+                    bool is_sparse) {
+  std::vector<unsigned char> bytes(20);
+  if (!is_sparse) {
+    build_magic_and_version(bytes.data());
+    if (!entries.empty())
+      bytes.resize(20 * (long(entries.back().rev) + 1));
+    for (const bulk_entry &entry : entries)
+      memcpy(bytes.data() + 20 * long(entry.rev), entry.sha1.bytes, 20);
+  } else {
+    long num_blocks = entries.empty() ? 0
+                                      : entries.back().rev /
+                                                svn2git_reader::revs_per_block +
+                                            1;
+    std::vector<unsigned long long> bitmaps(num_blocks);
+    std::vector<unsigned char> sha1s;
+    for (const bulk_entry &entry : entries) {
+      if (entry.sha1.is_zeros())
+        continue;
+      bitmaps[entry.rev / svn2git_reader::revs_per_block] |=
+          1ull << (entry.rev % svn2git_reader::revs_per_block);
+      sha1s.insert(sha1s.end(), entry.sha1.bytes, entry.sha1.bytes + 20);
+    }
+
+    auto append = [&bytes](unsigned long long value, int size) {
+      for (int i = size - 1; i >= 0; --i)
+        bytes.push_back(value >> (8 * i));
+    };
+    bytes.clear();
+    bytes.insert(bytes.end(), svn2git_sparse_magic, svn2git_sparse_magic + 8);
+    append(version, 4);
+    append(num_blocks, 4);
+    append(sha1s.size() / 20, 4);
+    long num_before = 0;
+    for (unsigned long long bitmap : bitmaps) {
+      append(bitmap, 8);
+      append(num_before, 4);
+      num_before += __builtin_popcountll(bitmap);
+    }
+    bytes.insert(bytes.end(), sha1s.begin(), sha1s.end());
+  }
+
+  // Write to a temporary and rename, so that readers never see half of it.
+  std::string tmp = std::string(dbfile) + ".tmp";
+  FILE *out = fopen(tmp.c_str(), "wb");
+  if (!out)
+    return error("could not open temporary for <db>");
+  bool failed = fwrite(bytes.data(), 1, bytes.size(), out) != bytes.size();
+  failed |= bool(fclose(out));
+  if (failed || chmod(tmp.c_str(), 0644) || rename(tmp.c_str(), dbfile)) {
+    unlink(tmp.c_str());
+    return error("could not write <db>");
+  }
+  return 0;
+}
+
+/// Read all the entries in \a db.
+static void read_entries(const svn2git_reader &db,
+                         std::vector<bulk_entry> &entries) {
+  db.for_each([&entries](int rev, const unsigned char *sha1) {
+    bulk_entry entry;
+    entry.rev = rev;
+    entry.sha1.from_binary(sha1);
+    entries.push_back(entry);
+  });
+}
+
+/// Insert \a added (sorted by rev and unique) into a sparse db by rewriting
+/// it.
+static int insert_sparse(const char *dbfile,
+                         const std::vector<bulk_entry> &added) {
+  svn2git_reader db;
+  if (read_db(db, dbfile))
+    return 1;
+  std::vector<bulk_entry> existing, entries;
+  read_entries(db, existing);
+
+  auto less = [](const bulk_entry &lhs, const bulk_entry &rhs) {
+    return lhs.rev < rhs.rev;
+  };
+  entries.reserve(existing.size() + added.size());
+  auto next = added.begin();
+  for (const bulk_entry &entry : existing) {
+    for (; next != added.end() && less(*next, entry); ++next)
+      entries.push_back(*next);
+    if (next != added.end() && next->rev == entry.rev)
+      continue;
+    entries.push_back(entry);
+  }
+  entries.insert(entries.end(), next, added.end());
+  return write_db(dbfile, entries, /*is_sparse=*/true);
+}
+
 static int insert_one_impl(svn2gitdb &db, int rev, const char *sha1) {
   if (rev < 1)
     return error("invalid rev < 1");
@@ -153,12 +290,68 @@ static int cmdline_rev(const char *cmd, int &rev, const char *str) {
   return 0;
 }
 
+static int update_rindex(svn2gitdb &db, const char *dbfile,
+                         const std::vector<int> &revs) {
+  if (fflush(db.out))
+    return error("could not flush <db>");
+  if (!svn2git_rindex::update(dbfile, db.stamp_on_open, revs))
+    return 0;
+
+  // Don't leave behind an index that looks fresh but is missing revs.
+  unlink(svn2git_rindex::get_path(dbfile).c_str());
+  return error("could not update reverse index; try 'svn2git reindex'");
+}
+
 static int insert_one(const char *cmd, const char *dbfile, const char *revstr,
                       const char *sha1) {
   svn2gitdb db;
   int rev = 0;
-  return opendb(cmd, db, dbfile, /*only_create=*/false) ||
-         cmdline_rev(cmd, rev, revstr) || insert_one_impl(db, rev, sha1);
+  if (opendb(cmd, db, dbfile, /*only_create=*/false) ||
+      cmdline_rev(cmd, rev, revstr))
+    return 1;
+  if (db.is_sparse) {
+    std::vector<bulk_entry> added(1);
+    added.back().rev = rev;
+    added.back().sha1.from_textual(sha1);
+    if (insert_sparse(dbfile, added))
+      return 1;
+  } else if (int EC = insert_one_impl(db, rev, sha1))
+    return EC;
+  return update_rindex(db, dbfile, std::vector<int>(1, rev));
+}
+
+/// Parse lines of the form "<rev> SP ['-']<sha1> LF" from \a current, which
+/// must be null-terminated.
+static int parse_bulk_entries(const char *current,
+                              std::vector<bulk_entry> &entries) {
+  auto skip_space = [&current]() {
+    while (*current == ' ' || *current == '\t' || *current == '\n' ||
+           *current == '\r')
+      ++current;
+  };
+  for (skip_space(); *current; skip_space()) {
+    bulk_entry entry;
+    bool is_negative = *current == '-';
+    current += is_negative;
+    if (*current < '0' || *current > '9')
+      return error("expected <rev> in input");
+    long rev = 0;
+    for (; *current >= '0' && *current <= '9'; ++current)
+      if ((rev = rev * 10 + (*current - '0')) > std::numeric_limits<int>::max())
+        return error("<rev> is bigger than INT_MAX");
+    if (is_negative || rev < 1)
+      return error("invalid rev < 1");
+    entry.rev = rev;
+
+    if (*current != ' ' && *current != '\t')
+      return error("expected space after <rev>");
+    skip_space();
+    current += *current == '-';
+    if (entry.sha1.from_input(current, &current))
+      return error("invalid <sha1> in input");
+    entries.push_back(entry);
+  }
+  return 0;
 }
 
 static int insert_bulk(const char *cmd, const char *dbfile,
@@ -172,16 +365,78 @@ static int insert_bulk(const char *cmd, const char *dbfile,
   if (opendb(cmd, db, dbfile, /*only_create=*/false))
     return 1;
 
-  char sha1[42] = {0};
-  int rev = 0;
-  int n = 0;
-  while (scanf("%d %41s", &rev, sha1) == 2) {
-    if (int EC = insert_one_impl(db, rev, sha1[0] == '-' ? sha1 + 1 : sha1))
-      return EC;
-    if ((++n % 5000) == 0)
-      if (show_progress(n, total))
-        return error("could not show progress");
+  // Parse everything up front, so that bad input doesn't leave a partial
+  // update behind.
+  std::vector<char> input;
+  if (read_all(0, input))
+    return error("could not read input");
+  input.push_back(0);
+  std::vector<bulk_entry> entries;
+  if (parse_bulk_entries(input.data(), entries))
+    return 1;
+  int n = entries.size();
+  if (!n)
+    return show_progress(n, total) ? error("could not show progress") : 0;
+
+  // Sort by rev.  When a rev shows up more than once, the last one wins.
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const bulk_entry &lhs, const bulk_entry &rhs) {
+                     return lhs.rev < rhs.rev;
+                   });
+  entries.erase(entries.begin(),
+                std::unique(entries.rbegin(), entries.rend(),
+                            [](const bulk_entry &lhs, const bulk_entry &rhs) {
+                              return lhs.rev == rhs.rev;
+                            })
+                    .base());
+
+  std::vector<int> revs;
+  revs.reserve(entries.size());
+  for (const bulk_entry &entry : entries)
+    revs.push_back(entry.rev);
+  if (db.is_sparse) {
+    if (insert_sparse(dbfile, entries) || update_rindex(db, dbfile, revs))
+      return 1;
+    if (show_progress(n, total))
+      return error("could not show progress");
+    return 0;
+  }
+
+  // Extend the file once, then write contiguous runs of revs.
+  int fd = fileno(db.out);
+  struct stat st;
+  if (fflush(db.out) || fstat(fd, &st))
+    return error("could not compute size of <db>");
+  off_t num_bytes = 20 * (off_t(entries.back().rev) + 1);
+  if (num_bytes > st.st_size && ftruncate(fd, num_bytes))
+    return error("could not extend <db>");
+
+  std::vector<unsigned char> run;
+  for (auto first = entries.begin(), last = first; first != entries.end();
+       first = last) {
+    run.clear();
+    do {
+      run.insert(run.end(), last->sha1.bytes, last->sha1.bytes + 20);
+      ++last;
+    } while (last != entries.end() && last->rev == last[-1].rev + 1);
+
+    off_t offset = 20 * off_t(first->rev);
+    for (size_t written = 0; written != run.size();) {
+      ssize_t count = pwrite(fd, run.data() + written, run.size() - written,
+                             offset + written);
+      if (count == -1 && errno == EINTR)
+        continue;
+      if (count <= 0) {
+        error("could not write revs");
+        return 2; // file is now invalid...
+      }
+      written += count;
+    }
   }
+
+  if (update_rindex(db, dbfile, revs))
+    return 1;
+
   if (show_progress(n, total))
     return error("could not show progress");
   return 0;
@@ -194,29 +449,21 @@ static int main_dump(const char *cmd, int argc, const char *argv[]) {
     return usage("dump: too many positional args", cmd);
   const char *dbfile = argv[0];
 
-  mmapped_file db;
-  if (db.init(dbfile))
-    return error("could not read <db>");
-  auto *bytes = reinterpret_cast<const unsigned char *>(db.bytes);
-  if (check_db(bytes, db.num_bytes))
+  svn2git_reader db;
+  if (read_db(db, dbfile))
     return 1;
 
-  textual_sha1 sha1;
-  std::string spaces(8, ' ');
-  long drop_space_at = 10;
-  for (long offset = 20; offset < db.num_bytes; offset += 20) {
-    if ((offset / 20) == drop_space_at) {
-      drop_space_at *= 10;
-      spaces.pop_back();
-    }
-    // skip all zeros.
-    if (sha1.from_binary(bytes + offset))
-      continue;
-    int rev = offset / 20;
-    if (!printf("r%d%s %s\n", rev, spaces.c_str(), sha1.bytes))
-      return 1;
-  }
-  return 0;
+  // Line up the sha1s for up to 9-digit revs.
+  bool failed = false;
+  db.for_each([&failed](int rev, const unsigned char *bytes) {
+    textual_sha1 sha1;
+    sha1.from_binary(bytes);
+    int num_spaces = 9 - std::to_string(rev).size();
+    if (printf("r%d%*s %s\n", rev, std::max(num_spaces, 0), "", sha1.bytes) <
+        0)
+      failed = true;
+  });
+  return failed ? 1 : 0;
 }
 
 static int main_lookup(const char *cmd, int argc, const char *argv[]) {
@@ -229,11 +476,8 @@ static int main_lookup(const char *cmd, int argc, const char *argv[]) {
   const char *dbfile = argv[0];
   const char *revstr = argv[1];
 
-  mmapped_file db;
-  if (db.init(dbfile))
-    return error("could not read <db>");
-  auto *bytes = reinterpret_cast<const unsigned char *>(db.bytes);
-  if (check_db(bytes, db.num_bytes))
+  svn2git_reader db;
+  if (read_db(db, dbfile))
     return 1;
 
   int rev = 0;
@@ -241,9 +485,104 @@ static int main_lookup(const char *cmd, int argc, const char *argv[]) {
     return 1;
 
   textual_sha1 sha1;
-  long offset = 20 * rev;
-  return offset + 20 > db.num_bytes || sha1.from_binary(bytes + offset) ||
-         printf("%s\n", sha1.bytes) != 41;
+  const unsigned char *bytes = db.lookup(rev);
+  return !bytes || sha1.from_binary(bytes) || printf("%s\n", sha1.bytes) != 41;
+}
+
+static int reverse_lookup_one(const svn2git_rindex &rindex,
+                              const svn2git_reader &db,
+                              const binary_sha1 &sha1, int &rev) {
+  if (rindex.entries)
+    return rindex.lookup(sha1, db, rev);
+  bool found = false;
+  db.for_each([&](int r, const unsigned char *bytes) {
+    if (!found && !memcmp(bytes, sha1.bytes, 20)) {
+      found = true;
+      rev = r;
+    }
+  });
+  return found ? 0 : 1;
+}
+
+static int main_reverse_lookup(const char *cmd, int argc, const char *argv[]) {
+  if (argc < 1)
+    return usage("reverse-lookup: missing <db>", cmd);
+  if (argc > 2)
+    return usage("reverse-lookup: too many positional args", cmd);
+  const char *dbfile = argv[0];
+
+  svn2git_reader db;
+  if (read_db(db, dbfile))
+    return 1;
+
+  // Fall back to scanning <db> if the index is missing or stale.
+  svn2git_rindex rindex;
+  rindex.init(dbfile);
+
+  int rev = 0;
+  binary_sha1 sha1;
+  if (argc == 2) {
+    if (strlen(argv[1]) != 40 || sha1.from_textual(argv[1]))
+      return usage("reverse-lookup: invalid <sha1>", cmd);
+    return reverse_lookup_one(rindex, db, sha1, rev) ||
+           printf("r%d\n", rev) < 0;
+  }
+
+  // Batch mode: one sha1 per line on stdin, one rev (or '-') per line out.
+  char text[42] = {0};
+  while (scanf("%41s", text) == 1) {
+    if (strlen(text) != 40 || sha1.from_textual(text))
+      return error("invalid <sha1> in input");
+    int printed = reverse_lookup_one(rindex, db, sha1, rev)
+                      ? printf("-\n")
+                      : printf("r%d\n", rev);
+    if (printed < 0)
+      return error("could not print rev");
+  }
+  return 0;
+}
+
+static int reindex(const char *dbfile) {
+  svn2git_reader db;
+  if (read_db(db, dbfile))
+    return 1;
+
+  std::vector<svn2git_rindex::entry_type> entries;
+  svn2git_rindex::collect(db, entries);
+  std::sort(entries.begin(), entries.end());
+  if (svn2git_rindex::write(dbfile, entries))
+    return error("could not write reverse index");
+  return 0;
+}
+
+static int main_reindex(const char *cmd, int argc, const char *argv[]) {
+  if (argc < 1)
+    return usage("reindex: missing <db>", cmd);
+  if (argc > 1)
+    return usage("reindex: too many positional args", cmd);
+  return reindex(argv[0]);
+}
+
+static int main_convert(const char *cmd, int argc, const char *argv[]) {
+  if (argc < 2)
+    return usage("convert: missing <db> or format", cmd);
+  if (argc > 2)
+    return usage("convert: too many positional args", cmd);
+  const char *dbfile = argv[0];
+  bool is_sparse = !strcmp(argv[1], "sparse");
+  if (!is_sparse && strcmp(argv[1], "dense"))
+    return usage("convert: format must be 'dense' or 'sparse'", cmd);
+
+  std::vector<bulk_entry> entries;
+  {
+    svn2git_reader db;
+    if (read_db(db, dbfile))
+      return 1;
+    if (db.is_sparse == is_sparse)
+      return 0;
+    read_entries(db, entries);
+  }
+  return write_db(dbfile, entries, is_sparse) || reindex(dbfile);
 }
 
 static int main_insert(const char *cmd, int argc, const char *argv[]) {
@@ -278,7 +617,11 @@ int main(int argc, const char *argv[]) {
   SUBMAIN(dump);
   SUBMAIN(lookup);
   SUBMAIN(insert);
+  SUBMAIN(reindex);
+  SUBMAIN(convert);
   SUBMAIN(create);
+  if (!strcmp(argv[1], "reverse-lookup"))
+    return main_reverse_lookup(argv[0], argc - 2, argv + 2);
 #undef SUBMAIN
   return usage("unknown command", argv[0]);
 }
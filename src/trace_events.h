@@ -0,0 +1,164 @@
+// trace_events.h
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unistd.h>
+
+namespace {
+/// Record where the time goes as Chrome trace events, in the JSON array
+/// format that chrome://tracing and Perfetto load.  Set MT_TRACE_FILE to the
+/// file to write.  Each trace_scope becomes a complete ("X") event on its
+/// thread, so nested scopes show up nested, and trace_counter() writes a
+/// counter ("C") event.
+///
+/// Without MT_TRACE_FILE, a scope costs a load and a branch.
+struct trace_events {
+  FILE *file = nullptr;
+  std::mutex mutex;
+  std::chrono::steady_clock::time_point start;
+  std::atomic<int> num_threads{0};
+  bool has_events = false;
+
+  static trace_events &get() {
+    static trace_events events;
+    return events;
+  }
+  static bool is_enabled() { return get().file; }
+
+  /// Microseconds since the trace started.
+  long long now() const {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+  void complete(const char *category, const char *name, long long begin,
+                long long end, const std::string &detail);
+  void counter(const char *name, long long value);
+
+private:
+  trace_events();
+  void close();
+  void write(const std::string &event);
+  int thread_id();
+  static void append_escaped(std::string &out, const char *s);
+};
+
+/// Time a scope as an event named \a name in \a category.  Both have to
+/// outlive the scope.  \a detail, if any, is shown with the event.
+struct trace_scope {
+  const char *category;
+  const char *name;
+  long long begin = -1;
+  std::string detail;
+
+  trace_scope(const char *category, const char *name)
+      : category(category), name(name) {
+    if (trace_events::is_enabled())
+      begin = trace_events::get().now();
+  }
+  ~trace_scope() {
+    if (begin != -1)
+      trace_events::get().complete(category, name, begin,
+                                   trace_events::get().now(), detail);
+  }
+
+  bool is_enabled() const { return begin != -1; }
+};
+
+static void trace_counter(const char *name, long long value) {
+  if (trace_events::is_enabled())
+    trace_events::get().counter(name, value);
+}
+} // end namespace
+
+trace_events::trace_events() {
+  const char *path = getenv("MT_TRACE_FILE");
+  if (!path || !*path)
+    return;
+  file = fopen(path, "w");
+  if (!file) {
+    fprintf(stderr, "error: failed to open MT_TRACE_FILE '%s': %s\n", path,
+            strerror(errno));
+    return;
+  }
+  start = std::chrono::steady_clock::now();
+  fprintf(file, "[\n");
+  atexit([]() { get().close(); });
+}
+
+void trace_events::close() {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!file)
+    return;
+
+  fprintf(file, "\n]\n");
+  fclose(file);
+  file = nullptr;
+}
+
+int trace_events::thread_id() {
+  thread_local int id = num_threads++;
+  return id;
+}
+
+void trace_events::append_escaped(std::string &out, const char *s) {
+  for (; *s; ++s) {
+    unsigned char ch = *s;
+    if (ch == '"' || ch == '\\') {
+      out += '\\';
+      out += ch;
+    } else if (ch < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", ch);
+      out += escaped;
+    } else {
+      out += ch;
+    }
+  }
+}
+
+void trace_events::complete(const char *category, const char *name,
+                            long long begin, long long end,
+                            const std::string &detail) {
+  std::string event = "{\"name\":\"";
+  append_escaped(event, name);
+  event += "\",\"cat\":\"";
+  append_escaped(event, category);
+  event += "\",\"ph\":\"X\",\"ts\":" + std::to_string(begin) +
+           ",\"dur\":" + std::to_string(end - begin) +
+           ",\"pid\":" + std::to_string(getpid()) +
+           ",\"tid\":" + std::to_string(thread_id());
+  if (!detail.empty()) {
+    event += ",\"args\":{\"detail\":\"";
+    append_escaped(event, detail.c_str());
+    event += "\"}";
+  }
+  event += "}";
+  write(event);
+}
+
+void trace_events::counter(const char *name, long long value) {
+  std::string event = "{\"name\":\"";
+  append_escaped(event, name);
+  event += "\",\"ph\":\"C\",\"ts\":" + std::to_string(now()) +
+           ",\"pid\":" + std::to_string(getpid()) +
+           ",\"args\":{\"value\":" + std::to_string(value) + "}}";
+  write(event);
+}
+
+void trace_events::write(const std::string &event) {
+  std::lock_guard<std::mutex> lock(mutex);
+  if (!file)
+    return;
+  fputs(has_events ? ",\n" : "", file);
+  fputs(event.c_str(), file);
+  has_events = true;
+}
@@ -2,8 +2,10 @@
 #pragma once
 
 #include "commit_source.h"
+#include "trace_events.h"
 #include <deque>
 #include <queue>
+#include <thread>
 
 namespace {
 struct translation_queue {
@@ -28,16 +30,43 @@ struct translation_queue {
   int find_dir_commit_parents_to_translate();
   int find_repeat_commits_and_head(commit_source *repeat, sha1_ref &head);
   int interleave_repeat_commits(commit_source *repeat);
+
+  /// Call \a finish on each of \a selected in order, having called \a start
+  /// on the next few first so that their git-log walks run in the
+  /// background.  Each walk buffers up to
+  /// git_record_prefetcher::max_buffered_bytes, so only as many run at once
+  /// as there are cores.  \a finish has to start its own walk if \a start
+  /// wasn't called.
+  template <class StartT, class FinishT>
+  static int prefetch_walks(const std::vector<commit_source *> &selected,
+                            StartT start, FinishT finish);
 };
 }
 
+template <class StartT, class FinishT>
+int translation_queue::prefetch_walks(
+    const std::vector<commit_source *> &selected, StartT start,
+    FinishT finish) {
+  size_t max_walks = std::max(1u, std::thread::hardware_concurrency());
+  size_t num_started = 0;
+  for (size_t i = 0, ie = selected.size(); i != ie; ++i) {
+    // Keep up to max_walks going, counting this one.
+    for (; num_started != ie && num_started < i + max_walks; ++num_started)
+      if (start(*selected[num_started]))
+        return 1;
+    if (finish(*selected[i]))
+      return 1;
+  }
+  return 0;
+}
+
 void translation_queue::set_source_head(commit_source &source, sha1_ref sha1) {
   assert(sha1);
   if (!source.is_repeat) {
     dirs.set_head(source.dir_index, sha1);
     return;
   }
-  dirs.active_dirs.bits |= dirs.repeated_dirs.bits;
+  dirs.active_dirs |= dirs.repeated_dirs;
   source.head = sha1;
 }
 
@@ -63,17 +92,33 @@ int translation_queue::clean_initial_head(sha1_ref &head) {
 }
 
 int translation_queue::find_dir_commits(sha1_ref head) {
-  long long earliest_ct = LLONG_MAX;
-  for (auto &source : sources) {
-    if (source.is_repeat)
-      continue;
+  trace_scope scope("phase", "find_dir_commits");
 
-    long long earliest_ct_for_source = LLONG_MAX;
-    if (source.find_dir_commits(cache, earliest_ct_for_source))
-      return error("failed to find commits for '" +
-                   std::string(dirs.list[source.dir_index].name) + "'");
-    earliest_ct = std::min(earliest_ct, earliest_ct_for_source);
-  }
+  // List sources ahead of the one being parsed.
+  std::vector<commit_source *> selected;
+  for (auto &source : sources)
+    if (!source.is_repeat)
+      selected.push_back(&source);
+  long long earliest_ct = LLONG_MAX;
+  if (prefetch_walks(
+          selected,
+          [&](commit_source &source) {
+            if (source.start_listing_dir_commits(cache))
+              return error("failed to list commits for '" +
+                           std::string(dirs.list[source.dir_index].name) +
+                           "'");
+            return 0;
+          },
+          [&](commit_source &source) {
+            long long earliest_ct_for_source = LLONG_MAX;
+            if (source.find_dir_commits(cache, earliest_ct_for_source))
+              return error("failed to find commits for '" +
+                           std::string(dirs.list[source.dir_index].name) +
+                           "'");
+            earliest_ct = std::min(earliest_ct, earliest_ct_for_source);
+            return 0;
+          }))
+    return 1;
 
   // Nothing to do if we have no untranslated commits.
   if (earliest_ct == LLONG_MAX)
@@ -113,19 +158,31 @@ int translation_queue::find_dir_commits(sha1_ref head) {
   // a head that matches the commit date of the earliest other commit we're
   // handling.
   std::string since = "--since=" + std::to_string(earliest_ct);
-  for (auto &source : sources) {
-    if (source.is_repeat)
-      continue;
-    if (source.head)
-      continue;
-    if (source.find_dir_commits_to_match_and_update_head(cache, since))
-      return error("failed to list first parents limit for '" +
-                   std::string(dirs.list[source.dir_index].name) + "'");
-  }
-  return 0;
+  selected.clear();
+  for (auto &source : sources)
+    if (!source.is_repeat && !source.head)
+      selected.push_back(&source);
+  auto limit_error = [&](commit_source &source) {
+    return error("failed to list first parents limit for '" +
+                 std::string(dirs.list[source.dir_index].name) + "'");
+  };
+  return prefetch_walks(
+      selected,
+      [&](commit_source &source) {
+        return source.start_matching_dir_commits(cache, since)
+                   ? limit_error(source)
+                   : 0;
+      },
+      [&](commit_source &source) {
+        return source.find_dir_commits_to_match_and_update_head(cache, since)
+                   ? limit_error(source)
+                   : 0;
+      });
 }
 
 int translation_queue::interleave_dir_commits() {
+  trace_scope scope("phase", "interleave_dir_commits");
+
   // Merge everything in.
   struct node {
     commit_source *source;
@@ -172,6 +229,7 @@ int translation_queue::interleave_dir_commits() {
 }
 
 int translation_queue::ff_translated_dir_commits() {
+  trace_scope scope("phase", "ff_translated_dir_commits");
   while (!fparents.empty()) {
     // Note that we don't have any repeats yet.
     assert(!sources[fparents.back().index].is_repeat);
@@ -188,6 +246,7 @@ int translation_queue::ff_translated_dir_commits() {
 
 int translation_queue::find_repeat_commits_and_head(commit_source *repeat,
                                                     sha1_ref &head) {
+  trace_scope scope("phase", "find_repeat_commits_and_head");
   if (!repeat)
     return 0;
   assert(repeat->is_repeat);
@@ -254,6 +313,7 @@ int translation_queue::find_repeat_commits_and_head(commit_source *repeat,
 }
 
 int translation_queue::interleave_repeat_commits(commit_source *repeat) {
+  trace_scope scope("phase", "interleave_repeat_commits");
   if (!repeat)
     return 0;
   if (repeat->fparents.empty())
@@ -272,13 +332,22 @@ int translation_queue::interleave_repeat_commits(commit_source *repeat) {
 }
 
 int translation_queue::find_dir_commit_parents_to_translate() {
-  for (auto &source : sources) {
-    if (source.is_repeat)
-      continue;
+  trace_scope scope("phase", "find_dir_commit_parents_to_translate");
 
-    if (source.find_dir_commit_parents_to_translate(cache, parent_alloc,
-                                                    commits))
-      return 1;
-  }
-  return 0;
+  // Run the next sources' git-log walks while parsing this one.  Parsing
+  // stays here, in source order, which keeps the cache single-threaded and the
+  // results the same as a serial run.
+  std::vector<commit_source *> selected;
+  for (auto &source : sources)
+    if (!source.is_repeat)
+      selected.push_back(&source);
+  return prefetch_walks(
+      selected,
+      [&](commit_source &source) {
+        return source.start_finding_dir_commit_parents(cache);
+      },
+      [&](commit_source &source) {
+        return source.find_dir_commit_parents_to_translate(
+            cache, parent_alloc, commits);
+      });
 }
@@ -0,0 +1,17 @@
+#!/bin/sh
+# Usage: insert-invalid-sha1s.sh <svn2git> <db> <file>
+#
+# Check that 'svn2git insert' rejects each sha1 in <file>, both in the middle
+# of its input and right at the end of it.
+svn2git=$1
+db=$2
+while read -r sha1; do
+  if printf "9 %s\n" "$sha1" | "$svn2git" insert "$db" 2>/dev/null; then
+    echo "error: accepted '$sha1'"
+    exit 1
+  fi
+  if printf "9 %s" "$sha1" | "$svn2git" insert "$db" 2>/dev/null; then
+    echo "error: accepted '$sha1' at the end of the input"
+    exit 1
+  fi
+done <"$3"
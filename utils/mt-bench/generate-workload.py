@@ -0,0 +1,230 @@
+#!/usr/bin/env python3
+"""Generate a synthetic workload for 'split2mono interleave-commits'.
+
+Creates split repositories with git-fast-import and a bare monorepo that
+fetches all of them, in the shape of the LLVM split repositories:
+
+  - commits on each master carry 'git-svn-id:' trailers, with SVN revisions
+    increasing across all of the repositories in commit-date order;
+  - some commits start side branches that are merged back later;
+  - some side-branch commits are cherry-picks of earlier upstream commits,
+    keeping their 'git-svn-id:' trailers; and
+  - the first --repeat-dirs directories are marked to be translated once on
+    their own and then repeated, as for a downstream branch.
+
+The layout of the output directory is:
+
+  split/<dir>   one bare repository per directory
+  mono          bare monorepo with remotes split/<dir>
+  workload.json the parameters, heads, and which directories repeat
+
+Use run-interleave-benchmark.py to time translating it.
+"""
+
+import argparse
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+
+SVN_UUID = '91177308-0d34-0410-b5e6-96231b3b80d8'
+
+
+class SplitRepo:
+    """Writes a git-fast-import stream for one split repository."""
+
+    def __init__(self, name, path, num_files):
+        self.name = name
+        self.path = path
+        self.num_files = num_files
+        self.stream = None
+        self.process = None
+        self.next_mark = 1
+        self.master = None
+        self.side = None
+        self.side_remaining = 0
+        self.upstream = []
+        self.num_commits = 0
+
+    def start(self):
+        subprocess.check_call(['git', 'init', '-q', '--bare', self.path])
+        self.process = subprocess.Popen(
+            ['git', '-C', self.path, 'fast-import', '--quiet',
+             '--done'], stdin=subprocess.PIPE)
+        self.stream = self.process.stdin
+
+    def finish(self):
+        self.stream.write(b'done\n')
+        self.stream.close()
+        if self.process.wait():
+            sys.exit('error: git-fast-import failed for ' + self.name)
+
+    def write_commit(self, ref, parents, ct, message, path, content):
+        mark = self.next_mark
+        self.next_mark += 1
+        ident = 'mt-bench <mt-bench@apple-llvm> %d +0000' % ct
+        data = message.encode()
+        blob = content.encode()
+        out = self.stream
+        out.write(('commit %s\nmark :%d\n' % (ref, mark)).encode())
+        out.write(('author %s\ncommitter %s\n' % (ident, ident)).encode())
+        out.write(b'data %d\n' % len(data) + data + b'\n')
+        if parents:
+            out.write(b'from :%d\n' % parents[0])
+        for parent in parents[1:]:
+            out.write(b'merge :%d\n' % parent)
+        out.write(('M 100644 inline %s\n' % path).encode())
+        out.write(b'data %d\n' % len(blob) + blob + b'\n\n')
+        self.num_commits += 1
+        return mark
+
+    def pick_path(self, rng):
+        index = rng.randrange(self.num_files)
+        return 'd%d/f%d' % (index % 16, index)
+
+
+def git_svn_id(dir_name, rev):
+    return 'git-svn-id: https://llvm.org/svn/llvm-project/%s/trunk@%d %s' % (
+        dir_name, rev, SVN_UUID)
+
+
+def generate(args):
+    rng = random.Random(args.seed)
+    if os.path.exists(args.output):
+        if not args.force:
+            sys.exit('error: %s already exists; use --force' % args.output)
+        shutil.rmtree(args.output)
+    os.makedirs(os.path.join(args.output, 'split'))
+
+    repos = []
+    for i in range(args.repos):
+        name = 'dir%d' % i
+        repo = SplitRepo(name, os.path.join(args.output, 'split', name),
+                         args.files)
+        repo.start()
+        repos.append(repo)
+
+    # Spread the commits over the repositories, mostly to the first few, as
+    # the LLVM repositories are.
+    weights = [1.0 / (i + 1) for i in range(args.repos)]
+    rev = 0
+    for i in range(args.commits):
+        ct = args.start_ct + i * 60
+        repo = rng.choices(repos, weights)[0]
+        path = repo.pick_path(rng)
+
+        # Finish a side branch by merging it back.
+        if repo.side is not None and repo.side_remaining == 0:
+            message = "Merge branch 'side' into master\n"
+            repo.master = repo.write_commit(
+                'refs/heads/master', [repo.master, repo.side], ct, message,
+                path, 'merge %d\n' % i)
+            repo.side = None
+            continue
+
+        # Maybe start a side branch from master.
+        if (repo.side is None and repo.master is not None and
+                rng.random() < args.merge_density):
+            repo.side = repo.master
+            repo.side_remaining = rng.randint(1, args.max_side_length)
+
+        if repo.side is not None and rng.random() < 0.5:
+            repo.side_remaining -= 1
+            if repo.upstream and rng.random() < args.cherry_pick_density:
+                # Cherry-pick an earlier upstream commit, trailer and all.
+                message, path, content = rng.choice(repo.upstream)
+            else:
+                message = 'side: change %s\n' % path
+                content = 'side %d\n' % i
+            repo.side = repo.write_commit(
+                'refs/heads/side', [repo.side], ct, message, path, content)
+            continue
+
+        rev += 1
+        content = 'r%d\n' % rev
+        message = 'r%d: change %s\n\n%s\n' % (rev, path,
+                                            git_svn_id(repo.name, rev))
+        parents = [repo.master] if repo.master is not None else []
+        repo.master = repo.write_commit('refs/heads/master', parents, ct,
+                                        message, path, content)
+        repo.upstream.append((message, path, content))
+        if len(repo.upstream) > 1000:
+            del repo.upstream[:500]
+
+    for repo in repos:
+        if repo.side is not None:
+            ct = args.start_ct + args.commits * 60
+            repo.master = repo.write_commit(
+                'refs/heads/master', [repo.master, repo.side], ct,
+                "Merge branch 'side' into master\n", repo.pick_path(rng),
+                'final merge\n')
+        repo.finish()
+
+    # Fetch everything into a monorepo.
+    mono = os.path.join(args.output, 'mono')
+    subprocess.check_call(['git', 'init', '-q', '--bare', mono])
+    heads = {}
+    for repo in repos:
+        if not repo.num_commits:
+            continue
+        subprocess.check_call(['git', '-C', mono, 'remote', 'add',
+                               'split/' + repo.name,
+                               os.path.abspath(repo.path)])
+        subprocess.check_call(['git', '-C', mono, 'fetch', '-q',
+                               'split/' + repo.name])
+        heads[repo.name] = subprocess.check_output(
+            ['git', '-C', mono, 'rev-parse',
+             'split/%s/master' % repo.name]).decode().strip()
+
+    repeat_dirs = sorted(heads)[:args.repeat_dirs]
+    workload = {
+        'commits': args.commits,
+        'repos': args.repos,
+        'merge_density': args.merge_density,
+        'cherry_pick_density': args.cherry_pick_density,
+        'seed': args.seed,
+        'heads': heads,
+        'repeat_dirs': repeat_dirs,
+    }
+    with open(os.path.join(args.output, 'workload.json'), 'w') as f:
+        json.dump(workload, f, indent=2, sort_keys=True)
+        f.write('\n')
+    print('generated %d commits in %d repositories at %s' %
+          (sum(r.num_commits for r in repos), len(heads), args.output))
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Generate split repositories to benchmark split2mono.')
+    parser.add_argument('output', help='directory to create')
+    parser.add_argument('--commits', type=int, default=10000,
+                        help='total commits across repositories')
+    parser.add_argument('--repos', type=int, default=8,
+                        help='number of split repositories')
+    parser.add_argument('--files', type=int, default=256,
+                        help='files per repository')
+    parser.add_argument('--merge-density', type=float, default=0.02,
+                        help='chance that a commit starts a side branch')
+    parser.add_argument('--max-side-length', type=int, default=8,
+                        help='most commits on a side branch')
+    parser.add_argument('--cherry-pick-density', type=float, default=0.3,
+                        help='chance that a side commit is a cherry-pick')
+    parser.add_argument('--repeat-dirs', type=int, default=0,
+                        help='directories to translate first and repeat')
+    parser.add_argument('--start-ct', type=int, default=1500000000,
+                        help='commit time of the first commit')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--force', action='store_true',
+                        help='replace the output directory')
+    args = parser.parse_args()
+    if args.repos < 1 or args.commits < 1:
+        parser.error('need at least one repository and commit')
+    if args.repeat_dirs >= args.repos:
+        parser.error('--repeat-dirs must leave at least one directory')
+    generate(args)
+
+
+if __name__ == '__main__':
+    main()
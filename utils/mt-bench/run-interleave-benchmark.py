@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+"""Time 'split2mono interleave-commits' on a generated workload.
+
+Copies the monorepo from generate-workload.py, creates fresh databases, and
+translates every split repository in one call to interleave-commits.  If the
+workload has repeat directories, those are translated first, untimed, into
+their own branch, which the timed run then repeats.
+
+Reports translated commits per second, the peak RSS of split2mono, and how
+many git subprocesses it spawned (from MT_GIT_STATS).  Pass --json to append
+a machine-readable line to a file, for tracking throughput across changes.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+ZERO_SHA1 = '0' * 40
+
+
+def build_tools(repo_root, out_dir):
+    subprocess.check_call(['make', '-s', '-C', os.path.join(repo_root, 'src'),
+                           'D=' + out_dir])
+
+
+def peak_rss_kib(pid, stop, result):
+    """Poll VmHWM for pid until stop is set, keeping the highest."""
+    path = '/proc/%d/status' % pid
+    while not stop.is_set():
+        try:
+            with open(path) as f:
+                for line in f:
+                    if line.startswith('VmHWM:'):
+                        result[0] = max(result[0], int(line.split()[1]))
+        except (IOError, OSError, ValueError):
+            return
+        stop.wait(0.05)
+
+
+def run_split2mono(split2mono, mono, args, env):
+    """Run split2mono and return (stdout, stderr, seconds, peak RSS KiB)."""
+    start = time.monotonic()
+    process = subprocess.Popen([split2mono, '-C', mono] + args,
+                               stdout=subprocess.PIPE,
+                               stderr=subprocess.PIPE, env=env)
+    peak = [0]
+    stop = threading.Event()
+    poller = threading.Thread(target=peak_rss_kib,
+                              args=(process.pid, stop, peak))
+    poller.start()
+
+    # Read both pipes without blocking either, then reap the child with
+    # wait4 for its rusage; ru_maxrss covers platforms without /proc.
+    output = {}
+
+    def drain(name, stream):
+        output[name] = stream.read()
+    readers = [threading.Thread(target=drain, args=(n, s)) for n, s in
+               (('out', process.stdout), ('err', process.stderr))]
+    for reader in readers:
+        reader.start()
+    for reader in readers:
+        reader.join()
+    _, status, rusage = os.wait4(process.pid, 0)
+    process.returncode = os.waitstatus_to_exitcode(status)
+    seconds = time.monotonic() - start
+    stop.set()
+    poller.join()
+
+    maxrss = rusage.ru_maxrss
+    if sys.platform == 'darwin':
+        maxrss //= 1024
+    stderr = output['err'].decode(errors='replace')
+    if process.returncode:
+        sys.stderr.write(stderr)
+        sys.exit('error: split2mono failed with status %d' %
+                 process.returncode)
+    return output['out'].decode(), stderr, seconds, max(peak[0], maxrss)
+
+
+def parse_git_stats(stderr):
+    """Return {subcommand: calls} from MT_GIT_STATS output."""
+    calls = {}
+    for line in stderr.splitlines():
+        match = re.match(r'git-stats: (\S+)\s+(\d+)\s', line)
+        if match:
+            calls[match.group(1)] = int(match.group(2))
+    return calls
+
+
+def parse_translated_commits(stderr):
+    """Return how many split commits interleave-commits translated, from the
+    last progress line: first-parent commits interleaved plus side commits.
+    Repeated commits are fast-forwarded, not translated, so they don't count;
+    neither do the merges it generates.
+    """
+    translated = None
+    for line in stderr.splitlines():
+        match = re.match(r'\s*(\d+) / \d+ interleaved\s+(\d+) / \d+ side\s',
+                         line)
+        if match:
+            translated = int(match.group(1)) + int(match.group(2))
+    if translated is None:
+        sys.exit('error: no progress from interleave-commits')
+    return translated
+
+
+def run_once(args, workload, split2mono, scratch):
+    mono = os.path.join(scratch, 'mono')
+    shutil.copytree(os.path.join(args.workload, 'mono'), mono, symlinks=True)
+    svn2git_db = os.path.join(scratch, 'svn2git')
+    split2mono_db = os.path.join(scratch, 'split2mono')
+    os.mkdir(split2mono_db)
+    subprocess.check_call([os.path.join(args.bin_dir, 'svn2git'), 'create',
+                           svn2git_db])
+    subprocess.check_call([split2mono, 'create', split2mono_db, 'bench'],
+                          stdout=subprocess.DEVNULL)
+
+    env = dict(os.environ)
+    env['MT_OBJECT_STORE'] = args.object_store
+    env['MT_PIPELINE'] = '1' if args.pipeline else '0'
+    heads = workload['heads']
+    repeat_dirs = workload['repeat_dirs']
+    db_args = ['interleave-commits', split2mono_db, svn2git_db]
+
+    # Translate the repeated directories first.  The timed run reads this
+    # branch from the monorepo, so the memory store can't be used here.
+    repeat_head = None
+    if repeat_dirs:
+        if args.object_store == 'memory':
+            env['MT_OBJECT_STORE'] = 'batch'
+        out, _, _, _ = run_split2mono(
+            split2mono, mono,
+            db_args + [ZERO_SHA1] + [ZERO_SHA1 + ':' + d
+                                     for d in repeat_dirs] +
+            ['--'] + ['%s:%s' % (heads[d], d) for d in repeat_dirs], env)
+        repeat_head = out.split()[0]
+        env['MT_OBJECT_STORE'] = args.object_store
+
+    dirs = [d for d in sorted(heads) if d not in repeat_dirs]
+    call = db_args + [ZERO_SHA1] + [ZERO_SHA1 + ':' + d for d in dirs]
+    goals = ['%s:%s' % (heads[d], d) for d in dirs]
+    if repeat_head:
+        call += [ZERO_SHA1 + ':%'] + ['%:' + d for d in repeat_dirs]
+        goals.append(repeat_head + ':%')
+    env['MT_GIT_STATS'] = '1'
+    out, stderr, seconds, rss = run_split2mono(split2mono, mono,
+                                               call + ['--'] + goals, env)
+
+    commits = parse_translated_commits(stderr)
+    calls = parse_git_stats(stderr)
+    return {
+        'commits': commits,
+        'seconds': round(seconds, 3),
+        'commits_per_second': round(commits / seconds, 1) if seconds else 0,
+        'peak_rss_kib': rss,
+        'git_calls': sum(calls.values()),
+        'git_calls_by_subcommand': calls,
+    }
+
+
+def main():
+    parser = argparse.ArgumentParser(
+        description='Benchmark split2mono interleave-commits.')
+    parser.add_argument('workload',
+                        help='directory from generate-workload.py')
+    parser.add_argument('--bin-dir',
+                        help='directory with split2mono and svn2git '
+                        '(default: build them)')
+    parser.add_argument('--object-store', default='subprocess',
+                        choices=['subprocess', 'batch', 'memory'])
+    parser.add_argument('--pipeline', action='store_true',
+                        help='set MT_PIPELINE=1')
+    parser.add_argument('--repeat', type=int, default=1,
+                        help='runs to take the best of')
+    parser.add_argument('--json', metavar='FILE',
+                        help='append the result as a JSON line')
+    parser.add_argument('--label', default='',
+                        help='label to record with the result')
+    args = parser.parse_args()
+
+    with open(os.path.join(args.workload, 'workload.json')) as f:
+        workload = json.load(f)
+
+    with tempfile.TemporaryDirectory(prefix='mt-bench.') as scratch:
+        if not args.bin_dir:
+            args.bin_dir = os.path.join(scratch, 'bin')
+            repo_root = os.path.dirname(os.path.dirname(
+                os.path.dirname(os.path.abspath(__file__))))
+            build_tools(repo_root, args.bin_dir)
+        split2mono = os.path.join(args.bin_dir, 'split2mono')
+
+        best = None
+        for i in range(args.repeat):
+            run_dir = os.path.join(scratch, 'run%d' % i)
+            os.mkdir(run_dir)
+            result = run_once(args, workload, split2mono, run_dir)
+            shutil.rmtree(run_dir)
+            if best is None or result['seconds'] < best['seconds']:
+                best = result
+
+    print('commits:      %d' % best['commits'])
+    print('seconds:      %.3f' % best['seconds'])
+    print('commits/s:    %.1f' % best['commits_per_second'])
+    print('peak RSS:     %.1f MiB' % (best['peak_rss_kib'] / 1024.0))
+    print('git calls:    %d' % best['git_calls'])
+    for name, calls in sorted(best['git_calls_by_subcommand'].items()):
+        print('  %-12s %d' % (name, calls))
+
+    if args.json:
+        best.update({
+            'label': args.label,
+            'object_store': args.object_store,
+            'pipeline': args.pipeline,
+            'workload': {k: workload[k] for k in
+                         ('commits', 'repos', 'merge_density',
+                          'cherry_pick_density', 'seed')},
+            'repeat_dirs': len(workload['repeat_dirs']),
+        })
+        with open(args.json, 'a') as f:
+            f.write(json.dumps(best, sort_keys=True) + '\n')
+
+
+if __name__ == '__main__':
+    main()